@@ -0,0 +1,56 @@
+// shared by the benchmarks: timing and the JSON they report in. each
+// benchmark prints one object on stdout, progress goes to stderr, and
+// `make bench` gathers the objects into one array
+#ifndef BENCH_H
+#define BENCH_H
+
+#include <algorithm>
+#include <chrono>
+#include <cstdio>
+#include <string>
+#include <vector>
+
+inline double now_ns() {
+  return std::chrono::duration<double, std::nano>(std::chrono::steady_clock::now().time_since_epoch()).count();
+}
+
+class BenchReport {
+public:
+  explicit BenchReport(std::string suite) : suite_(std::move(suite)) {}
+
+  // one figure: a throughput, a per-item cost...
+  void value(const std::string &name, double v, const char *unit) {
+    entries_.push_back("{\"name\":\"" + name + "\",\"unit\":\"" + unit + "\",\"value\":" + num(v) + "}");
+    fprintf(stderr, "%-40s %12.2f %s\n", name.c_str(), v, unit);
+  }
+
+  // per-operation timings in ns: median, p99, min, max and how many
+  void samples(const std::string &name, std::vector<double> ns) {
+    if (ns.empty()) return;
+    std::sort(ns.begin(), ns.end());
+    double median = ns[ns.size() / 2], p99 = ns[std::min(ns.size() - 1, ns.size() * 99 / 100)];
+    entries_.push_back("{\"name\":\"" + name + "\",\"unit\":\"ns\",\"median\":" + num(median) +
+                       ",\"p99\":" + num(p99) + ",\"min\":" + num(ns.front()) + ",\"max\":" + num(ns.back()) +
+                       ",\"samples\":" + std::to_string(ns.size()) + "}");
+    fprintf(stderr, "%-40s median %10.0f ns  p99 %10.0f ns\n", name.c_str(), median, p99);
+  }
+
+  void print() const {
+    printf("{\"suite\":\"%s\",\"results\":[", suite_.c_str());
+    for (size_t i = 0; i < entries_.size(); i++) printf("%s\n%s", i ? "," : "", entries_[i].c_str());
+    printf("\n]}\n");
+    fflush(stdout);
+  }
+
+private:
+  static std::string num(double v) {
+    char buf[32];
+    snprintf(buf, sizeof(buf), "%.3f", v);
+    return buf;
+  }
+
+  std::string suite_;
+  std::vector<std::string> entries_;
+};
+
+#endif
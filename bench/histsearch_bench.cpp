@@ -0,0 +1,62 @@
+// HistoryIndex build and query latency over a generated one million line
+// history, about a third of it repeats. run with `make bench`
+#include "bench.h"
+#include "histsearch.h"
+#include <algorithm>
+#include <chrono>
+#include <cstdio>
+#include <random>
+#include <string>
+#include <vector>
+using namespace std;
+
+static double ms_since(chrono::steady_clock::time_point t0) {
+  return chrono::duration<double, milli>(chrono::steady_clock::now() - t0).count();
+}
+
+int main() {
+  const size_t lines = 1000000;
+  const char *tools[] = {"git commit -m", "git checkout", "docker run --rm", "kubectl get pods -n",
+                         "make -j8", "ssh deploy@", "grep -rn", "cd ~/src/", "vim", "cargo test --package",
+                         "python3 manage.py", "ls -la", "tail -f /var/log/", "curl -s https://api.example.com/"};
+  const char *words[] = {"alpha", "build", "cache", "deploy", "engine", "fixture", "gateway", "handler",
+                         "index", "journal", "kernel", "loader", "metrics", "network", "oracle", "parser"};
+  mt19937 rng(42);
+  vector<string> history;
+  history.reserve(lines);
+  for (size_t i = 0; i < lines; i++) {
+    if (i > 1000 && rng() % 3 == 0) {
+      history.push_back(history[i - 1 - rng() % 1000]); // rerun something recent
+      continue;
+    }
+    string cmd = tools[rng() % size(tools)];
+    cmd += " ";
+    cmd += words[rng() % size(words)];
+    cmd += "-" + to_string(rng() % 100000);
+    if (rng() % 2) cmd += string(" ") + words[rng() % size(words)];
+    history.push_back(move(cmd));
+  }
+
+  BenchReport report("histsearch");
+  HistoryIndex index;
+  auto t0 = chrono::steady_clock::now();
+  for (size_t i = 0; i < history.size(); i++) index.add(history[i], i + 1);
+  double build = ms_since(t0);
+  report.value("build", build, "ms");
+  report.value("build/per_line", build * 1e6 / lines, "ns");
+  report.value("distinct", index.distinct(), "commands");
+
+  const char *queries[] = {"git", "docker deploy", "kubectl pods metrics", "gateway-123", "ls",
+                           "dockr deplyo", "manage parser 42"};
+  for (const char *q : queries) {
+    vector<double> times;
+    for (int r = 0; r < 21; r++) {
+      auto t1 = chrono::steady_clock::now();
+      index.search(q, 20);
+      times.push_back(ms_since(t1) * 1e6);
+    }
+    report.samples(string("query/") + q, move(times));
+  }
+  report.print();
+  return 0;
+}
@@ -0,0 +1,457 @@
+// the shell's hot paths: parse() throughput, check() and find_in_path()
+// latency, glob expansion over big directories, $(...) of a builtin and of
+// a program, how many writes a chatty builtin makes, what one command and
+// an N-stage pipeline cost to start, and how fast bytes get through the
+// pipes it sets up (plain, resized and metered). run with `make bench`
+#include "bench.h"
+#include "executor.h"
+#include "glob.h"
+#include "launcher.h"
+#include "parser.h"
+#include "pipes.h"
+#include "script_cache.h"
+#include "utils.h"
+#include "vars.h"
+#include <cerrno>
+#include <cstdlib>
+#include <cstring>
+#include <fcntl.h>
+#include <string>
+#include <sys/stat.h>
+#include <sys/time.h>
+#include <sys/wait.h>
+#include <unistd.h>
+#include <vector>
+using namespace std;
+
+static string repeat_to(const string &line, size_t bytes) {
+  string out;
+  out.reserve(bytes + line.size());
+  while (out.size() < bytes) out += line;
+  return out;
+}
+
+static void bench_parse(BenchReport &report) {
+  const size_t size = 8 << 20;
+  string long_line;
+  for (int i = 0; long_line.size() < size; i++) long_line += "arg" + to_string(i) + " ";
+
+  auto run = [&](const char *name, const string &input) {
+    const int rounds = 5;
+    size_t tokens = 0;
+    double t0 = now_ns();
+    for (int r = 0; r < rounds; r++) tokens += parse(input).tokens.size();
+    double sec = (now_ns() - t0) / 1e9;
+    if (tokens == 0) fprintf(stderr, "parse/%s: no tokens\n", name);
+    report.value(string("parse/") + name, rounds * input.size() / sec / 1e6, "MB/s");
+  };
+  run("short", repeat_to("ls -la /tmp | grep foo > out.txt; echo done\n", size));
+  run("quoted", repeat_to("echo 'single quoted words here' \"double \\\"esc\\\" $HOME\" back\\ slash | cat\n", size));
+  run("long", long_line);
+}
+
+// check() alone: the lines are parsed up front, outside the timing
+static void bench_check(BenchReport &report) {
+  string words;
+  for (int i = 0; i < 1000; i++) words += " arg" + to_string(i);
+  const pair<const char *, string> lines[] = {
+    {"short", "ls -la /tmp | grep foo > out.txt; echo done"},
+    {"long", "echo" + words},
+  };
+  for (const auto &[name, text] : lines) {
+    const size_t n = 20000;
+    vector<ParsedLine> parsed;
+    parsed.reserve(n);
+    for (size_t i = 0; i < n; i++) parsed.push_back(parse(text));
+    vector<double> ns;
+    ns.reserve(n);
+    for (ParsedLine &p : parsed) {
+      double t0 = now_ns();
+      CommandLine line = check(move(p));
+      ns.push_back(now_ns() - t0);
+    }
+    report.samples(string("check/") + name, move(ns));
+  }
+}
+
+// PATHs of 5 to 50 dirs with the command in the last one: cold is a fresh
+// hash (the whole walk), warm a hash hit, miss a name that is nowhere
+static void bench_find_in_path(BenchReport &report) {
+  char root[] = "/tmp/myshell-bench.XXXXXX";
+  if (!mkdtemp(root)) {
+    perror("mkdtemp");
+    return;
+  }
+  const int max_dirs = 50;
+  vector<string> dirs;
+  for (int i = 0; i < max_dirs; i++) {
+    dirs.push_back(string(root) + "/d" + to_string(i));
+    mkdir(dirs.back().c_str(), 0755);
+    // t<i> lives in d<i> only
+    int fd = open((dirs.back() + "/t" + to_string(i)).c_str(), O_WRONLY | O_CREAT | O_CLOEXEC, 0755);
+    if (fd >= 0) close(fd);
+  }
+
+  string saved = var_get("PATH") ? var_get("PATH") : "";
+  for (int k : {5, 10, 25, 50}) {
+    string path;
+    for (int i = 0; i < k; i++) path += (i ? ":" : "") + dirs[i];
+    var_set("PATH", path);
+    string target = "t" + to_string(k - 1);
+    const int n = 2000;
+
+    vector<double> cold, warm, miss;
+    for (int i = 0; i < n; i++) {
+      hash_reset();
+      double t0 = now_ns();
+      find_in_path(target);
+      cold.push_back(now_ns() - t0);
+    }
+    for (int i = 0; i < n; i++) {
+      double t0 = now_ns();
+      find_in_path(target);
+      warm.push_back(now_ns() - t0);
+    }
+    for (int i = 0; i < n; i++) {
+      double t0 = now_ns();
+      find_in_path("no-such-command");
+      miss.push_back(now_ns() - t0);
+    }
+    string dirs_tag = "/dirs=" + to_string(k);
+    report.samples("find_in_path/cold" + dirs_tag, move(cold));
+    report.samples("find_in_path/warm" + dirs_tag, move(warm));
+    report.samples("find_in_path/miss" + dirs_tag, move(miss));
+  }
+  var_set("PATH", saved);
+  hash_reset();
+
+  for (int i = 0; i < max_dirs; i++) {
+    unlink((dirs[i] + "/t" + to_string(i)).c_str());
+    rmdir(dirs[i].c_str());
+  }
+  rmdir(root);
+}
+
+// a flat directory of 100k files and a tree of 64 x 1000 under one root.
+// cold drops the listing cache first, warm reuses it (the directories are
+// backdated, fresh ones aren't cached)
+static void bench_glob(BenchReport &report) {
+  char root[] = "/tmp/myshell-glob.XXXXXX";
+  if (!mkdtemp(root)) {
+    perror("mkdtemp");
+    return;
+  }
+  string flat = string(root) + "/flat", tree = string(root) + "/tree";
+  vector<string> dirs = {flat};
+  mkdir(flat.c_str(), 0755);
+  mkdir(tree.c_str(), 0755);
+  auto touch = [](const string &path) {
+    int fd = open(path.c_str(), O_WRONLY | O_CREAT | O_CLOEXEC, 0644);
+    if (fd >= 0) close(fd);
+  };
+  for (int i = 0; i < 100000; i++) touch(flat + "/f" + to_string(i) + (i % 10 ? ".txt" : ".log"));
+  for (int d = 0; d < 64; d++) {
+    string dir = tree + "/d" + to_string(d) + "/sub";
+    mkdir(dir.substr(0, dir.size() - 4).c_str(), 0755);
+    mkdir(dir.c_str(), 0755);
+    dirs.push_back(dir.substr(0, dir.size() - 4));
+    dirs.push_back(dir);
+    for (int i = 0; i < 1000; i++) touch(dir + "/f" + to_string(i) + (i % 10 ? ".h" : ".cpp"));
+  }
+  dirs.push_back(tree);
+  struct timeval old[2] = {{1000000000, 0}, {1000000000, 0}};
+  for (const string &dir : dirs) utimes(dir.c_str(), old);
+
+  const pair<const char *, string> patterns[] = {
+    {"flat_suffix", flat + "/*.log"},
+    {"flat_class", flat + "/f[0-9]*7.t?t"},
+    {"recursive", tree + "/**/*.cpp"},
+  };
+  for (const auto &[name, pattern] : patterns) {
+    const int n = 10;
+    size_t matches = 0;
+    vector<double> cold, warm;
+    for (int i = 0; i < n; i++) {
+      glob_cache_clear();
+      vector<string> out;
+      double t0 = now_ns();
+      glob_expand(pattern, out);
+      cold.push_back(now_ns() - t0);
+      matches = out.size();
+    }
+    for (int i = 0; i < n; i++) {
+      vector<string> out;
+      double t0 = now_ns();
+      glob_expand(pattern, out);
+      warm.push_back(now_ns() - t0);
+    }
+    if (matches == 0) fprintf(stderr, "glob/%s: no matches\n", name);
+    report.samples(string("glob/") + name + "/cold", move(cold));
+    report.samples(string("glob/") + name + "/warm", move(warm));
+  }
+  glob_cache_clear();
+
+  string rm = string("rm -rf ") + root;
+  if (system(rm.c_str()) != 0) fprintf(stderr, "glob: couldn't remove %s\n", root);
+}
+
+// a 20k line provisioning-style script: parse + check of every line
+// against mapping its entry back in from the compiled script cache
+static void bench_script_cache(BenchReport &report) {
+  char root[] = "/tmp/myshell-cache.XXXXXX";
+  if (!mkdtemp(root)) {
+    perror("mkdtemp");
+    return;
+  }
+  var_set("XDG_CACHE_HOME", root);
+  string path = string(root) + "/provision.sh";
+  vector<string> lines;
+  for (int i = 0; i < 20000; i++) {
+    switch (i % 4) {
+    case 0: lines.push_back("mkdir -p \"$ROOT/srv/app" + to_string(i) + "\" && chmod 755 \"$ROOT/srv/app" + to_string(i) + "\""); break;
+    case 1: lines.push_back("echo 'setting up unit " + to_string(i) + "' >> \"$LOG\" 2>&1"); break;
+    case 2: lines.push_back("if test -f /etc/conf" + to_string(i) + "; then cp /etc/conf" + to_string(i) + " /tmp/x; fi"); break;
+    case 3: lines.push_back("NAME=unit" + to_string(i) + " install -m 644 src/*.conf \"$DEST\" | tee -a out.log"); break;
+    }
+  }
+  string text;
+  for (const string &l : lines) text += l + '\n';
+  int fd = open(path.c_str(), O_WRONLY | O_CREAT | O_TRUNC | O_CLOEXEC, 0644);
+  if (fd < 0 || write(fd, text.data(), text.size()) != ssize_t(text.size())) perror("write");
+  if (fd >= 0) close(fd);
+  struct timeval old[2] = {{1000000000, 0}, {1000000000, 0}};
+  utimes(path.c_str(), old); // fresh files aren't cached
+  struct stat st;
+  stat(path.c_str(), &st);
+
+  const int n = 10;
+  vector<double> compile, load;
+  CompiledScript script;
+  for (int r = 0; r < n; r++) {
+    double t0 = now_ns();
+    CompiledScript fresh;
+    for (const string &l : lines) {
+      fresh.lines.push_back(check(parse(l)));
+      fresh.last.push_back(false);
+    }
+    compile.push_back(now_ns() - t0);
+    script = move(fresh);
+  }
+  double t0 = now_ns();
+  script_cache_store(st, script);
+  report.value("script_cache/store", (now_ns() - t0) / 1e6, "ms");
+  for (int r = 0; r < n; r++) {
+    CompiledScript hit;
+    double t0 = now_ns();
+    bool ok = script_cache_load(st, hit);
+    load.push_back(now_ns() - t0);
+    if (!ok || hit.lines.size() != lines.size()) fprintf(stderr, "script_cache: no hit\n");
+  }
+  report.samples("script_cache/compile", move(compile));
+  report.samples("script_cache/load", move(load));
+
+  string rm = string("rm -rf ") + root;
+  if (system(rm.c_str()) != 0) fprintf(stderr, "script_cache: couldn't remove %s\n", root);
+}
+
+// one /bin/true, start to reaped: plain fork+exec as the baseline, then
+// spawn_process(), then the shell's whole path from the line on
+static void bench_command(BenchReport &report) {
+  const int n = 500;
+  char *const argv[] = {const_cast<char *>("/bin/true"), nullptr};
+
+  vector<double> ns;
+  for (int i = 0; i < n; i++) {
+    double t0 = now_ns();
+    pid_t pid = fork();
+    if (pid == 0) {
+      execv(argv[0], argv);
+      _exit(127);
+    }
+    waitpid(pid, nullptr, 0);
+    ns.push_back(now_ns() - t0);
+  }
+  report.samples("command/fork_exec_wait", move(ns));
+
+  ns.clear();
+  for (int i = 0; i < n; i++) {
+    SpawnSpec spec;
+    spec.path = argv[0];
+    spec.argv = argv;
+    double t0 = now_ns();
+    pid_t pid = spawn_process(spec);
+    waitpid(pid, nullptr, 0);
+    ns.push_back(now_ns() - t0);
+  }
+  report.samples("command/spawn_wait", move(ns));
+
+  ns.clear();
+  for (int i = 0; i < n; i++) {
+    double t0 = now_ns();
+    CommandLine line = check(parse("/bin/true"));
+    execute_pipeline(line, line.pipelines[0]);
+    ns.push_back(now_ns() - t0);
+  }
+  report.samples("command/shell_line", move(ns));
+}
+
+// $(pwd) runs in the shell; $(/bin/pwd) is a spawn, a pipe and a wait
+static void bench_substitution(BenchReport &report) {
+  const pair<const char *, const char *> cases[] = {
+    {"builtin", "pwd"}, {"program", "/bin/pwd"}, {"pipeline", "echo a | cat"}};
+  for (const auto &[name, text] : cases) {
+    const int n = 500;
+    vector<double> ns;
+    for (int i = 0; i < n; i++) {
+      double t0 = now_ns();
+      string out = command_output(text);
+      ns.push_back(now_ns() - t0);
+      if (out.empty()) fprintf(stderr, "substitution/%s: no output\n", name);
+    }
+    report.samples(string("substitution/") + name, move(ns));
+  }
+}
+
+// write(2)s so far, from /proc/self/io
+static long write_calls() {
+  FILE *f = fopen("/proc/self/io", "re");
+  if (!f) return 0;
+  char key[32];
+  long v, calls = 0;
+  while (fscanf(f, "%31[^:]: %ld\n", key, &v) == 2) {
+    if (strcmp(key, "syscw") == 0) calls = v;
+  }
+  fclose(f);
+  return calls;
+}
+
+// a builtin printing many pieces: its time, and how many writes it takes
+static void bench_builtin_output(BenchReport &report) {
+  string text = "echo";
+  for (int i = 0; i < 1000; i++) text += " word" + to_string(i);
+  text += " > /dev/null";
+  CommandLine line = check(parse(text));
+  const int n = 500;
+  vector<double> ns;
+  long w0 = write_calls();
+  for (int i = 0; i < n; i++) {
+    double t0 = now_ns();
+    execute_line(line, false);
+    ns.push_back(now_ns() - t0);
+  }
+  report.value("builtin_output/echo_1000_words/writes", double(write_calls() - w0) / n, "calls");
+  report.samples("builtin_output/echo_1000_words", move(ns));
+}
+
+// a 100k-iteration loop of builtins, compiled once: what an iteration
+// costs once the line is parsed
+static void bench_loop(BenchReport &report) {
+  const int iterations = 100000;
+  const pair<const char *, string> cases[] = {
+    {"true", "for i in $(seq " + to_string(iterations) + "); do true; done"},
+    {"case", "for i in $(seq " + to_string(iterations) + "); do case $i in *0) x=$i;; *) true;; esac; done"},
+  };
+  for (const auto &[name, text] : cases) {
+    double t0 = now_ns();
+    execute_line(check(parse(text)), false);
+    double ms = (now_ns() - t0) / 1e6;
+    report.value(string("loop/") + name + "/total", ms, "ms");
+    report.value(string("loop/") + name + "/iteration", ms * 1e6 / iterations, "ns");
+  }
+}
+
+static void reap(const LaunchedPipeline &job) {
+  for (pid_t pid : job.pids) waitpid(pid, nullptr, 0);
+}
+
+// launch_pipeline() until every stage of a cat chain fed /dev/null is
+// started, not counting their run. per stage it should stay flat all the
+// way to 1000 stages
+static void bench_pipeline_setup(BenchReport &report) {
+  PipelineIO io;
+  io.in = open("/dev/null", O_RDONLY | O_CLOEXEC);
+  io.out = open("/dev/null", O_WRONLY | O_CLOEXEC);
+  for (int stages : {2, 8, 32, 128, 512, 1000}) {
+    string text = "cat";
+    for (int i = 1; i < stages; i++) text += " | cat";
+    CommandLine line = check(parse(text));
+
+    int rounds = max(3, 512 / stages);
+    vector<double> ns;
+    for (int r = 0; r < rounds; r++) {
+      double t0 = now_ns();
+      LaunchedPipeline job = launch_pipeline(line, line.pipelines[0], -1, io);
+      ns.push_back(now_ns() - t0);
+      reap(job);
+    }
+    sort(ns.begin(), ns.end());
+    report.value("pipeline_setup/stages=" + to_string(stages) + "/per_stage", ns[ns.size() / 2] / stages / 1e3, "us");
+    report.samples("pipeline_setup/stages=" + to_string(stages), move(ns));
+  }
+  close(io.in);
+  close(io.out);
+}
+
+// bytes from head through some cats into us, with default pipes, 1M ones
+// and through the meter's splice relay
+static void bench_pipeline_throughput(BenchReport &report) {
+  const size_t bytes = size_t(512) << 20;
+  const pair<const char *, const char *> modes[] = {{"", ""}, {"/pipe=1M", "PIPE_SIZE=1M"}, {"/metered", "PIPE_METER=1"}};
+  for (auto [tag, mode] : modes)
+  for (int cats : {1, 3}) {
+    var_unset("PIPE_SIZE");
+    var_unset("PIPE_METER");
+    if (*mode) var_assign(mode);
+    string text = "head -c " + to_string(bytes) + " /dev/zero";
+    for (int i = 0; i < cats; i++) text += " | cat";
+    CommandLine line = check(parse(text));
+
+    int fds[2];
+    if (pipe2(fds, O_CLOEXEC) < 0) {
+      perror("pipe2");
+      return;
+    }
+    PipelineIO io;
+    io.out = fds[1];
+    double t0 = now_ns();
+    LaunchedPipeline job = launch_pipeline(line, line.pipelines[0], -1, io);
+    close(fds[1]);
+
+    static char buf[1 << 18];
+    size_t got = 0;
+    for (ssize_t r; (r = read(fds[0], buf, sizeof(buf))) != 0;) {
+      if (r < 0) {
+        if (errno == EINTR) continue;
+        break;
+      }
+      got += r;
+    }
+    double sec = (now_ns() - t0) / 1e9;
+    close(fds[0]);
+    reap(job);
+    if (job.meter) meter_finish(job.meter, false);
+    if (got != bytes) fprintf(stderr, "pipeline_throughput: got %zu of %zu bytes\n", got, bytes);
+    report.value("pipeline_throughput/stages=" + to_string(cats + 1) + tag, got / sec / 1e6, "MB/s");
+  }
+  var_unset("PIPE_SIZE");
+  var_unset("PIPE_METER");
+}
+
+int main() {
+  interactive = false; // no terminal handoffs around the waits
+  vars_init();
+  BenchReport report("shell");
+  bench_parse(report);
+  bench_check(report);
+  bench_find_in_path(report);
+  bench_glob(report);
+  bench_script_cache(report);
+  bench_command(report);
+  bench_substitution(report);
+  bench_builtin_output(report);
+  bench_loop(report);
+  bench_pipeline_setup(report);
+  bench_pipeline_throughput(report);
+  report.print();
+  return 0;
+}
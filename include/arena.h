@@ -0,0 +1,37 @@
+#ifndef ARENA_H
+#define ARENA_H
+
+#include <cstddef>
+#include <memory>
+#include <string_view>
+#include <vector>
+
+// bump allocator for data that lives exactly as long as one input line.
+// nothing is freed individually, the whole thing goes when the arena does.
+// chunks never move, so pointers/views into them stay valid across moves
+class Arena {
+public:
+  explicit Arena(size_t chunk_size = 4096) : chunk_size_(chunk_size) {}
+
+  Arena(Arena &&) = default;
+  Arena &operator=(Arena &&) = default;
+  Arena(const Arena &) = delete;
+  Arena &operator=(const Arena &) = delete;
+
+  // n bytes, aligned to align (a power of two)
+  char *alloc(size_t n, size_t align = 1);
+
+  // NUL terminated copy; the view excludes the terminator
+  std::string_view copy(std::string_view s);
+
+  // drop everything but keep the first chunk around for reuse
+  void reset();
+
+private:
+  std::vector<std::unique_ptr<char[]>> chunks_;
+  size_t chunk_size_;
+  size_t cur_cap_ = 0;
+  size_t used_ = 0;
+};
+
+#endif
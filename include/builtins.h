@@ -0,0 +1,61 @@
+#ifndef BUILTINS_H
+#define BUILTINS_H
+
+#include <cstddef>
+#include <string>
+#include <string_view>
+#include <vector>
+
+// what every builtin gets: its words and the descriptors to use.
+// builtins never touch cout/cerr or the shell's own fds 0-2 directly, so the
+// same code runs in the shell, in a pipeline stage or in a forked child
+struct BuiltinArgs {
+  char *const *argv; // argv[0] is the builtin's own name
+  size_t argc;
+  int in, out, err;
+};
+
+// returns the exit status
+typedef int (*BuiltinFn)(const BuiltinArgs &args);
+
+// write all of s to fd, for builtins' output. buffered: it's out once
+// put_flush() runs, which the shell does after every builtin
+void put(int fd, std::string_view s);
+
+// write out what put() is holding
+void put_flush();
+
+// put_flush() at the end of builtin name: if any of its writes failed,
+// say so once on err and make its status 1. a pipeline stage run inside
+// the shell stands in for a process SIGPIPE would have killed, so there
+// EPIPE is a quiet 128+SIGPIPE instead
+int put_status(std::string_view name, int err, int status, bool stage = false);
+
+// put()'s buffer, then cout and cerr: before a fork (or the child would
+// print it again), a spawn (or the child's output could come first) and
+// the prompt
+void flush_output();
+
+// an out/err that is no descriptor: put() appends to the capture buffer.
+// $(...) of a builtin runs it in the shell with this as its stdout
+const int CAPTURE_FD = -2;
+// make buf the capture buffer, returning the one before (nesting)
+std::string *set_capture(std::string *buf);
+
+// compile-time perfect hash lookup, nullptr if name isn't a builtin
+BuiltinFn find_builtin(std::string_view name);
+
+inline bool is_builtin(std::string_view name) { return find_builtin(name) != nullptr; }
+
+// does the builtin only print, so $(name ...) may run it inside the shell
+// instead of a subshell
+bool builtin_capturable(std::string_view name);
+
+// can the builtin read its stdin at all (a pipeline keeps its input open
+// for it only then)
+bool builtin_reads_stdin(std::string_view name);
+
+// every builtin's name, sorted (for completion)
+std::vector<std::string_view> builtin_names();
+
+#endif
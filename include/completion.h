@@ -0,0 +1,53 @@
+#ifndef COMPLETION_H
+#define COMPLETION_H
+
+#include <ctime>
+#include <memory>
+#include <string>
+#include <string_view>
+#include <utility>
+#include <vector>
+
+// every executable on $PATH, scanned on a background thread (one
+// getdents64 pass per directory, directories in parallel) and published as
+// immutable snapshots, so readers never wait on the scan
+
+struct ExecDir {
+  std::string dir;
+  struct timespec mtime; // when it was scanned; a different mtime means rescan
+  bool exists;
+  bool scanned;
+  std::vector<std::string> names; // sorted
+};
+
+struct ExecIndex {
+  std::string path_env;       // the $PATH these dirs came from
+  std::vector<ExecDir> dirs;  // in $PATH order
+  // sorted, one per name: the name and the first dir (index into dirs) it
+  // is found in, which is where it resolves to
+  std::vector<std::pair<std::string_view, size_t>> names;
+  bool complete;              // every dir scanned
+};
+
+// latest snapshot, possibly partial while the first scan runs. nullptr
+// before anything was published
+std::shared_ptr<const ExecIndex> exec_index();
+
+// compare $PATH and the dir mtimes with the snapshot and rescan what
+// changed, in the background. a scan already running makes this a no-op
+void exec_index_refresh();
+
+// drop the snapshot (hash -r): nothing scanned before this gets published,
+// and the next refresh scans every dir again
+void exec_index_reset();
+
+// for find_in_path(): where name resolves to per a complete snapshot of
+// path_env whose dirs up to that point haven't changed since. the dir
+// index, -1 for "in none of them", -2 if the snapshot can't tell. a dir's
+// mtime doesn't change on chmod, so only a hit is worth anything
+long exec_index_lookup(const std::string &path_env, std::string_view name);
+
+// hook command name completion into readline and start the first scan
+void completion_init();
+
+#endif
@@ -2,12 +2,56 @@
 #define EXECUTOR_H
 
 #include "parser.h"
+#include <memory>
+#include <string>
+#include <string_view>
 #include <vector>
+#include <unistd.h>
+#include <sys/types.h>
 
-void execute(const Tree &ast);
+// a lone builtin or assignment-only command, in the shell itself. external
+// commands always go through execute_pipeline's launcher
+void execute(const CommandLine &line, const Command &cmd);
 
-void execute_child_logic(const Tree &ast);
+void execute_child_logic(const CommandLine &line, const Command &cmd, const fs::path &path);
 
-void execute_pipeline(const std::vector<Tree> &pipeline);
+void execute_pipeline(const CommandLine &line, const Pipeline &pipeline);
 
-#endif
\ No newline at end of file
+// run line's pipelines in order, each expanded right before it starts.
+// exec_last: nothing runs after this line (end of a -c string or script),
+// so its last simple foreground command may replace the shell instead of
+// fork+wait
+void execute_line(const CommandLine &line, bool exec_last);
+
+// $(text): text's standard output, trailing newlines trimmed. a lone
+// printing builtin runs right here writing into the buffer, one pipeline
+// is launched as usual, anything longer runs in a forked subshell.
+// last_status becomes text's status
+std::string command_output(std::string_view text);
+
+// where a launched pipeline's ends go. a foreground pipeline gets the
+// terminal and its builtin stages run inside the shell; otherwise every
+// stage is a child
+struct PipelineIO {
+  int in = STDIN_FILENO;
+  int out = STDOUT_FILENO;
+  int err = STDERR_FILENO;
+  bool foreground = true;
+};
+
+struct PipeMeter;
+
+struct LaunchedPipeline {
+  pid_t pgid = -1;
+  std::vector<pid_t> pids;    // children, in stage order
+  pid_t last_pid = -1;        // the last stage's child, if it has one
+  int last_stage_status = 127; // status of a last stage that ran without a child
+  std::shared_ptr<PipeMeter> meter; // PIPE_METER's relay, foreground only
+};
+
+// start every stage of pipeline without waiting for any of them.
+// pgid: -1 stay in the shell's group, 0 the first stage leads a new one
+LaunchedPipeline launch_pipeline(const CommandLine &line, const Pipeline &pipeline, pid_t pgid,
+                                 const PipelineIO &io);
+
+#endif
@@ -0,0 +1,23 @@
+#ifndef EXPAND_H
+#define EXPAND_H
+
+#include "parser.h"
+#include <string>
+#include <string_view>
+#include <vector>
+
+// $NAME ${NAME} $? $$ $! $(...) `...`, globs and quote removal for the
+// words check() left raw. done per pipeline right before it runs, so
+// `x=1; echo $x` sees the new x
+
+// raw's final text appended to fields: exactly one entry for ExpandString
+// and ExpandHereDoc, any number (none for an empty unquoted result) for
+// ExpandFields
+void expand_word(std::string_view raw, ExpandMode mode, std::vector<std::string> &fields);
+
+// pipeline p of line as a line of its own with every raw word and target
+// expanded. words that needed nothing still point into line, which has to
+// outlive the result
+CommandLine expand_pipeline(const CommandLine &line, const Pipeline &p);
+
+#endif
@@ -0,0 +1,28 @@
+#ifndef GLOB_H
+#define GLOB_H
+
+#include <string>
+#include <string_view>
+#include <vector>
+
+// pathname expansion: * ? [...] within a path component, ** for any number
+// of directories (hidden ones skipped, symlinks not followed), \ escaping
+// the next character. each component is compiled once and run over raw
+// getdents64 listings; those are cached by directory and reused while its
+// mtime stays the same, and the directories under a ** are read in parallel
+
+// does pattern have an unescaped * ? or [
+bool glob_has_meta(std::string_view pattern);
+
+// the matches, sorted bytewise, appended to out. false (out untouched)
+// when there were none
+bool glob_expand(std::string_view pattern, std::vector<std::string> &out);
+
+// does text match pattern as a whole (case patterns). / and a leading .
+// are ordinary characters here
+bool glob_match(std::string_view pattern, std::string_view text);
+
+// drop the cached listings
+void glob_cache_clear();
+
+#endif
@@ -0,0 +1,56 @@
+#ifndef HISTORY_H
+#define HISTORY_H
+
+#include <cstddef>
+#include <cstdint>
+#include <functional>
+#include <string_view>
+
+// persistent history: an append-only log file ($HISTFILE, default
+// ~/.myshell_history) mapped MAP_SHARED by every running shell. appends
+// reserve their spot with one atomic add on the shared tail, so sessions
+// never take a lock to record a command. when the file fills up, one
+// session copies it into a fresh file twice the size of what's in it and
+// renames that over the old one; the others notice on their next append
+// and remap. nothing is ever dropped
+
+// one entry, viewed straight out of the mapping. the views are only good
+// until the next history call
+struct HistoryEntry {
+  uint64_t number;  // 1-based, stable across compactions
+  int64_t time;     // seconds since the epoch
+  int status;       // exit status, -1 while running (or if it never finished)
+  std::string_view cwd;
+  std::string_view cmd;
+};
+
+// where history_finish() should put the status
+struct HistoryMark {
+  uint64_t generation;
+  uint64_t offset;
+};
+
+// map the log, creating it if needed. no scan: O(1) whatever its size.
+// falls back to an in-memory log if the file can't be used
+void history_open();
+
+// record line, run from the current directory, right now
+HistoryMark history_append(std::string_view line);
+
+// fill in the status of a record once its command is done
+void history_finish(HistoryMark mark, int status);
+
+// call fn on the newest n entries (all of them when n is 0), oldest first.
+// reads backwards from the tail, so the cost is O(n) whatever the log size
+void history_tail(size_t n, const std::function<void(const HistoryEntry &)> &fn);
+
+// call fn on every entry numbered above after, oldest first. for keeping
+// something in step with the log without rereading all of it
+void history_since(uint64_t after, const std::function<void(const HistoryEntry &)> &fn);
+
+// call fn on every entry of the log file as it is now, oldest first, from a
+// mapping of its own: fine on another thread, whatever this one appends or
+// compacts meanwhile. nothing for an in-memory log
+void history_snapshot(const std::function<void(const HistoryEntry &)> &fn);
+
+#endif
@@ -0,0 +1,70 @@
+#ifndef HISTSEARCH_H
+#define HISTSEARCH_H
+
+#include "arena.h"
+#include <cstdint>
+#include <string_view>
+#include <unordered_map>
+#include <utility>
+#include <vector>
+
+// trigram index over history lines, for `history -s` and Ctrl-R.
+// every distinct command is stored once with its use count and the number
+// of its newest use; each lowercase trigram maps to the (ascending) ids of
+// the commands containing it
+class HistoryIndex {
+public:
+  struct Match {
+    std::string_view cmd;
+    uint64_t number; // history number of the newest use
+    uint32_t count;  // times it was run
+  };
+
+  // entries must come in history order
+  void add(std::string_view cmd, uint64_t number);
+
+  // best `limit` matches, best first. every space separated word of query
+  // has to appear (any order, ignoring case); if nothing does, commands
+  // sharing most of the query's trigrams are returned instead, so typos
+  // still find something. ties go to recent, frequently used commands.
+  // commands whose newest use is numbered `before` or later are skipped
+  std::vector<Match> search(std::string_view query, size_t limit, uint64_t before = UINT64_MAX) const;
+
+  uint64_t last_number() const { return last_number_; }
+  size_t entries() const { return entries_; }
+  size_t distinct() const { return cmds_.size(); }
+
+private:
+  struct Cmd {
+    std::string_view text;
+    uint64_t last;
+    uint32_t count;
+  };
+
+  double score(const Cmd &c) const;
+
+  Arena text_{1 << 20};
+  std::vector<Cmd> cmds_;
+  std::unordered_map<std::string_view, uint32_t> ids_;
+  std::unordered_map<uint32_t, std::vector<uint32_t>> postings_;
+  std::vector<std::pair<uint64_t, uint32_t>> recent_; // (number, id) of every add
+  uint32_t max_count_ = 1;
+  uint64_t last_number_ = 0;
+  size_t entries_ = 0;
+};
+
+// the shell's index over its history log. the log there is at startup is
+// indexed in the background (history_index_load()), each line run after
+// that is added as it's appended (history_index_update()), and a search
+// brings it up to date with other sessions' lines first. without a load
+// the first search indexes the whole log
+HistoryIndex &history_index();
+
+// index the log in the background
+void history_index_load();
+
+// add whatever was appended since the last update; nothing while the
+// load is still running
+void history_index_update();
+
+#endif
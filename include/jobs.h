@@ -0,0 +1,110 @@
+#ifndef JOBS_H
+#define JOBS_H
+
+#include <functional>
+#include <string>
+#include <unordered_map>
+#include <utility>
+#include <vector>
+#include <sys/types.h>
+
+enum JobState { JobRunning, JobStopped, JobDone, JobQueued };
+
+struct JobProc {
+    pid_t pid;
+    int pidfd;   // -1 in signalfd mode, or once reaped
+    int status;  // raw waitpid status once done
+    bool done;
+    bool stopped;
+};
+
+// launches a queued job: its process group and pids (none if nothing
+// could be started)
+typedef std::function<std::pair<pid_t, std::vector<pid_t>>()> JobStart;
+
+// one job == one process group
+struct Job {
+    int id;
+    pid_t pgid;
+    std::string command;
+    std::vector<JobProc> procs;
+    JobState state;
+    JobStart start = nullptr; // JobQueued only
+};
+
+extern std::unordered_map<int, Job> job_table;
+extern pid_t last_bg_pid; // $!
+
+// pidfd_open + epoll when the kernel has it, signalfd otherwise
+void jobs_init();
+
+// readable whenever job events are pending; the main loop polls it
+int jobs_event_fd();
+
+// handle whatever job events are ready, without blocking. notices about
+// finished jobs are printed only when the shell is interactive
+void jobs_poll();
+
+// drop finished jobs once `jobs` has listed them
+void jobs_clear_done();
+
+// the main loop sets this while readline owns the screen, so notices
+// clear and redraw the prompt around themselves
+void jobs_set_at_prompt(bool at_prompt);
+
+// a pipeline the shell isn't going to wait for. returns the job id
+int job_add(pid_t pgid, const std::vector<pid_t> &pids, const std::string &command);
+
+// $JOBS_MAX caps how many background jobs run at once; past it new ones
+// wait in a queue and start, oldest first, as running ones finish. stopped
+// jobs don't take a slot
+
+// is there room for one more running background job
+bool jobs_slot_free();
+
+// a background job that has to wait for a slot. returns the job id
+int job_enqueue(const std::string &command, JobStart start);
+
+// any job still waiting for a slot
+bool jobs_queued();
+
+// wait until every queued job has been started (end of a script, so
+// none of them is silently dropped)
+void jobs_finish_queue();
+
+// make pgid the terminal's foreground group (interactive shells only)
+void give_terminal(pid_t pgid);
+
+// hand the terminal to pgid and wait for all of pids. if the job gets
+// stopped (Ctrl-Z) it's moved into the job table. returns the shell status
+// of the last process
+int wait_foreground(pid_t pgid, const std::vector<pid_t> &pids, const std::string &command);
+
+// job named by a `fg`/`bg`/`wait` argument: %N, %%, %+, %-, or a pid.
+// nullptr if there's no such job
+Job *find_job(const std::string &spec);
+
+// the job `fg`/`bg` pick with no argument
+Job *current_job();
+
+// continue a job in the foreground, returns its status. a queued one
+// starts right away
+int job_foreground(Job &job);
+
+// continue a stopped job in the background
+void job_background(Job &job);
+
+// block until the job finishes, returns its status
+int job_wait(Job &job);
+
+// block until any running job finishes; -1 if there are none. the finished
+// job's status goes to *status
+int job_wait_any(int *status);
+
+// job ids in ascending order, for listing
+std::vector<int> job_ids();
+
+// status word for `jobs`: Running, Stopped, Queued, Done, Exit N ...
+std::string job_state_text(const Job &job);
+
+#endif
@@ -0,0 +1,74 @@
+#ifndef LAUNCHER_H
+#define LAUNCHER_H
+
+#include <string>
+#include <string_view>
+#include <utility>
+#include <vector>
+#include <sched.h>
+#include <signal.h>
+#include <sys/resource.h>
+#include <sys/types.h>
+
+// a single fd operation, applied in order in the child right before exec
+struct FdAction {
+  enum Kind { Open, Dup2, Close } kind;
+  int fd;           // target descriptor
+  int src_fd;       // Dup2 only
+  std::string path; // Open only
+  int flags;        // Open only
+  mode_t mode;      // Open only
+};
+
+// scheduling a child starts with: CPU affinity, nice level, I/O priority
+// and resource limits. filled in from the JOB_CPUS, JOB_NICE, JOB_IONICE
+// and JOB_RLIMITS variables (see sched_set())
+struct SchedSpec {
+  bool pin = false;
+  cpu_set_t cpus;
+  bool renice = false;
+  int nice = 0;
+  int ioprio = -1; // ioprio_set() value, -1 leaves it alone
+  std::vector<std::pair<int, rlimit>> rlimits;
+
+  bool empty() const { return !pin && !renice && ioprio < 0 && rlimits.empty(); }
+};
+
+// the variables sched_set() understands
+extern const char *const sched_vars[4];
+
+// one setting of s from a variable's text:
+//   JOB_CPUS     0-3,8        CPU list, like taskset -c
+//   JOB_NICE     10           nice level
+//   JOB_IONICE   idle, best-effort[:0-7], realtime[:0-7]
+//   JOB_RLIMITS  as=2G nofile=1024 cpu=600 ...   soft and hard limit
+// false, with s untouched, when the text doesn't parse
+bool sched_set(SchedSpec &s, std::string_view var, std::string_view value);
+
+// apply s to the calling process. every setting is tried; a failed one is
+// reported on stderr under name and the rest still apply
+void apply_sched(const SchedSpec &s, const char *name);
+
+// everything the child needs, prepared in the parent so the child side
+// does no allocation between clone and exec
+struct SpawnSpec {
+  std::string path;
+  char *const *argv = nullptr; // nullptr terminated, owned by the caller
+  char *const *envp = nullptr; // nullptr means inherit environ
+  std::vector<FdAction> actions;
+  pid_t pgid = -1; // -1 stay in our group, 0 lead a new one, >0 join that one
+  const sigset_t *sigmask = nullptr; // mask the child starts with, nullptr = empty
+  const SchedSpec *sched = nullptr;  // applied in the child before exec (fork+exec then)
+};
+
+// posix_spawn based launch (glibc implements it with clone(CLONE_VM|CLONE_VFORK),
+// so no page tables get copied). posix_spawn can't set scheduling, so a
+// spec with sched goes through fork and does the same steps by hand.
+// returns the pid, or -1 with errno set
+pid_t spawn_process(const SpawnSpec &spec);
+
+// for children made with plain fork(): put back the signal dispositions and
+// mask the shell changed for itself, the same way spawn_process() does
+void reset_child_signals();
+
+#endif
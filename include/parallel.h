@@ -0,0 +1,16 @@
+#ifndef PARALLEL_H
+#define PARALLEL_H
+
+#include "builtins.h"
+
+// parallel [-j N] [-n N] [-X] [-k] [--tag] command... [::: arg...]
+//
+// runs command once per argument (read one per line from stdin, or taken
+// from after :::) with at most N at a time. {} in command is replaced by the
+// argument, otherwise arguments are appended. a command given as a single
+// word is parsed as a command line, so it can be a pipeline.
+// each job's output is kept together; the status is the number of failed
+// jobs (at most 101)
+int builtin_parallel(const BuiltinArgs &args);
+
+#endif
@@ -2,37 +2,170 @@
 #define PARSER_H
 
 #include <string>
+#include <string_view>
 #include <vector>
-#include <deque>
+#include <cstdint>
 #include <iostream>
 #include <filesystem>
+#include "arena.h"
 namespace fs = std::filesystem;
 
-enum TokenT { PlainText, SingleQuoted, Pipe, Semicolon, WhitespaceTk, RedirectOut, Background };
+enum TokenT { PlainText, SingleQuoted, Pipe, Semicolon, WhitespaceTk, RedirectOut, RedirectIn, Background,
+              And, Or,       // && ||
+              CaseEnd,       // ;; closing a case branch
+              Expandable,    // a word with $ expansions or globs, kept raw (quotes and all) until it runs
+              HereDoc,       // << <<- <<<, optionally with a digit in front
+              HereDocBody,   // what a << delimiter token becomes once its body is read
+              HereDocExpand }; // the same, for an unquoted delimiter and a body with $ ` or \ in it
 
+// does a $ followed by c start an expansion: $NAME ${NAME} $? $$ $! $(...)
+inline bool starts_expansion(char c) {
+  return (c >= 'a' && c <= 'z') || (c >= 'A' && c <= 'Z') || c == '_' || c == '{' || c == '?' || c == '$' ||
+         c == '!' || c == '(';
+}
+
+// offset just past the $(...) or `...` starting at s[i], skipping quotes
+// and nested substitutions inside it; s.size() if it never closes
+size_t substitution_end(std::string_view s, size_t i);
+
+// text points either into the parsed input or into the line's arena
 typedef struct Token {
   TokenT type;
-  std::string text;
+  std::string_view text;
 } Token;
-enum TreeT { Builtin, ExecutableFile, TextNode, Leaf, WhitespaceNode };
 
-typedef struct Tree {
-  TreeT type;
-  std::string value;
-  fs::path path;
-  std::vector<Tree> children;
-  bool is_background = false;
-} Tree;
+// a here-document whose delimiter line hasn't come (yet)
+struct OpenHereDoc {
+  std::string delim;
+  bool strip_tabs; // <<-
+};
 
+// output of parse(): tokens plus the storage for any word that had to be
+// unescaped. plain words are views into src, so the input must outlive this
+struct ParsedLine {
+  std::string_view src;
+  Arena arena;
+  std::vector<Token> tokens;
+  // here-documents the input ended inside of (or before), in order. their
+  // bodies are whatever there was; readers use this to know they have to
+  // fetch more lines before running the line
+  std::vector<OpenHereDoc> open_heredocs;
+};
 
-std::ostream &operator<<(std::ostream &os, const Token &tok);
+// is line (without its newline) the one that closes doc
+bool heredoc_ends(std::string_view line, const OpenHereDoc &doc);
+enum CommandT { Builtin, ExecutableFile, EmptyCommand };
+
+// how a raw word becomes its final text when its command runs
+enum ExpandMode : uint8_t {
+  ExpandNone,
+  ExpandFields,  // an argument: quotes removed, $ substituted, unquoted results split on $IFS, then globbed
+  ExpandString,  // assignment, redirection target, here-string: the same, never split
+  ExpandHereDoc, // here-document body: only $, ` and backslashes before $ ` \ and newline
+  ExpandPattern, // case pattern: like ExpandString, but quoted * ? [ come out backslash escaped
+};
+
+enum RedirOp {
+  RedirTrunc,     // >
+  RedirAppend,    // >>
+  RedirHereDoc,   // << and <<<
+  RedirIn,        // <
+  RedirReadWrite, // <>
+  RedirDup,       // N>&M, N<&M
+  RedirClose,     // N>&-, N<&-
+};
+
+// one redirection; they apply in the order they were written. target is
+// NUL terminated and lives in the line's arena: a file name, or for
+// RedirHereDoc the text to feed in ("" for dups and closes)
+struct Redirect {
+  int fd; // descriptor being redirected: 1 for >, 0 for < and <<, N for N>...
+  RedirOp op;
+  const char *target;
+  int src_fd; // RedirDup: the descriptor fd becomes a copy of
+  ExpandMode expand = ExpandNone; // target is still raw
+};
+
+// a simple command: a slice of CommandLine::argv (nullptr terminated, so it
+// can go straight to execv) and a slice of CommandLine::redirs. NAME=value
+// words in front of the name sit in argv right before its own slice
+struct Command {
+  CommandT type;
+  uint32_t argv_begin;
+  uint32_t argc;
+  uint32_t redir_begin;
+  uint32_t redir_count;
+  uint32_t assign_begin = 0;
+  uint32_t assign_count = 0;
+};
 
-std::ostream &operator<<(std::ostream &os, const Tree &t);
+// commands [cmd_begin, cmd_begin + cmd_count) joined by '|'
+struct Pipeline {
+  uint32_t cmd_begin;
+  uint32_t cmd_count;
+  bool background;
+  bool expand = false; // some word or redirection in it is still raw
+  bool substituted = false; // expanded, and a $(...) ran: $? is its status so far
+};
+
+// control flow (if, while, until, for, case, && and ||) is compiled once
+// into code for a small machine that runs pipelines by index; loops jump
+// back instead of parsing their bodies again
+enum OpCode : uint8_t {
+  OpRun,        // run pipeline arg
+  OpJump,       // go to target
+  OpJumpIfFail, // go to target if $? != 0
+  OpJumpIfOk,   // go to target if $? == 0
+  OpSetStatus,  // $? = arg
+  OpLoopEnter,  // while/until: a new loop with status 0
+  OpForBegin,   // a new loop over the words of pipeline arg
+  OpForNext,    // next word into variable name, or go to target when there is none
+  OpSaveStatus, // the loop's status is $? (end of an iteration)
+  OpLoopExit,   // leave the loop: $? is its status
+  OpCaseBegin,  // the word of pipeline arg is what the next OpCaseMatches test
+  OpCaseMatch,  // $? = 0 if a pattern of pipeline arg matches, otherwise go to target
+  OpCasePop,    // done with the case word
+};
+
+struct Instr {
+  OpCode op;
+  uint32_t arg;
+  uint32_t target;
+  const char *name; // OpForNext's variable
+};
+
+// the whole input line, flattened. without code, pipelines run in order
+// (';' and '&' separate them); with it only what the code runs does, and
+// the rest are word lists for for and case. everything is freed together
+// with the line
+struct CommandLine {
+  Arena arena;
+  std::vector<char *> argv;
+  std::vector<Redirect> redirs;
+  std::vector<Command> commands;
+  std::vector<Pipeline> pipelines;
+  // ExpandMode of each argv entry, or empty when nothing in the line expands
+  std::vector<uint8_t> argv_expand;
+  std::vector<Instr> code; // empty when the line has no control flow
+  bool incomplete = false; // an if/while/for/case still open, or && || | at the end
+  std::string error;       // a syntax error; nothing in the line runs
+
+  char *const *argv_of(const Command &cmd) const { return argv.data() + cmd.argv_begin; }
+  char *const *assigns_of(const Command &cmd) const { return argv.data() + cmd.assign_begin; }
+  ExpandMode expand_of(size_t i) const { return i < argv_expand.size() ? ExpandMode(argv_expand[i]) : ExpandNone; }
+  const char *name_of(const Command &cmd) const { return cmd.argc ? argv[cmd.argv_begin] : ""; }
+  const Redirect *redirs_of(const Command &cmd) const { return redirs.data() + cmd.redir_begin; }
+  const Command &command(const Pipeline &p, size_t i) const { return commands[p.cmd_begin + i]; }
+};
+
+std::ostream &operator<<(std::ostream &os, const Token &tok);
 
-std::vector<Token> parse(std::string in);
+std::ostream &operator<<(std::ostream &os, const CommandLine &line);
 
-Tree check(std::vector<Token> &tokens);
+ParsedLine parse(std::string_view in);
 
-std::vector<Tree> build_pipeline_trees(std::vector<Token> &tokens);
+// build the flat command IR from parsed tokens. takes over the line's arena
+// so unescaped words are reused without another copy
+CommandLine check(ParsedLine &&parsed);
 
 #endif
\ No newline at end of file
@@ -0,0 +1,51 @@
+#ifndef PIPES_H
+#define PIPES_H
+
+#include <cstddef>
+#include <cstdint>
+#include <memory>
+#include <string>
+#include <string_view>
+#include <utility>
+#include <vector>
+
+// the pipes between pipeline stages.
+//
+// PIPE_SIZE is their capacity: bytes (K and M suffixes), `max' for
+// /proc/sys/fs/pipe-max-size, or `auto', which starts at the kernel's
+// default and keeps growing a pipe up to the max while its reader falls
+// behind (that needs the meter below to see it happen; unmetered, auto
+// means max). the shell variable is the default for every pipe, a prefix
+// assignment sizes the pipe that one stage writes into.
+//
+// PIPE_METER=1 (variable or prefix on any stage) meters foreground
+// pipelines: every stage writes into a pipe of its own, the shell moves
+// the data on to the next stage with splice(2), and when the pipeline ends
+// it prints per stage bytes, throughput and how long the stage sat waiting
+// for input or blocked on its output on stderr
+
+const size_t PIPE_AUTO = SIZE_MAX;
+
+// a PIPE_SIZE value in bytes, PIPE_AUTO for auto. false if it doesn't parse
+bool parse_pipe_size(std::string_view text, size_t &bytes);
+
+// /proc/sys/fs/pipe-max-size, read once
+size_t pipe_max_size();
+
+// resize fd's pipe to bytes, or as close below it as the limits allow
+// (past the per-user pipe budget F_SETPIPE_SZ fails for non-root)
+void set_pipe_size(int fd, size_t bytes);
+
+struct PipeMeter;
+
+// start relaying: links[i] is {the read end of the pipe stage i writes
+// into, the write end of the pipe stage i+1 reads from}, both owned by the
+// meter from here on. names label the stages in the report
+std::shared_ptr<PipeMeter> meter_start(std::vector<std::pair<int, int>> links, std::vector<std::string> names,
+                                       bool grow);
+
+// the pipeline is done: wait for the relay to drain and print the report.
+// a stopped pipeline (report false) keeps its relay going on its own
+void meter_finish(const std::shared_ptr<PipeMeter> &meter, bool report);
+
+#endif
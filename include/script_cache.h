@@ -0,0 +1,36 @@
+#ifndef SCRIPT_CACHE_H
+#define SCRIPT_CACHE_H
+
+#include "parser.h"
+#include <cstdint>
+#include <memory>
+#include <vector>
+#include <sys/stat.h>
+
+// compiled scripts on disk: a script file's lines after parse() and
+// check(), keyed by the file's device, inode, mtime and size plus the
+// shell binary itself, under $XDG_CACHE_HOME/myshell/scripts (or
+// ~/.cache/...). a hit maps the entry in and points the lines' words
+// straight into the mapping, so the script is never tokenized. the
+// directory is kept to a fixed budget, least recently used entries go
+// first
+
+// a script's lines in the order they run, each one whole (here-document
+// bodies and continuation lines included)
+struct CompiledScript {
+  std::vector<CommandLine> lines;
+  std::vector<uint8_t> last; // per line: nothing runs after it (exec elision is fine)
+  std::shared_ptr<void> mapping; // what the lines point into, on a hit
+};
+
+// the entry for the file st describes. false on a miss, or when the entry
+// is stale, damaged or from another build of the shell
+bool script_cache_load(const struct stat &st, CompiledScript &out);
+
+// save script for the next run of the file st describes, then evict down
+// to the budget. best effort: a failure only means no cache next time.
+// files changed in the last couple of seconds are skipped, an edit within
+// the same mtime tick could otherwise go unnoticed
+void script_cache_store(const struct stat &st, const CompiledScript &script);
+
+#endif
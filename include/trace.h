@@ -0,0 +1,85 @@
+#ifndef TRACE_H
+#define TRACE_H
+
+#include <atomic>
+#include <cstdint>
+#include <string>
+#include <time.h>
+
+// built-in profiling. spans time the phases of running a command line and
+// land in a fixed ring of the newest events (dumped as Chrome trace JSON,
+// chrome://tracing or ui.perfetto.dev) and in per-phase latency histograms
+// for `stats`. off by default: a span is then one load and one branch.
+// MYSHELL_TRACE=file turns it on at startup and dumps to file at exit
+
+enum TracePhase : uint8_t {
+  PhaseParse,
+  PhaseCheck,
+  PhaseResolve,  // PATH lookup
+  PhaseRedirect, // opening redirection targets
+  PhaseSpawn,    // posix_spawn: clone until the child has exec'd
+  PhaseFork,
+  PhaseExec,     // the shell itself exec'ing (exec elision), instant
+  PhaseWait,     // foreground wait, until it ends or stops
+  PhaseBuiltin,
+  PhaseGlob,     // pathname expansion of one word
+  PhaseCache,    // looking a script up in the compiled script cache
+  PHASE_COUNT
+};
+
+// bumped whether tracing is on or not, they're a relaxed add each
+enum TraceCounter { CountForks, CountSpawns, CountExecs, CountStats, CountPipes, COUNTER_COUNT };
+
+extern bool trace_enabled;
+extern std::atomic<uint64_t> trace_counters[COUNTER_COUNT];
+
+inline void trace_count(TraceCounter c, uint64_t n = 1) {
+  trace_counters[c].fetch_add(n, std::memory_order_relaxed);
+}
+
+inline uint64_t trace_now() {
+  struct timespec ts;
+  clock_gettime(CLOCK_MONOTONIC, &ts);
+  return uint64_t(ts.tv_sec) * 1000000000 + ts.tv_nsec;
+}
+
+// one finished span. detail (a command name, say) is copied, truncated
+void trace_record(TracePhase phase, uint64_t start, uint64_t end, const char *detail);
+
+// times its own scope. detail has to outlive it; `when` skips uninteresting
+// cases (no redirections to set up) without a second code path
+class TraceSpan {
+public:
+  explicit TraceSpan(TracePhase phase, const char *detail = nullptr, bool when = true)
+      : phase_(phase), detail_(detail), start_(when && trace_enabled ? trace_now() : 0) {}
+  ~TraceSpan() {
+    if (start_) trace_record(phase_, start_, trace_now(), detail_);
+  }
+  TraceSpan(const TraceSpan &) = delete;
+  TraceSpan &operator=(const TraceSpan &) = delete;
+
+private:
+  TracePhase phase_;
+  const char *detail_;
+  uint64_t start_;
+};
+
+// read MYSHELL_TRACE
+void trace_init();
+
+void trace_set(bool on);
+// forget the recorded events and histograms (not the counters)
+void trace_clear();
+void trace_reset_counters();
+
+// the ring as Chrome trace JSON, oldest event first
+std::string trace_json();
+// write it to path; false with errno set on failure
+bool trace_dump(const std::string &path);
+// the MYSHELL_TRACE dump, for when the shell is about to exec or exit
+void trace_dump_at_exit();
+
+// per-phase p50/p99/max and the counters, as `stats` prints them
+std::string trace_stats_text();
+
+#endif
@@ -3,28 +3,47 @@
 
 #include <string>
 #include <vector>
-#include <deque>
+#include <unordered_map>
 #include <filesystem>
 #include <sys/types.h>
 #include <termios.h>
 namespace fs = std::filesystem;
 
-struct Job {
-    pid_t pid;
-    std::string command;
-    bool is_running;
+struct HashEntry {
+    fs::path path;
+    size_t dir_index; // index into the split $PATH this was found in
+    unsigned hits;
 };
 
 extern struct termios shell_tmodes;
-extern std::vector<Job> jobs;
-extern std::vector<std::string> builtins;
-extern std::deque<std::string> manual_history_list;
-extern const size_t MAX_HISTORY;
-extern size_t history_count;
+extern const size_t MAX_HISTORY; // lines readline keeps for up-arrow
+extern bool interactive; // false for -c, scripts and piped stdin
+extern int last_status;  // $? of the last pipeline
+extern std::unordered_map<std::string, HashEntry> command_hash;
 
-fs::path find_in_path(std::string s);
+fs::path find_in_path(const std::string &s);
 
-void chdir_logic(std::string dir);
+void hash_reset();
+
+// shell-style status from a waitpid() status: exit code, or 128 + signal
+int exit_code(int status);
+
+std::string chdir_logic(const std::string &dir);
+
+// the shell's own long-lived descriptors (job epoll, signalfd, pidfds, the
+// history log, ...) sit at SHELL_FD_BASE and up, out of the way of the
+// 0-9 scripts redirect, and a redirection may not dup one of them
+const int SHELL_FD_BASE = 10;
+
+// fd moved up there (O_CLOEXEC) and registered; -1 stays -1, and fd
+// itself is registered if it can't be moved
+int shell_fd(int fd);
+
+// close a shell_fd() descriptor
+void shell_fd_close(int fd);
+
+// is fd one of the shell's own
+bool is_shell_fd(int fd);
 
 bool peek(const std::string &s, int (*f)(int), int pos);
 bool peek(const std::string &s, bool (*f)(char), int pos);
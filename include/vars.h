@@ -0,0 +1,38 @@
+#ifndef VARS_H
+#define VARS_H
+
+#include <string>
+#include <string_view>
+#include <vector>
+
+// shell variables, in one hash map. the exported ones are the environment
+// every child gets, kept as a ready envp array that is only rebuilt after
+// an exported variable changed, never per exec
+
+// take over environ, everything in it exported
+void vars_init();
+
+// nullptr if unset
+const char *var_get(std::string_view name);
+void var_set(std::string_view name, std::string_view value);
+void var_unset(std::string_view name);
+// mark exported; an unset one gets exported once it is set
+void var_export(std::string_view name);
+
+// [A-Za-z_][A-Za-z0-9_]*
+bool valid_var_name(std::string_view name);
+
+// a "NAME=value" word: set NAME. false if it isn't one
+bool var_assign(std::string_view assignment);
+
+// NULL terminated NAME=value array of the exported variables
+char *const *var_envp();
+
+// the environment with NAME=value prefix assignments on top: the cached
+// array's pointers minus the names assigned, plus the assignments
+std::vector<char *> env_overlay(char *const *assigns, size_t count);
+
+// every variable as export / set would list them, sorted by name
+std::vector<std::pair<std::string, bool>> var_names();
+
+#endif
@@ -0,0 +1,37 @@
+#include "arena.h"
+#include <cstring>
+using namespace std;
+
+char *Arena::alloc(size_t n, size_t align) {
+  if (!chunks_.empty()) {
+    size_t start = (used_ + align - 1) & ~(align - 1);
+    if (start + n <= cur_cap_) {
+      used_ = start + n;
+      return chunks_.back().get() + start;
+    }
+  }
+
+  // oversized requests get a chunk of their own
+  size_t cap = n + align > chunk_size_ ? n + align : chunk_size_;
+  chunks_.emplace_back(new char[cap]);
+  cur_cap_ = cap;
+
+  char *base = chunks_.back().get();
+  size_t start = (align - (reinterpret_cast<size_t>(base) & (align - 1))) & (align - 1);
+  used_ = start + n;
+  return base + start;
+}
+
+string_view Arena::copy(string_view s) {
+  char *p = alloc(s.size() + 1);
+  if (!s.empty()) memcpy(p, s.data(), s.size());
+  p[s.size()] = '\0';
+  return string_view(p, s.size());
+}
+
+void Arena::reset() {
+  if (chunks_.empty()) return;
+  chunks_.resize(1);
+  cur_cap_ = chunk_size_; // first chunk is always a regular one or bigger
+  used_ = 0;
+}
@@ -0,0 +1,522 @@
+#include "builtins.h"
+#include "utils.h"
+#include "jobs.h"
+#include "parallel.h"
+#include "history.h"
+#include "histsearch.h"
+#include "trace.h"
+#include "vars.h"
+#include <algorithm>
+#include <array>
+#include <cerrno>
+#include <cstdint>
+#include <cstdlib>
+#include <cstring>
+#include <csignal>
+#include <ctime>
+#include <iostream>
+#include <string>
+#include <unistd.h>
+#include <vector>
+#include <sys/uio.h>
+using namespace std;
+
+static string *capture = nullptr;
+
+string *set_capture(string *buf) {
+  swap(buf, capture);
+  return buf;
+}
+
+// builtin output waits here and goes out at the end of the command (or
+// before anything forks), so a builtin costs one write(2) however many
+// put()s it makes. one descriptor at a time: output to another one sends
+// what's pending first, which keeps stdout and stderr in order
+static const size_t OUT_BUF = 32 * 1024;
+static int out_fd = -1;
+static string out_buf;
+static int put_errno = 0; // the first write that failed since put_status() last looked
+
+// write all of iov to fd. a failure drops the rest and is kept for put_status()
+static void write_iov(int fd, struct iovec *iov, int count) {
+  while (count > 0) {
+    ssize_t n = writev(fd, iov, count);
+    if (n < 0) {
+      if (errno == EINTR) continue;
+      if (!put_errno) put_errno = errno;
+      return;
+    }
+    for (; count > 0 && size_t(n) >= iov->iov_len; iov++, count--) n -= iov->iov_len;
+    if (count > 0) {
+      iov->iov_base = static_cast<char *>(iov->iov_base) + n;
+      iov->iov_len -= n;
+    }
+  }
+}
+
+void put(int fd, string_view s) {
+  if (fd == CAPTURE_FD) {
+    if (capture) capture->append(s);
+    return;
+  }
+  if (fd != out_fd) {
+    put_flush();
+    out_fd = fd;
+  }
+  if (out_buf.size() + s.size() <= OUT_BUF) {
+    out_buf.append(s);
+    return;
+  }
+  // too big to hold: what's pending and s in one go
+  struct iovec iov[2] = {{out_buf.data(), out_buf.size()}, {const_cast<char *>(s.data()), s.size()}};
+  write_iov(fd, iov, 2);
+  out_buf.clear();
+}
+
+void put_flush() {
+  if (out_buf.empty()) return;
+  struct iovec iov = {out_buf.data(), out_buf.size()};
+  write_iov(out_fd, &iov, 1);
+  out_buf.clear();
+}
+
+int put_status(string_view name, int err, int status, bool stage) {
+  put_flush();
+  if (!put_errno) return status;
+  if (stage && put_errno == EPIPE) {
+    put_errno = 0;
+    return 128 + SIGPIPE;
+  }
+  string msg = string(name) + ": write error: " + strerror(put_errno) + "\n";
+  put(err, msg);
+  put_flush();
+  put_errno = 0; // err may be the broken one too: one message is all it gets
+  return 1;
+}
+
+void flush_output() {
+  put_flush();
+  cout.flush();
+  cerr.flush();
+}
+
+static int builtin_cd(const BuiltinArgs &a) {
+  if (a.argc < 2) {
+    put(a.out, "specify a path to continue\n");
+    return 0;
+  }
+  string error = chdir_logic(a.argv[1]);
+  if (error.empty()) return 0;
+  put(a.err, error);
+  put(a.err, "\n");
+  return 1;
+}
+
+static int builtin_echo(const BuiltinArgs &a) {
+  for (size_t i = 1; i < a.argc; i++) {
+    put(a.out, a.argv[i]);
+    if (i < a.argc - 1) put(a.out, " ");
+  }
+  put(a.out, "\n");
+  return 0;
+}
+
+static int builtin_exit(const BuiltinArgs &a) {
+  put_flush();
+  exit(a.argc < 2 ? last_status : atoi(a.argv[1]));
+}
+
+static int builtin_pwd(const BuiltinArgs &a) {
+  put(a.out, fs::current_path().native());
+  put(a.out, "\n");
+  return 0;
+}
+
+static int builtin_type(const BuiltinArgs &a) {
+  int status = 0;
+  for (size_t i = 1; i < a.argc; i++) {
+    string_view name = a.argv[i];
+    put(a.out, name);
+    if (is_builtin(name)) {
+      put(a.out, " is a shell builtin\n");
+      continue;
+    }
+    fs::path p = find_in_path(a.argv[i]);
+    if (!p.empty()) {
+      put(a.out, " is ");
+      put(a.out, p.native());
+      put(a.out, "\n");
+    } else {
+      put(a.out, ": not found\n");
+      status = 1;
+    }
+  }
+  return status;
+}
+
+// `history` and `history N`
+static int builtin_history(const BuiltinArgs &a) {
+  // -s words...: indexed search, best match first
+  if (a.argc > 1 && string_view(a.argv[1]) == "-s") {
+    string query;
+    for (size_t w = 2; w < a.argc; w++) query += (w > 2 ? " " : "") + string(a.argv[w]);
+    if (query.empty()) {
+      put(a.err, "history: -s: pattern required\n");
+      return 2;
+    }
+    // the newest entry is this very command line; it's no answer
+    HistoryIndex &index = history_index();
+    auto matches = index.search(query, 20, interactive ? index.last_number() : UINT64_MAX);
+    string out;
+    for (const auto &m : matches) {
+      out += "  " + to_string(m.number) + "  ";
+      out += m.cmd;
+      out += "\n";
+    }
+    put(a.out, out);
+    return matches.empty() ? 1 : 0;
+  }
+
+  size_t i = 1;
+  // -v: when, where and how each one went, too
+  bool verbose = a.argc > 1 && string_view(a.argv[1]) == "-v";
+  if (verbose) i++;
+  size_t n = 0;
+
+  if (a.argc > i) {
+    string_view arg = a.argv[i];
+
+    bool is_numeric = !arg.empty() && std::all_of(arg.begin(), arg.end(), ::isdigit);
+
+    if (!is_numeric) {
+      put(a.err, "history: " + string(arg) + ": numeric argument required\n");
+      return 1;
+    }
+
+    if (a.argc > i + 1) {
+      put(a.err, "history: too many arguments\n");
+      return 1;
+    }
+
+    try {
+      // all digits, so it can't be negative; only too large can fail
+      n = static_cast<size_t>(std::stoull(string(arg)));
+    } catch (...) {
+      put(a.err, "history: " + string(arg) + ": numeric argument required\n");
+      return 1;
+    }
+    if (n == 0) return 0;
+  }
+
+  // straight from the mapped log, nothing copied but the line being built
+  string out;
+  history_tail(n, [&](const HistoryEntry &e) {
+    out.clear();
+    out += "  " + to_string(e.number) + "  ";
+    if (verbose) {
+      char when[32];
+      time_t t = e.time;
+      strftime(when, sizeof(when), "%F %T", localtime(&t));
+      out += when;
+      out += e.status < 0 ? "  [ ]  " : "  [" + to_string(e.status) + "]  ";
+      out += e.cwd;
+      out += "  ";
+    }
+    out += e.cmd;
+    out += "\n";
+    put(a.out, out);
+  });
+  return 0;
+}
+
+static int builtin_jobs(const BuiltinArgs &a) {
+  jobs_poll(); // pick up anything that finished since the prompt
+  for (int id : job_ids()) {
+    const Job &job = job_table[id];
+    put(a.out, "[" + to_string(id) + "]  " + job_state_text(job) + "  ");
+    put(a.out, job.command);
+    put(a.out, job.state == JobQueued ? "\n" : " (" + to_string(job.pgid) + ")\n");
+  }
+  jobs_clear_done();
+  return 0;
+}
+
+// job named by argv[1], or the current one
+static Job *job_arg(const BuiltinArgs &a) {
+  Job *job = a.argc > 1 ? find_job(a.argv[1]) : current_job();
+  if (!job) {
+    put(a.err, string(a.argv[0]) + ": " + (a.argc > 1 ? a.argv[1] : "current") + ": no such job\n");
+  }
+  return job;
+}
+
+static int builtin_fg(const BuiltinArgs &a) {
+  Job *job = job_arg(a);
+  if (!job) return 1;
+  return job_foreground(*job);
+}
+
+static int builtin_bg(const BuiltinArgs &a) {
+  Job *job = job_arg(a);
+  if (!job) return 1;
+  if (job->state != JobStopped && job->state != JobQueued) return 0;
+  job_background(*job);
+  return 0;
+}
+
+// wait: everything. wait %n / pid: that job. wait -n: whichever ends first
+static int builtin_wait(const BuiltinArgs &a) {
+  if (a.argc < 2) {
+    for (int id : job_ids()) {
+      auto it = job_table.find(id);
+      if (it != job_table.end() && it->second.state != JobStopped) job_wait(it->second);
+    }
+    return 0;
+  }
+  if (string_view(a.argv[1]) == "-n") {
+    int status = 127;
+    return job_wait_any(&status) < 0 ? 127 : status;
+  }
+  int status = 0;
+  for (size_t i = 1; i < a.argc; i++) {
+    Job *job = find_job(a.argv[i]);
+    if (!job) {
+      put(a.err, string("wait: ") + a.argv[i] + ": no such job\n");
+      status = 127;
+      continue;
+    }
+    status = job_wait(*job);
+  }
+  return status;
+}
+
+static int builtin_hash(const BuiltinArgs &a) {
+  string_view first = a.argc > 1 ? a.argv[1] : "";
+  if (first == "-r") {
+    hash_reset();
+    return 0;
+  }
+
+  bool reusable = first == "-l";
+  if (a.argc > 1 && !reusable) {
+    int status = 0;
+    for (size_t i = 1; i < a.argc; i++) {
+      if (find_in_path(a.argv[i]).empty()) {
+        put(a.err, "hash: " + string(a.argv[i]) + ": not found\n");
+        status = 1;
+      } else {
+        auto it = command_hash.find(a.argv[i]);
+        if (it != command_hash.end()) it->second.hits = 0; // bash resets the count
+      }
+    }
+    return status;
+  }
+
+  if (command_hash.empty()) {
+    put(a.out, "hash: hash table empty\n");
+    return 0;
+  }
+  if (!reusable) put(a.out, "hits\tcommand\n");
+  for (const auto &[name, entry] : command_hash) {
+    if (reusable) {
+      put(a.out, "builtin hash -p " + entry.path.native() + " " + name + "\n");
+    } else {
+      put(a.out, "   " + to_string(entry.hits) + "\t" + entry.path.native() + "\n");
+    }
+  }
+  return 0;
+}
+
+// trace [on|off|clear], trace dump [FILE]: the span ring, as Chrome trace
+// JSON on stdout or into FILE
+static int builtin_trace(const BuiltinArgs &a) {
+  string_view cmd = a.argc > 1 ? a.argv[1] : "";
+  if (cmd.empty()) {
+    put(a.out, trace_enabled ? "trace on\n" : "trace off\n");
+  } else if (cmd == "on" || cmd == "off") {
+    trace_set(cmd == "on");
+  } else if (cmd == "clear") {
+    trace_clear();
+  } else if (cmd == "dump" && a.argc <= 3) {
+    if (a.argc < 3) {
+      put(a.out, trace_json());
+    } else if (!trace_dump(a.argv[2])) {
+      put(a.err, "trace: " + string(a.argv[2]) + ": " + strerror(errno) + "\n");
+      return 1;
+    }
+  } else {
+    put(a.err, "usage: trace [on|off|clear] | trace dump [file]\n");
+    return 2;
+  }
+  return 0;
+}
+
+// per-phase latencies and syscall counters; -r starts them over
+static int builtin_stats(const BuiltinArgs &a) {
+  if (a.argc > 1 && string_view(a.argv[1]) == "-r") {
+    trace_clear();
+    trace_reset_counters();
+    return 0;
+  }
+  put(a.out, trace_stats_text());
+  return 0;
+}
+
+// export NAME[=value]...; with no names, every exported variable in a form
+// that can be read back in
+static int builtin_export(const BuiltinArgs &a) {
+  if (a.argc < 2) {
+    string out;
+    for (const auto &[name, exported] : var_names()) {
+      if (!exported) continue;
+      out += "export " + name;
+      if (const char *value = var_get(name)) {
+        out += "=\"";
+        for (const char *c = value; *c; c++) {
+          if (*c == '"' || *c == '\\' || *c == '$' || *c == '`') out += '\\';
+          out += *c;
+        }
+        out += '"';
+      }
+      out += '\n';
+    }
+    put(a.out, out);
+    return 0;
+  }
+  int status = 0;
+  for (size_t i = 1; i < a.argc; i++) {
+    string_view word = a.argv[i];
+    string_view name = word.substr(0, word.find('='));
+    if (!valid_var_name(name)) {
+      put(a.err, "export: `" + string(word) + "': not a valid identifier\n");
+      status = 1;
+      continue;
+    }
+    if (name.size() < word.size()) var_assign(word);
+    var_export(name);
+  }
+  return status;
+}
+
+static int builtin_unset(const BuiltinArgs &a) {
+  int status = 0;
+  for (size_t i = 1; i < a.argc; i++) {
+    if (!valid_var_name(a.argv[i])) {
+      put(a.err, "unset: `" + string(a.argv[i]) + "': not a valid identifier\n");
+      status = 1;
+      continue;
+    }
+    var_unset(a.argv[i]);
+  }
+  return status;
+}
+
+// true, : and false: only their status, for conditions and loops
+static int builtin_true(const BuiltinArgs &) { return 0; }
+static int builtin_false(const BuiltinArgs &) { return 1; }
+
+// ---- dispatch table -------------------------------------------------------
+// the names are hashed at compile time with a seed chosen so that no two
+// land in the same slot; a lookup is one hash, one load and one compare
+
+struct BuiltinEntry {
+  string_view name;
+  BuiltinFn fn;
+  bool capturable; // no effect on the shell besides its output
+  bool reads_stdin = false;
+};
+
+static constexpr BuiltinEntry builtin_table[] = {
+  {"cd", builtin_cd, false},
+  {"echo", builtin_echo, true},
+  {"exit", builtin_exit, false},
+  {"pwd", builtin_pwd, true},
+  {"type", builtin_type, true},
+  {"history", builtin_history, true},
+  {"jobs", builtin_jobs, false},
+  {"fg", builtin_fg, false},
+  {"bg", builtin_bg, false},
+  {"wait", builtin_wait, false},
+  {"parallel", builtin_parallel, false, true}, // arguments, without :::
+  {"hash", builtin_hash, false},
+  {"trace", builtin_trace, false},
+  {"stats", builtin_stats, false},
+  {"export", builtin_export, false},
+  {"unset", builtin_unset, false},
+  {"true", builtin_true, true},
+  {"false", builtin_false, true},
+  {":", builtin_true, true},
+};
+
+constexpr size_t SLOT_BITS = 6;
+constexpr size_t SLOTS = size_t(1) << SLOT_BITS;
+constexpr size_t BUILTIN_COUNT = sizeof(builtin_table) / sizeof(builtin_table[0]);
+static_assert(BUILTIN_COUNT < SLOTS / 2, "grow SLOT_BITS");
+
+static constexpr uint32_t name_hash(string_view s, uint32_t seed) {
+  uint32_t h = 2166136261u ^ seed; // FNV-1a
+  for (char c : s) {
+    h ^= static_cast<unsigned char>(c);
+    h *= 16777619u;
+  }
+  return h ^ (h >> 16);
+}
+
+static constexpr uint32_t find_seed() {
+  for (uint32_t seed = 0; seed < 10000; seed++) {
+    bool used[SLOTS] = {};
+    bool ok = true;
+    for (const auto &e : builtin_table) {
+      size_t slot = name_hash(e.name, seed) & (SLOTS - 1);
+      if (used[slot]) {
+        ok = false;
+        break;
+      }
+      used[slot] = true;
+    }
+    if (ok) return seed;
+  }
+  return UINT32_MAX;
+}
+
+constexpr uint32_t SEED = find_seed();
+static_assert(SEED != UINT32_MAX, "no collision-free seed for the builtin table");
+
+static constexpr array<int8_t, SLOTS> make_slots() {
+  array<int8_t, SLOTS> slots{};
+  for (auto &s : slots) s = -1;
+  for (size_t i = 0; i < BUILTIN_COUNT; i++) {
+    slots[name_hash(builtin_table[i].name, SEED) & (SLOTS - 1)] = static_cast<int8_t>(i);
+  }
+  return slots;
+}
+
+static constexpr array<int8_t, SLOTS> builtin_slots = make_slots();
+
+vector<string_view> builtin_names() {
+  vector<string_view> names;
+  for (const auto &e : builtin_table) names.push_back(e.name);
+  sort(names.begin(), names.end());
+  return names;
+}
+
+static const BuiltinEntry *find_entry(string_view name) {
+  int8_t i = builtin_slots[name_hash(name, SEED) & (SLOTS - 1)];
+  if (i < 0 || builtin_table[i].name != name) return nullptr;
+  return &builtin_table[i];
+}
+
+BuiltinFn find_builtin(string_view name) {
+  const BuiltinEntry *e = find_entry(name);
+  return e ? e->fn : nullptr;
+}
+
+bool builtin_capturable(string_view name) {
+  const BuiltinEntry *e = find_entry(name);
+  return e && e->capturable;
+}
+
+bool builtin_reads_stdin(string_view name) {
+  const BuiltinEntry *e = find_entry(name);
+  return e && e->reads_stdin;
+}
@@ -0,0 +1,262 @@
+#include "completion.h"
+#include "builtins.h"
+#include "trace.h"
+#include "vars.h"
+#include <algorithm>
+#include <atomic>
+#include <cstdlib>
+#include <cstring>
+#include <mutex>
+#include <thread>
+#include <unordered_set>
+#include <dirent.h>
+#include <fcntl.h>
+#include <signal.h>
+#include <readline/readline.h>
+#include <sys/stat.h>
+#include <sys/syscall.h>
+#include <unistd.h>
+using namespace std;
+
+// never destroyed: a scan still running at exit() must not publish into
+// a dead object
+static shared_ptr<const ExecIndex> &current = *new shared_ptr<const ExecIndex>;
+static atomic<bool> scanning{false};
+// bumped by exec_index_reset(): a scan that started before it publishes nothing
+static atomic<unsigned> generation{0};
+
+shared_ptr<const ExecIndex> exec_index() { return atomic_load(&current); }
+
+static void publish(shared_ptr<ExecIndex> index, unsigned gen) {
+  if (gen == generation) atomic_store(&current, shared_ptr<const ExecIndex>(move(index)));
+}
+
+static vector<string> split_path(const string &path_env) {
+  vector<string> dirs;
+  size_t start = 0;
+  while (start <= path_env.size()) {
+    size_t end = path_env.find(':', start);
+    if (end == string::npos) end = path_env.size();
+    if (end > start) dirs.push_back(path_env.substr(start, end - start));
+    start = end + 1;
+  }
+  return dirs;
+}
+
+static bool dir_mtime(const string &dir, struct timespec &out) {
+  struct stat st;
+  trace_count(CountStats);
+  if (stat(dir.c_str(), &st) < 0) return false;
+  out = st.st_mtim;
+  return true;
+}
+
+static bool same_time(const struct timespec &a, const struct timespec &b) {
+  return a.tv_sec == b.tv_sec && a.tv_nsec == b.tv_nsec;
+}
+
+// appeared, vanished or had entries added/removed since it was scanned
+static bool dir_changed(const ExecDir &d) {
+  struct timespec now;
+  bool exists = dir_mtime(d.dir, now);
+  return exists != d.exists || (exists && !same_time(now, d.mtime));
+}
+
+struct linux_dirent64 {
+  ino64_t d_ino;
+  off64_t d_off;
+  unsigned short d_reclen;
+  unsigned char d_type;
+  char d_name[];
+};
+
+// executables directly in dir, sorted. raw getdents64 into a big buffer:
+// no DIR* and one syscall per few hundred entries; only entries that could
+// be executables (not dirs, not sockets...) get a stat
+static vector<string> scan_dir(const string &dir) {
+  vector<string> names;
+  int fd = open(dir.c_str(), O_RDONLY | O_DIRECTORY | O_CLOEXEC);
+  if (fd < 0) return names;
+
+  alignas(linux_dirent64) char buf[64 * 1024];
+  while (true) {
+    long n = syscall(SYS_getdents64, fd, buf, sizeof(buf));
+    if (n <= 0) break;
+    for (long off = 0; off < n;) {
+      auto *d = reinterpret_cast<linux_dirent64 *>(buf + off);
+      off += d->d_reclen;
+      if (d->d_name[0] == '.' && (!d->d_name[1] || (d->d_name[1] == '.' && !d->d_name[2]))) continue;
+      if (d->d_type != DT_REG && d->d_type != DT_LNK && d->d_type != DT_UNKNOWN) continue;
+
+      // same test as find_in_path: a regular file (after links) with an x bit
+      struct stat st;
+      trace_count(CountStats);
+      if (fstatat(fd, d->d_name, &st, 0) < 0) continue;
+      if (S_ISREG(st.st_mode) && (st.st_mode & (S_IXUSR | S_IXGRP | S_IXOTH))) names.push_back(d->d_name);
+    }
+  }
+  close(fd);
+  sort(names.begin(), names.end());
+  return names;
+}
+
+// snapshot of dirs as they stand, with the merged name table
+static shared_ptr<ExecIndex> snapshot(const string &path_env, const vector<ExecDir> &dirs) {
+  auto index = make_shared<ExecIndex>();
+  index->path_env = path_env;
+  index->dirs = dirs;
+  index->complete = true;
+
+  unordered_set<string_view> seen;
+  for (size_t i = 0; i < index->dirs.size(); i++) {
+    const ExecDir &d = index->dirs[i];
+    if (!d.scanned) index->complete = false;
+    for (const string &name : d.names) {
+      // earlier dirs win, like the $PATH walk
+      if (seen.insert(name).second) index->names.push_back({name, i});
+    }
+  }
+  sort(index->names.begin(), index->names.end());
+  return index;
+}
+
+// rescan whatever changed since prev, a few dirs at a time, publishing a
+// fresh snapshot after each one so completion sees results as they land
+static void start_scan(const string &path_env, shared_ptr<const ExecIndex> prev);
+
+static void scan(string path_env, shared_ptr<const ExecIndex> prev, unsigned gen) {
+  vector<ExecDir> dirs;
+  vector<size_t> todo;
+  for (string &dir : split_path(path_env)) {
+    ExecDir d{move(dir), {}, false, false, {}};
+    d.exists = dir_mtime(d.dir, d.mtime);
+    if (prev) {
+      for (const ExecDir &old : prev->dirs) {
+        if (old.dir == d.dir && old.scanned && d.exists && old.exists && same_time(old.mtime, d.mtime)) {
+          d.names = old.names;
+          d.scanned = true;
+          break;
+        }
+      }
+    }
+    if (!d.exists) d.scanned = true; // missing dir: nothing in it
+    if (!d.scanned) todo.push_back(dirs.size());
+    dirs.push_back(move(d));
+  }
+  publish(snapshot(path_env, dirs), gen);
+
+  mutex lock;
+  atomic<size_t> next{0};
+  auto worker = [&]() {
+    for (size_t k; (k = next++) < todo.size();) {
+      size_t i = todo[k];
+      vector<string> names = scan_dir(dirs[i].dir);
+      lock_guard<mutex> guard(lock);
+      dirs[i].names = move(names);
+      dirs[i].scanned = true;
+      publish(snapshot(path_env, dirs), gen);
+    }
+  };
+  size_t workers = min<size_t>(todo.size(), max(2u, thread::hardware_concurrency()));
+  vector<thread> pool;
+  for (size_t w = 1; w < workers; w++) pool.emplace_back(worker);
+  worker();
+  for (thread &t : pool) t.join();
+
+  scanning = false;
+  // reset while this ran: what it found may be what the reset was about
+  if (gen != generation && !scanning.exchange(true)) start_scan(path_env, nullptr);
+}
+
+// scanning is already set
+static void start_scan(const string &path_env, shared_ptr<const ExecIndex> prev) {
+  // the scanner must not take signals meant for the shell (SIGCHLD for the
+  // job engine's signalfd in particular), so it starts with all blocked
+  sigset_t all, old;
+  sigfillset(&all);
+  pthread_sigmask(SIG_BLOCK, &all, &old);
+  thread(scan, path_env, move(prev), unsigned(generation)).detach();
+  pthread_sigmask(SIG_SETMASK, &old, nullptr);
+}
+
+void exec_index_refresh() {
+  const char *env = var_get("PATH");
+  string path_env = env ? env : "";
+  shared_ptr<const ExecIndex> index = exec_index();
+
+  if (index && index->path_env == path_env && index->complete &&
+      none_of(index->dirs.begin(), index->dirs.end(), dir_changed)) {
+    return;
+  }
+  if (scanning.exchange(true)) return;
+  start_scan(path_env, index);
+}
+
+void exec_index_reset() {
+  generation++;
+  atomic_store(&current, shared_ptr<const ExecIndex>());
+}
+
+long exec_index_lookup(const string &path_env, string_view name) {
+  shared_ptr<const ExecIndex> index = exec_index();
+  if (!index || !index->complete || index->path_env != path_env) return -2;
+
+  auto it = lower_bound(index->names.begin(), index->names.end(), make_pair(name, size_t(0)));
+  long where = it != index->names.end() && it->first == name ? (long)it->second : -1;
+
+  // only as good as the dirs it could have come from
+  size_t upto = where < 0 ? index->dirs.size() : where + 1;
+  for (size_t i = 0; i < upto; i++) {
+    if (dir_changed(index->dirs[i])) {
+      exec_index_refresh();
+      return -2;
+    }
+  }
+  return where;
+}
+
+// readline side: a word in command position completes to builtins and
+// $PATH executables, anything else (or anything with a '/') to filenames
+
+static vector<string> matches;
+static size_t match_pos;
+
+static char *command_generator(const char *text, int state) {
+  if (state == 0) {
+    matches.clear();
+    match_pos = 0;
+    string_view prefix = text;
+    for (string_view name : builtin_names()) {
+      if (name.substr(0, prefix.size()) == prefix) matches.emplace_back(name);
+    }
+    // whatever has been scanned so far; a cold index just offers less
+    if (shared_ptr<const ExecIndex> index = exec_index()) {
+      auto it = lower_bound(index->names.begin(), index->names.end(), make_pair(prefix, size_t(0)));
+      for (; it != index->names.end() && it->first.substr(0, prefix.size()) == prefix; ++it) {
+        matches.emplace_back(it->first);
+      }
+    }
+    sort(matches.begin(), matches.end());
+    matches.erase(unique(matches.begin(), matches.end()), matches.end());
+  }
+  if (match_pos >= matches.size()) return nullptr;
+  return strdup(matches[match_pos++].c_str());
+}
+
+static bool command_position(int start) {
+  int i = start - 1;
+  while (i >= 0 && (rl_line_buffer[i] == ' ' || rl_line_buffer[i] == '\t')) i--;
+  return i < 0 || strchr("|;&", rl_line_buffer[i]);
+}
+
+static char **shell_completion(const char *text, int start, int) {
+  exec_index_refresh(); // a few stats; any rescan happens off this thread
+  if (!command_position(start) || strchr(text, '/')) return nullptr;
+  rl_attempted_completion_over = 1;
+  return rl_completion_matches(text, command_generator);
+}
+
+void completion_init() {
+  rl_attempted_completion_function = shell_completion;
+  exec_index_refresh();
+}
@@ -1,455 +1,950 @@
 #include "executor.h"
 #include "utils.h"
+#include "launcher.h"
+#include "builtins.h"
+#include "jobs.h"
+#include "trace.h"
+#include "vars.h"
+#include "expand.h"
+#include "glob.h"
+#include "pipes.h"
+#include <algorithm>
 #include <iostream>
 #include <unistd.h>
 #include <sys/wait.h>
 #include <fcntl.h>
-#include <algorithm>
 #include <signal.h>
 #include <termios.h>
-#define ALL(s) (s).begin(), (s).end()
+#include <cstring>
+#include <cerrno>
+#include <cstdlib>
+#include <string_view>
+#include <optional>
+#include <memory>
+#include <sys/mman.h>
 using namespace std;
 
-void execute(const Tree &ast) {
-  int out_fd = -1;
-  int err_fd = -1;
-  int saved_stdout = -1;
-  int saved_stderr = -1;
-  vector<Tree> filtered_children;
-
- for (size_t i = 0; i < ast.children.size(); i++) {
-    string val = ast.children[i].value;
-
-    if ((val.find(">") != string::npos) && i + 1 < ast.children.size()) {
-        string filename = ast.children[i + 1].value;
-        
-        int flags = O_WRONLY | O_CREAT;
-        if (val.find(">>") != string::npos) {
-            flags |= O_APPEND; // Keep existing content
-        } else {
-            flags |= O_TRUNC;  // Wipe existing content
-        }
+// open(2) flags for the redirections that name a file
+static int open_flags(const Redirect &rd) {
+  switch (rd.op) {
+  case RedirIn:
+    return O_RDONLY;
+  case RedirReadWrite:
+    return O_RDWR | O_CREAT;
+  case RedirAppend:
+    return O_WRONLY | O_CREAT | O_APPEND;
+  default:
+    return O_WRONLY | O_CREAT | O_TRUNC;
+  }
+}
 
-        int fd = open(filename.c_str(), flags, 0644);
-        if (fd < 0) { perror("open"); return; }
+static bool write_all(int fd, const char *p, size_t len) {
+  while (len > 0) {
+    ssize_t n = write(fd, p, len);
+    if (n < 0) {
+      if (errno == EINTR) continue;
+      return false;
+    }
+    p += n;
+    len -= n;
+  }
+  return true;
+}
 
-        if (val.find("2") != string::npos) {
-            if (err_fd != -1) close(err_fd);
-            err_fd = fd;
-        } else {
-            if (out_fd != -1) close(out_fd);
-            out_fd = fd;
-        }
-        i++;
-    } else {
-        filtered_children.push_back(ast.children[i]);
+// a read-only descriptor (O_CLOEXEC) that yields body and then EOF.
+// a body that fits goes into a pipe in one non-blocking write, so the shell
+// never waits on the reader; anything bigger (or a pipe that turns out to
+// be smaller than usual) becomes a sealed memfd, which can't fill up and
+// never touches the filesystem. -1 with errno set on failure
+static int heredoc_fd(const char *body) {
+  size_t len = strlen(body);
+  const size_t PIPE_MAX = 64 * 1024; // the default pipe capacity
+
+  if (len <= PIPE_MAX) {
+    int fds[2];
+    if (pipe2(fds, O_CLOEXEC) == 0) {
+      trace_count(CountPipes);
+      fcntl(fds[1], F_SETFL, O_NONBLOCK);
+      ssize_t n = len ? write(fds[1], body, len) : 0;
+      close(fds[1]);
+      if (n == (ssize_t)len) return fds[0];
+      close(fds[0]);
     }
-  } 
-  if (ast.type == Builtin) {
-    saved_stdout = dup(STDOUT_FILENO);
-    saved_stderr = dup(STDERR_FILENO);
-    if (out_fd != -1) {
-      dup2(out_fd, STDOUT_FILENO);
-      close(out_fd);
+  }
+
+  int fd = memfd_create("heredoc", MFD_CLOEXEC | MFD_ALLOW_SEALING);
+  if (fd < 0) return -1;
+  if (!write_all(fd, body, len) || lseek(fd, 0, SEEK_SET) < 0 ||
+      fcntl(fd, F_ADD_SEALS, F_SEAL_SHRINK | F_SEAL_GROW | F_SEAL_WRITE | F_SEAL_SEAL) < 0) {
+    int saved = errno;
+    close(fd);
+    errno = saved;
+    return -1;
+  }
+  return fd;
+}
+
+// the descriptor a file or here-document redirection puts in place, -1
+// after reporting why not. dups and closes have nothing to open
+static int open_redirect(const Redirect &rd) {
+  int fd = rd.op == RedirHereDoc ? heredoc_fd(rd.target) : open(rd.target, open_flags(rd) | O_CLOEXEC, 0644);
+  if (fd < 0) cerr << (rd.op == RedirHereDoc ? "here-document" : rd.target) << ": " << strerror(errno) << endl;
+  return fd;
+}
+
+// the environment cmd runs with: the cached envp, or with NAME=value
+// prefix assignments an overlay built into env, which has to stay alive
+// until the exec
+static char *const *command_envp(const CommandLine &line, const Command &cmd, vector<char *> &env) {
+  if (cmd.assign_count == 0) return var_envp();
+  env = env_overlay(line.assigns_of(cmd), cmd.assign_count);
+  return env.data();
+}
+
+// does redirection r dup one of the shell's internal descriptors (one no
+// earlier redirection of the command put something else on). complains
+// if so
+static bool internal_dup(const Redirect *rd, size_t r) {
+  int src = rd[r].src_fd;
+  if (!is_shell_fd(src)) return false;
+  for (size_t k = 0; k < r; k++) {
+    if (rd[k].fd == src) return false;
+  }
+  cerr << src << ": " << strerror(EBADF) << endl;
+  return true;
+}
+
+// queue a command's redirections as spawn file actions, after any pipe
+// dup2s already in spec. the IR's argv goes to the child as is.
+// here-documents are made ready here and dup'd in by the child; their
+// descriptors go into owned, for the caller to close after the spawn, and
+// a prefix assignment overlay into env. false if one couldn't be set up
+static bool plan_command(const CommandLine &line, const Command &cmd, const fs::path &path, SpawnSpec &spec,
+                         vector<int> &owned, vector<char *> &env) {
+  spec.path = path.string();
+  spec.argv = line.argv_of(cmd);
+  spec.envp = command_envp(line, cmd, env);
+
+  TraceSpan span(PhaseRedirect, line.name_of(cmd), cmd.redir_count > 0);
+  const Redirect *rd = line.redirs_of(cmd);
+  for (size_t r = 0; r < cmd.redir_count; r++) {
+    switch (rd[r].op) {
+    case RedirDup:
+      if (internal_dup(rd, r)) return false;
+      spec.actions.push_back({FdAction::Dup2, rd[r].fd, rd[r].src_fd, "", 0, 0});
+      break;
+    case RedirClose:
+      spec.actions.push_back({FdAction::Close, rd[r].fd, -1, "", 0, 0});
+      break;
+    case RedirHereDoc: {
+      int fd = open_redirect(rd[r]);
+      if (fd < 0) return false;
+      owned.push_back(fd);
+      spec.actions.push_back({FdAction::Dup2, rd[r].fd, fd, "", 0, 0});
+    } break;
+    default:
+      // opened by the child straight onto its fd, nothing to leak
+      spec.actions.push_back({FdAction::Open, rd[r].fd, -1, rd[r].target, open_flags(rd[r]), 0644});
+      break;
     }
-    if (err_fd != -1) {
-      dup2(err_fd, STDERR_FILENO);
-      close(err_fd);
+  }
+  return true;
+}
+
+// the value cmd's own prefix assignment gives var, or fallback
+static const char *prefix_value(const CommandLine &line, const Command &cmd, string_view var,
+                                const char *fallback) {
+  const char *value = fallback;
+  char *const *assigns = line.assigns_of(cmd);
+  for (size_t a = 0; a < cmd.assign_count; a++) {
+    if (strncmp(assigns[a], var.data(), var.size()) == 0 && assigns[a][var.size()] == '=') {
+      value = assigns[a] + var.size() + 1;
     }
+  }
+  return value;
+}
+
+// JOB_CPUS, JOB_NICE, JOB_IONICE and JOB_RLIMITS for one stage: its own
+// prefix assignments, over the shell's variables for a background job.
+// true when there is anything to apply
+static bool stage_sched(const CommandLine &line, const Command &cmd, bool background, SchedSpec &s) {
+  for (const char *var : sched_vars) {
+    string_view name = var;
+    const char *value = prefix_value(line, cmd, name, background ? var_get(name) : nullptr);
+    if (value && *value && !sched_set(s, name, value)) cerr << var << ": bad value `" << value << "'" << endl;
+  }
+  return !s.empty();
+}
+
+// PIPE_SIZE for the pipe stage cmd writes into, 0 to leave it be
+static size_t stage_pipe_size(const CommandLine &line, const Command &cmd) {
+  const char *value = prefix_value(line, cmd, "PIPE_SIZE", var_get("PIPE_SIZE"));
+  size_t bytes = 0;
+  if (value && *value && !parse_pipe_size(value, bytes)) {
+    cerr << "PIPE_SIZE: bad value `" << value << "'" << endl;
+  }
+  return bytes;
+}
+
+// PIPE_METER on for the shell or any of the pipeline's stages
+static bool pipeline_metered(const CommandLine &line, const Pipeline &pipeline) {
+  auto on = [](const char *v) { return v && *v && strcmp(v, "0") != 0; };
+  if (on(var_get("PIPE_METER"))) return true;
+  for (size_t i = 0; i < pipeline.cmd_count; i++) {
+    if (on(prefix_value(line, line.command(pipeline, i), "PIPE_METER", nullptr))) return true;
+  }
+  return false;
+}
+
+static void close_all(vector<int> &fds) {
+  for (int fd : fds) close(fd);
+  fds.clear();
+}
 
-    if (ast.value == "cd") {
-      if (!filtered_children.empty()) {
-          chdir_logic(filtered_children[0].value);
-      } else {
-          cout << "specify a path to continue" << endl;
+// apply each redirection in order, for a process that is about to become
+// the command (forked child / exec elision). files are opened O_CLOEXEC
+// and dup2'd into place. false if one failed
+static bool apply_redirections(const CommandLine &line, const Command &cmd) {
+  TraceSpan span(PhaseRedirect, line.name_of(cmd), cmd.redir_count > 0);
+  const Redirect *rd = line.redirs_of(cmd);
+  for (size_t r = 0; r < cmd.redir_count; r++) {
+    if (rd[r].op == RedirClose) {
+      close(rd[r].fd);
+      continue;
+    }
+    if (rd[r].op == RedirDup) {
+      if (internal_dup(rd, r)) return false;
+      // 1>&1 has to survive the exec too
+      int ok = rd[r].src_fd == rd[r].fd ? fcntl(rd[r].fd, F_SETFD, 0) : dup2(rd[r].src_fd, rd[r].fd);
+      if (ok < 0) {
+        cerr << rd[r].src_fd << ": " << strerror(errno) << endl;
+        return false;
       }
-    } else if (ast.value == "echo") {
-      for (size_t i = 0; i < filtered_children.size(); i++) {
-        cout << filtered_children[i].value << (i < filtered_children.size() - 1 ? " " : "");
+      continue;
+    }
+    int fd = open_redirect(rd[r]);
+    if (fd < 0) {
+      return false;
+    }
+    if (dup2(fd, rd[r].fd) < 0) perror("dup2");
+    close(fd);
+  }
+  return true;
+}
+
+// the descriptors a builtin running in the shell sees: 0-2 start out as
+// its in/out/err, the rest as the shell's own (bar the shell's internal
+// ones, which it doesn't see at all), and redirections rearrange entries
+// here instead of touching the shell's table
+struct BuiltinFds {
+  int low[SHELL_FD_BASE];
+  vector<pair<int, int>> high; // set entries past the low ones
+
+  BuiltinFds(int in, int out, int err) {
+    for (int fd = 0; fd < SHELL_FD_BASE; fd++) low[fd] = fd;
+    low[0] = in;
+    low[1] = out;
+    low[2] = err;
+  }
+  int get(int fd) const {
+    if (fd < SHELL_FD_BASE) return low[fd];
+    for (auto [from, to] : high) {
+      if (from == fd) return to;
+    }
+    return is_shell_fd(fd) ? -1 : fd;
+  }
+  void set(int fd, int to) {
+    if (fd < SHELL_FD_BASE) {
+      low[fd] = to;
+      return;
+    }
+    for (auto &entry : high) {
+      if (entry.first == fd) {
+        entry.second = to;
+        return;
       }
-      cout << endl;
-    } else if (ast.value == "exit") {
-      exit(0);
-    } else if (ast.value == "pwd") {
-      cout << fs::current_path().c_str() << endl;
-    } else if (ast.value == "type") {
-      for (const auto &child : filtered_children) {
-        if (find(ALL(builtins), child.value) != builtins.end()) {
-            cout << child.value << " is a shell builtin" << endl;
-        } else {
-            fs::path p = find_in_path(child.value);
-            if (!p.empty()) cout << child.value << " is " << p.string() << endl;
-            else cout << child.value << ": not found" << endl;
-        }
+    }
+    high.push_back({fd, to});
+  }
+};
+
+// run a builtin inside the current process. redirections don't touch the
+// shell's own descriptors: they rearrange the builtin's table instead,
+// files opened and handed over, dups copying entries, closes leaving -1.
+// stage: it's a pipeline stage (see put_status)
+static int run_builtin(const CommandLine &line, const Command &cmd, int in, int out, int err, bool stage = false) {
+  BuiltinFds fds(in, out, err);
+  vector<int> opened;
+  int status = 0;
+
+  {
+    TraceSpan span(PhaseRedirect, line.name_of(cmd), cmd.redir_count > 0);
+    const Redirect *rd = line.redirs_of(cmd);
+    for (size_t r = 0; r < cmd.redir_count; r++) {
+      int to = rd[r].fd;
+      if (rd[r].op == RedirClose) {
+        fds.set(to, -1);
+        continue;
       }
-    } else if (ast.value == "history") {
-        size_t start_index = history_count - manual_history_list.size() + 1;
-        size_t i = 0;
-
-        if (!filtered_children.empty()) {
-            const string& arg = filtered_children[0].value;
-            
-            bool is_numeric = !arg.empty() && std::all_of(arg.begin(), arg.end(), ::isdigit);
-
-            if (!is_numeric) {
-                cerr << "history: " << arg << ": numeric argument required" << endl;
-                return;
-            }
-
-            if (filtered_children.size() > 1) {
-                cerr << "history: too many arguments" << endl;
-                return;
-            }
-
-            try {
-                long long requested = std::stoll(arg);
-                if (requested < 0) {
-                    // technically bash handles negative numbers differently,
-                    // but for our shell, this is an error
-                    cerr << "history: " << arg << ": invalid option" << endl;
-                    return;
-                }
-                
-                size_t n = static_cast<size_t>(requested);
-                if (manual_history_list.size() > n) {
-                    i = manual_history_list.size() - n;
-                }
-            } catch (...) {
-                // handles numbers too large for long long
-                cerr << "history: " << arg << ": numeric argument required" << endl;
-                return;
-            }
-        }
-
-        for (; i < manual_history_list.size(); ++i) {
-            cout << "  " << (start_index + i) << "  " << manual_history_list[i] << endl;
-        }
-    } else if (ast.value == "jobs") {
-        for (size_t i = 0; i < jobs.size(); ++i) {
-            cout << "[" << i + 1 << "]  Running  " << jobs[i].command << " (" << jobs[i].pid << ")" << endl;
+      if (rd[r].op == RedirDup) {
+        int src = fds.get(rd[r].src_fd);
+        if (src < 0 || fcntl(src, F_GETFD) < 0) {
+          cerr << rd[r].src_fd << ": " << strerror(EBADF) << endl;
+          status = 1;
+          break;
         }
+        fds.set(to, src);
+        continue;
+      }
+      int fd = open_redirect(rd[r]);
+      if (fd < 0) {
+        status = 1;
+        break;
+      }
+      opened.push_back(fd);
+      fds.set(to, fd);
     }
+  }
 
-    // restore parent descriptors
-    if (saved_stdout != -1) {   
-      dup2(saved_stdout, STDOUT_FILENO);
-      close(saved_stdout);
+  if (status == 0 && cmd.type == Builtin) {
+    // whatever cout/cerr still hold belongs before the builtin's output
+    cout.flush();
+    cerr.flush();
+    BuiltinFn fn = find_builtin(line.name_of(cmd));
+    // NAME=value in front of a builtin holds only while it runs
+    vector<pair<string, optional<string>>> saved;
+    char *const *assigns = line.assigns_of(cmd);
+    for (size_t a = 0; a < cmd.assign_count; a++) {
+      string_view word = assigns[a];
+      string name(word.substr(0, word.find('=')));
+      const char *old = var_get(name);
+      saved.push_back({name, old ? optional<string>(old) : nullopt});
+      var_assign(word);
+    }
+    {
+      TraceSpan span(PhaseBuiltin, line.name_of(cmd));
+      status = fn(BuiltinArgs{line.argv_of(cmd), cmd.argc, fds.get(0), fds.get(1), fds.get(2)});
+      // while its redirections are still open
+      status = put_status(line.name_of(cmd), fds.get(2), status, stage);
     }
-    if (saved_stderr != -1) {
-      dup2(saved_stderr, STDERR_FILENO);
-      close(saved_stderr);
+    for (auto it = saved.rbegin(); it != saved.rend(); ++it) {
+      if (it->second) var_set(it->first, *it->second);
+      else var_unset(it->first);
     }
+  }
 
-  } else if (ast.type == ExecutableFile) {
-    sigset_t mask, oldmask;
-    sigemptyset(&mask);
-    sigaddset(&mask, SIGCHLD);
-    sigprocmask(SIG_BLOCK, &mask, &oldmask); // block before fork
+  for (int fd : opened) close(fd);
+  return status;
+}
 
-    pid_t pid = fork();
+void execute(const CommandLine &line, const Command &cmd) {
+  if (cmd.type == Builtin || cmd.type == EmptyCommand) {
+    // builtins run right here; a bare `> file` just creates the file
+    last_status = run_builtin(line, cmd, STDIN_FILENO, STDOUT_FILENO, STDERR_FILENO);
+    // with no command, NAME=value words are plain assignments
+    if (cmd.type == EmptyCommand && last_status == 0) {
+      for (size_t a = 0; a < cmd.assign_count; a++) var_assign(line.assigns_of(cmd)[a]);
+    }
+  }
+}
 
-    if (pid == 0) {
-        sigprocmask(SIG_SETMASK, &oldmask, nullptr); 
+void execute_child_logic(const CommandLine &line, const Command &cmd, const fs::path &path) {
+  const char *name = line.name_of(cmd);
 
-        if (out_fd != -1) dup2(out_fd, STDOUT_FILENO);
-        if (err_fd != -1) dup2(err_fd, STDERR_FILENO);
+  // apply redirection
+  // in a pipeline child, we just overwrite the FDs
+  // no restore needed as this process image is temporary
+  if (!apply_redirections(line, cmd)) exit(1);
 
-        vector<char*> argv;
-        argv.push_back(const_cast<char*>(ast.value.c_str()));
-        for (const auto& child : filtered_children) {
-            argv.push_back(const_cast<char*>(child.value.c_str()));
-        }
-        argv.push_back(nullptr);
-
-        execv(ast.path.c_str(), argv.data());
-        perror("execv failed");
-        exit(1);
-
-    } else if (pid > 0) {
-        if (out_fd != -1) close(out_fd);
-        if (err_fd != -1) close(err_fd);
-
-        if (!ast.is_background) {
-            // FOREGROUND: The shell waits
-            int status;
-            if (waitpid(pid, &status, WUNTRACED) > 0) {
-                // reclaim terminal
-                tcsetpgrp(STDIN_FILENO, getpgrp());
-                tcsetattr(STDIN_FILENO, TCSADRAIN, &shell_tmodes);
-
-                if (WIFEXITED(status)) {
-                    int code = WEXITSTATUS(status);
-                    if (code != 0) cout << "Error code " << code << " encountered" << endl;
-                } else if (WIFSIGNALED(status)) {
-                    cout << "Terminated by signal " << WTERMSIG(status) << endl;
-                }
-            }
-        } else {
-            // BACKGROUND: The shell records and moves on immediately
-            jobs.push_back({pid, ast.value, true});
-            cout << "[" << jobs.size() << "] " << pid << endl;
-            // no waitpid here
-        }
+  // execution Switch
+  switch (cmd.type) {
+  case Builtin: {
+    // same implementation as in the shell, on the already redirected fds;
+    // this process is the builtin's alone, so its assignments can just stay
+    for (size_t a = 0; a < cmd.assign_count; a++) var_assign(line.assigns_of(cmd)[a]);
+    BuiltinFn fn = find_builtin(name);
+    int status = fn(BuiltinArgs{line.argv_of(cmd), cmd.argc, STDIN_FILENO, STDOUT_FILENO, STDERR_FILENO});
+    exit(put_status(name, STDERR_FILENO, status));
+  } break;
 
-        // unblock SIGCHLD so handler can work
-        sigprocmask(SIG_SETMASK, &oldmask, nullptr);
-    } else {
-        perror("fork failed");
-        sigprocmask(SIG_SETMASK, &oldmask, nullptr); // cleanup on error
+  case ExecutableFile: {
+    if (path.empty()) {
+      cerr << name << ": command not found" << endl;
+      exit(1);
     }
-  } else {
-    cout << ast.value << ": command not found" << endl;
-    if (out_fd != -1) close(out_fd);
-    if (err_fd != -1) close(err_fd);
+
+    // replace the child process image with the program
+    vector<char *> env;
+    execve(path.c_str(), line.argv_of(cmd), command_envp(line, cmd, env));
+
+    perror("execve failed");
+    exit(1);
+  } break;
+
+  default:
+    break;
   }
 }
-void execute_child_logic(const Tree &ast) {
-  int out_fd = -1;
-  int err_fd = -1;
-  vector<Tree> filtered_children;
-
-  // scan for redirection tokens: ">", "1>", or "2>"
-  for (size_t i = 0; i < ast.children.size(); i++) {
-    string val = ast.children[i].value;
-
-    if ((val.find(">") != string::npos) && i + 1 < ast.children.size()) {
-        string filename = ast.children[i + 1].value;
-        
-        int flags = O_WRONLY | O_CREAT;
-        if (val.find(">>") != string::npos) {
-            flags |= O_APPEND; // keep existing content
-        } else {
-            flags |= O_TRUNC;  // wipe existing content
-        }
 
-        int fd = open(filename.c_str(), flags, 0644);
-        if (fd < 0) { perror("open"); return; }
+// run a builtin pipeline stage inside the shell, reading in_fd and writing
+// straight into out_fd. SIGPIPE is ignored meanwhile so a reader that went away gives the
+// builtin EPIPE instead of killing the shell
+static int run_builtin_stage(const CommandLine &line, const Command &cmd, int in_fd, int out_fd) {
+  struct sigaction ign, old_pipe;
+  memset(&ign, 0, sizeof(ign));
+  ign.sa_handler = SIG_IGN;
+  sigaction(SIGPIPE, &ign, &old_pipe);
 
-        if (val.find("2") != string::npos) {
-            if (err_fd != -1) close(err_fd);
-            err_fd = fd;
-        } else {
-            if (out_fd != -1) close(out_fd);
-            out_fd = fd;
-        }
-        i++;
-    } else {
-        filtered_children.push_back(ast.children[i]);
-    }
-  }
+  int status = run_builtin(line, cmd, in_fd, out_fd, STDERR_FILENO, true);
 
-  // apply redirection
-  // in a pipeline child, we just overwrite FD 1 or FD 2
-  // no restore needed as this process image is temporary
-  if (out_fd != -1) {
-    if (dup2(out_fd, STDOUT_FILENO) < 0) { 
-      perror("dup2 stdout"); 
-      exit(1); 
-    }
-    close(out_fd);
+  sigaction(SIGPIPE, &old_pipe, nullptr);
+  return status;
+}
+
+// the pipe from stage i to stage i+1, O_CLOEXEC so a spawned stage keeps
+// only the ends it dup2s onto 0 and 1. metered, stage i writes into one
+// pipe and stage i+1 reads another, and the relay's ends between them go
+// into links. false (nothing left open) on failure
+static bool open_stage_pipe(size_t size, bool metered, int &write_end, int &read_end,
+                            vector<pair<int, int>> &links) {
+  int fds[2];
+  if (pipe2(fds, O_CLOEXEC) < 0) return false;
+  trace_count(CountPipes);
+  if (size) set_pipe_size(fds[1], size);
+  if (!metered) {
+    write_end = fds[1];
+    read_end = fds[0];
+    return true;
+  }
+  int down[2];
+  if (pipe2(down, O_CLOEXEC) < 0) {
+    close(fds[0]);
+    close(fds[1]);
+    return false;
   }
+  trace_count(CountPipes);
+  if (size) set_pipe_size(down[1], size);
+  // only the relay's own ends; the stages keep blocking pipes
+  fcntl(fds[0], F_SETFL, O_NONBLOCK);
+  fcntl(down[1], F_SETFL, O_NONBLOCK);
+  write_end = fds[1];
+  read_end = down[0];
+  links.push_back({fds[0], down[1]});
+  return true;
+}
 
-  if (err_fd != -1) {
-    if (dup2(err_fd, STDERR_FILENO) < 0) { 
-      perror("dup2 stderr"); 
-      exit(1); 
+// stages go up one at a time, each with just the pipe to its right made
+// for it: the shell holds the read end that feeds the next stage and
+// nothing else (bar the ends of the in-process builtin stage, and the
+// relay's when metered), so the work and the descriptors stay linear in the
+// number of stages
+LaunchedPipeline launch_pipeline(const CommandLine &line, const Pipeline &pipeline, pid_t pgid,
+                                 const PipelineIO &io) {
+  int n = pipeline.cmd_count;
+  LaunchedPipeline job;
+  job.pgid = pgid;
+  if (n == 0) return job;
+
+  bool metered = io.foreground && n > 1 && pipeline_metered(line, pipeline);
+  bool grow = false;
+  vector<pair<int, int>> links;
+
+  // a foreground pipeline's last builtin stage runs inside the shell, after
+  // the spawns. only the one: the shell can't run two stages at once, and
+  // one of them waiting on the other would hang it, so any other builtin
+  // stage is forked
+  int inproc = -1;
+  if (io.foreground) {
+    for (int i = n - 1; i >= 0 && inproc < 0; i--) {
+      const Command &cmd = line.command(pipeline, i);
+      if (cmd.type == Builtin && strcmp(line.name_of(cmd), "exit") != 0) inproc = i;
     }
-    close(err_fd);
-  }
-  // if process is background, it needs its own group id
-  if (ast.is_background) {
-      setpgid(0, 0); 
   }
+  int inproc_in = -1, inproc_out = -1; // its ends, open until it runs
+  // what a forked builtin stage has to close: it never execs, so
+  // O_CLOEXEC does nothing for it
+  vector<int> held;
 
-  // execution Switch
-  switch (ast.type) {
-  case Builtin: {
-    if (ast.value == "cd") {
-      if (!filtered_children.empty()) {
-          chdir_logic(filtered_children[0].value);
+  int stage_in = io.in; // the read end feeding stage i
+  bool failed = false;
+  for (int i = 0; i < n; i++) {
+    const Command &cmd = line.command(pipeline, i);
+    pid_t pid = -1;
+    // where this stage's 0/1/2 come from, before its own redirections
+    int stage_out = io.out;
+    int next_in = -1;
+    if (i < n - 1) {
+      size_t size = stage_pipe_size(line, cmd);
+      if (size == PIPE_AUTO) {
+        // unmetered nobody sees a pipe fill up, so it starts out as big as it gets
+        grow = metered;
+        size = metered ? 0 : pipe_max_size();
       }
-    } else if (ast.value == "echo") {
-      for (size_t i = 0; i < filtered_children.size(); i++) {
-        cout << filtered_children[i].value;
-        if (i < filtered_children.size() - 1) cout << " ";
+      if (!open_stage_pipe(size, metered, stage_out, next_in, links)) {
+        perror("pipe");
+        failed = true;
+        break;
       }
-      cout << endl;
-    } else if (ast.value == "exit") {
-      exit(0);
-    } else if (ast.value == "pwd") {
-      cout << fs::current_path().c_str() << endl;
-    } else if (ast.value == "type") {
-      for (const auto &child : filtered_children) {
-        if (find(ALL(builtins), child.value) != builtins.end()) {
-            cout << child.value << " is a shell builtin" << endl;
-        } else {
-            fs::path p = find_in_path(child.value);
-            if (!p.empty()) cout << child.value << " is " << p.string() << endl;
-            else cout << child.value << ": not found" << endl;
-        }
+    }
+    // resolved in the parent so hash hits/inserts survive the fork
+    fs::path path;
+    if (cmd.type == ExecutableFile) path = find_in_path(line.name_of(cmd));
+    bool keep = false; // the shell still needs stage_in and stage_out
+
+    if (cmd.type == ExecutableFile && !path.empty()) {
+      // external command: spawn without copying the shell
+      SpawnSpec spec;
+      // redirect input from previous pipe / output to current pipe; every
+      // other pipe end is O_CLOEXEC and goes away at the exec
+      if (stage_in != STDIN_FILENO) spec.actions.push_back({FdAction::Dup2, STDIN_FILENO, stage_in, "", 0, 0});
+      if (stage_out != STDOUT_FILENO) spec.actions.push_back({FdAction::Dup2, STDOUT_FILENO, stage_out, "", 0, 0});
+      if (io.err != STDERR_FILENO) spec.actions.push_back({FdAction::Dup2, STDERR_FILENO, io.err, "", 0, 0});
+      vector<int> owned;
+      vector<char *> env;
+      SchedSpec sched;
+      if (stage_sched(line, cmd, pipeline.background, sched)) spec.sched = &sched;
+      if (plan_command(line, cmd, path, spec, owned, env)) {
+        spec.pgid = job.pgid;
+        pid = spawn_process(spec);
+        if (pid < 0) cerr << line.name_of(cmd) << ": " << strerror(errno) << endl;
       }
-    } else if (ast.value == "history") {
-      size_t start_index = history_count - manual_history_list.size() + 1;
-      size_t i = 0;
-
-      if (!filtered_children.empty()) {
-          const string& arg = filtered_children[0].value;
-          
-          bool is_numeric = !arg.empty() && std::all_of(arg.begin(), arg.end(), ::isdigit);
-
-          if (!is_numeric) {
-              cerr << "history: " << arg << ": numeric argument required" << endl;
-              exit(1);
-          }
-
-          if (filtered_children.size() > 1) {
-              cerr << "history: too many arguments" << endl;
-              return;
-          }
-
-          try {
-              long long requested = std::stoll(arg);
-              if (requested < 0) {
-                  // technically bash handles negative numbers differently,
-                  // but for our shell, this is an error
-                  cerr << "history: " << arg << ": invalid option" << endl;
-                  return;
-              }
-              
-              size_t n = static_cast<size_t>(requested);
-              if (manual_history_list.size() > n) {
-                  i = manual_history_list.size() - n;
-              }
-          } catch (...) {
-              // handles numbers too large for long long
-              cerr << "history: " << arg << ": numeric argument required" << endl;
-              return;
-          }
+      close_all(owned);
+    } else if (cmd.type == ExecutableFile) {
+      // nothing to run; the pipe ends get closed below so neighbours see EOF
+      cerr << line.name_of(cmd) << ": command not found" << endl;
+    } else if (cmd.type == EmptyCommand) {
+      if (i == n - 1) job.last_stage_status = 0;
+    } else if (i == inproc) {
+      // no fork, it writes straight into the pipe once the other stages
+      // are up and draining. one that never reads lets go of its input
+      // now, so upstream gets SIGPIPE instead of filling the pipe
+      if (i > 0 && builtin_reads_stdin(line.name_of(cmd))) {
+        inproc_in = stage_in;
+        held.push_back(stage_in);
+      } else if (i > 0) {
+        close(stage_in);
       }
-
-      for (; i < manual_history_list.size(); ++i) {
-          cout << "  " << (start_index + i) << "  " << manual_history_list[i] << endl;
+      if (i < n - 1) {
+        inproc_out = stage_out;
+        held.push_back(stage_out);
       }
-    } else if (ast.value == "jobs") {
-        for (size_t i = 0; i < jobs.size(); ++i) {
-            cout << "[" << i + 1 << "]  Running  " << jobs[i].command << " (" << jobs[i].pid << ")" << endl;
+      keep = true;
+    } else {
+      // the other builtins (and exit, which must not take the shell down
+      // from inside a pipeline) still need a forked child.
+      // flush first or the child would print our pending output a second time
+      SchedSpec sched;
+      bool scheduled = stage_sched(line, cmd, pipeline.background, sched);
+      flush_output();
+      trace_count(CountForks);
+      {
+        TraceSpan span(PhaseFork, line.name_of(cmd));
+        pid = fork();
+      }
+      if (pid == 0) {
+
+        // signals back to defaults in the child
+        reset_child_signals();
+        if (job.pgid >= 0) setpgid(0, job.pgid);
+        if (scheduled) apply_sched(sched, line.name_of(cmd));
+
+        // redirect input from previous pipe / output to current pipe
+        if (stage_in != STDIN_FILENO && dup2(stage_in, STDIN_FILENO) < 0) perror("dup2 input");
+        if (stage_out != STDOUT_FILENO && dup2(stage_out, STDOUT_FILENO) < 0) perror("dup2 output");
+        if (io.err != STDERR_FILENO && dup2(io.err, STDERR_FILENO) < 0) perror("dup2 error");
+
+        // and close the pipe ends that aren't its own
+        if (i > 0) close(stage_in);
+        if (i < n - 1) {
+          close(stage_out);
+          close(next_in);
+        }
+        for (int fd : held) close(fd);
+        for (auto [src, dst] : links) {
+          close(src);
+          close(dst);
         }
+
+        execute_child_logic(line, cmd, path);
+        exit(0);
+      } else if (pid < 0) {
+        perror("fork failed");
+      } else if (job.pgid >= 0) {
+        setpgid(pid, job.pgid ? job.pgid : pid); // both sides, whoever runs first
+      }
     }
-  } break;
 
-  case ExecutableFile: {
-    vector<char*> argv;
-    argv.push_back(const_cast<char*>(ast.value.c_str()));
+    if (pid > 0) {
+      job.pids.push_back(pid);
+      // the whole pipeline shares the first stage's group
+      if (job.pgid == 0) {
+        job.pgid = pid;
+        // foreground job: the terminal is theirs before any builtin stage
+        // below gets going
+        if (io.foreground) give_terminal(job.pgid);
+      }
+      if (i == n - 1) job.last_pid = pid;
+    }
 
-    for (const auto& child : filtered_children) {
-      argv.push_back(const_cast<char*>(child.value.c_str()));
+    // the child has its copies now
+    if (!keep) {
+      if (i > 0) close(stage_in);
+      if (i < n - 1) close(stage_out);
     }
-    argv.push_back(nullptr);
+    stage_in = next_in;
+  }
 
-    // replace the child process image with the program
-    execv(ast.path.c_str(), argv.data());
+  if (failed) {
+    // the stages already up see EOF or SIGPIPE at the break
+    if (stage_in != io.in) close(stage_in);
+    for (int fd : held) close(fd);
+    for (auto [src, dst] : links) {
+      close(src);
+      close(dst);
+    }
+    return job;
+  }
 
-    perror("execv failed");
-    exit(1);
-  } break;
+  // the relay has to be running before a builtin stage below starts
+  // writing into it
+  if (metered) {
+    vector<string> names;
+    for (int i = 0; i < n; i++) {
+      const Command &cmd = line.command(pipeline, i);
+      names.push_back(cmd.argc ? line.name_of(cmd) : "-");
+    }
+    job.meter = meter_start(move(links), move(names), grow);
+  }
 
-  default:
-    // ensure error messages go to current STDERR (which might be redirected)
-    cerr << ast.value << ": command not found" << endl;
-    exit(1);
-    break;
+  if (inproc >= 0) {
+    int in = inproc > 0 ? inproc_in : io.in;
+    int out = inproc < n - 1 ? inproc_out : io.out;
+    int status = run_builtin_stage(line, line.command(pipeline, inproc), in, out);
+    if (inproc_in >= 0) close(inproc_in); // upstream gets SIGPIPE from now on
+    if (inproc_out >= 0) close(inproc_out); // downstream sees EOF
+    if (inproc == n - 1) job.last_stage_status = status;
   }
+  return job;
 }
-void execute_pipeline(const vector<Tree> &pipeline) {
-  int n = pipeline.size();
+
+// pipeline p of line as a line of its own that owns every word, for a
+// job that starts after line is gone
+static CommandLine own_pipeline(const CommandLine &line, const Pipeline &p) {
+  CommandLine out;
+  auto copy = [&](const char *s) { return const_cast<char *>(out.arena.copy(s).data()); };
+  for (size_t c = 0; c < p.cmd_count; c++) {
+    const Command &cmd = line.command(p, c);
+    Command next = cmd;
+    next.assign_begin = out.argv.size();
+    for (size_t a = 0; a < cmd.assign_count; a++) out.argv.push_back(copy(line.assigns_of(cmd)[a]));
+    next.argv_begin = out.argv.size();
+    for (size_t a = 0; a < cmd.argc; a++) out.argv.push_back(copy(line.argv_of(cmd)[a]));
+    out.argv.push_back(nullptr);
+    next.redir_begin = out.redirs.size();
+    for (size_t r = 0; r < cmd.redir_count; r++) {
+      Redirect rd = line.redirs_of(cmd)[r];
+      rd.target = copy(rd.target);
+      out.redirs.push_back(rd);
+    }
+    out.commands.push_back(next);
+  }
+  out.pipelines.push_back(Pipeline{0, p.cmd_count, p.background});
+  return out;
+}
+
+void execute_pipeline(const CommandLine &line, const Pipeline &pipeline) {
+  int n = pipeline.cmd_count;
   if (n == 0) return;
 
   // if only one command, we run it normally
-  if (n == 1 && pipeline[0].type == Builtin) {
-      execute(pipeline[0]); 
+  if (n == 1 && line.command(pipeline, 0).type != ExecutableFile) {
+      int subst_status = last_status;
+      execute(line, line.command(pipeline, 0));
+      // x=$(cmd) alone keeps cmd's status
+      if (line.command(pipeline, 0).type == EmptyCommand && pipeline.substituted && last_status == 0) {
+          last_status = subst_status;
+      }
       return;
   }
 
-  int pipefds[2 * (n - 1)];
-  for (int i = 0; i < n - 1; i++) {
-      if (pipe(pipefds + i * 2) < 0) {
-          perror("pipe");
-          return;
+  bool is_bg = pipeline.background;
+
+  // reconstruct the full command string: "cmd arg | cmd arg"
+  string cmd_str = "";
+  for (int i = 0; i < n; ++i) {
+      const Command &cmd = line.command(pipeline, i);
+      // command name and all arguments
+      for (size_t a = 0; a < cmd.argc; a++) {
+          if (a > 0) cmd_str += " ";
+          cmd_str += line.argv_of(cmd)[a];
+      }
+
+      // add pipe separator if this isn't the last command
+      if (i < n - 1) {
+          cmd_str += " | ";
       }
   }
-  sigset_t mask, oldmask;
-  sigemptyset(&mask);
-  sigaddset(&mask, SIGCHLD);
-  sigprocmask(SIG_BLOCK, &mask, &oldmask);
 
-  vector<pid_t> children_pids;
+  if (is_bg && !jobs_slot_free()) {
+      // $JOBS_MAX are running: it waits in the queue, with its own copy
+      // of the words since this line is gone by the time it starts
+      last_status = 0;
+      auto owned = make_shared<CommandLine>(own_pipeline(line, pipeline));
+      int id = job_enqueue(cmd_str, [owned]() {
+          PipelineIO io;
+          io.foreground = false;
+          LaunchedPipeline job = launch_pipeline(*owned, owned->pipelines[0], 0, io);
+          return make_pair(job.pgid, job.pids);
+      });
+      if (interactive) cout << "[" << id << "] queued" << endl;
+      return;
+  }
 
-  for (int i = 0; i < n; i++) {
-    pid_t pid = fork();
-    if (pid == 0) {
+  // own process group for background jobs, and for every job when we do
+  // job control; 0 = "the first stage leads it"
+  pid_t pgid = (is_bg || interactive) ? 0 : -1;
+  PipelineIO io;
+  io.foreground = !is_bg;
+  LaunchedPipeline job = launch_pipeline(line, pipeline, pgid, io);
+
+  if (is_bg) {
+      last_status = 0;
+      if (job.pids.empty()) return;
+      // hand it to the job engine, which reaps it whenever it finishes
+      int id = job_add(job.pgid, job.pids, cmd_str);
+      if (interactive) cout << "[" << id << "] " << job.pids.back() << endl;
+      return; 
+  }
+
+  // then wait for the children/foreground
+  // the pipeline's status is the status of its last stage
+  int status = wait_foreground(job.pgid, job.pids, cmd_str);
+  last_status = job.last_pid != -1 ? status : job.last_stage_status;
+  if (job.meter) {
+      bool stopped = any_of(job_table.begin(), job_table.end(), [&](const auto &j) {
+          return j.second.pgid == job.pgid && j.second.state == JobStopped;
+      });
+      meter_finish(job.meter, !stopped);
+  }
+}
 
-      // unblock signals in the child
-      sigprocmask(SIG_SETMASK, &oldmask, nullptr);
+// pipeline p of line, expanded right before it starts (after whatever ran
+// before it, so `x=1; echo $x` sees the new x)
+static void run_pipeline(const CommandLine &line, size_t p, bool exec_last) {
+  CommandLine expanded;
+  bool expand = line.pipelines[p].expand;
+  if (expand) expanded = expand_pipeline(line, line.pipelines[p]);
+  const CommandLine &cur = expand ? expanded : line;
+  const Pipeline &pipeline = expand ? expanded.pipelines[0] : line.pipelines[p];
+
+  // exec elision: nothing runs after this command, so there is
+  // nobody to wait for it. become it instead of forking
+  if (exec_last && pipeline.cmd_count == 1 && !pipeline.background && !jobs_queued() &&
+      cur.command(pipeline, 0).type == ExecutableFile) {
+    const Command &cmd = cur.command(pipeline, 0);
+    fs::path path = find_in_path(cur.name_of(cmd));
+    if (!path.empty()) {
+      flush_output();
+      // nothing runs at exit after this, so the trace goes out now
+      trace_record(PhaseExec, trace_now(), trace_now(), cur.name_of(cmd));
+      trace_count(CountExecs);
+      trace_dump_at_exit();
+      SchedSpec sched;
+      if (stage_sched(cur, cmd, false, sched)) apply_sched(sched, cur.name_of(cmd));
+      execute_child_logic(cur, cmd, path); // only returns on a redirection error
+      exit(1);
+    }
+  }
 
-      // redirect input from previous pipe
-      if (i > 0) {
-        if (dup2(pipefds[(i - 1) * 2], STDIN_FILENO) < 0) perror("dup2 input");
-      }
-      // redirect output to current pipe
-      if (i < n - 1) {
-          if (dup2(pipefds[i * 2 + 1], STDOUT_FILENO) < 0) perror("dup2 output");        
-      }
+  execute_pipeline(cur, pipeline);
+}
 
-      // close all pipe FDs in the child
-      for (int j = 0; j < 2 * (n - 1); j++) {
-          close(pipefds[j]);
-      }
+// the words of a for list or a case word/pattern pipeline, expanded
+static void words_of(const CommandLine &line, uint32_t p, vector<string> &out) {
+  out.clear();
+  const Pipeline &pipeline = line.pipelines[p];
+  CommandLine expanded;
+  if (pipeline.expand) expanded = expand_pipeline(line, pipeline);
+  const CommandLine &cur = pipeline.expand ? expanded : line;
+  const Command &cmd = cur.command(pipeline.expand ? expanded.pipelines[0] : pipeline, 0);
+  for (size_t a = 0; a < cmd.argc; a++) out.emplace_back(cur.argv_of(cmd)[a]);
+}
 
-      execute_child_logic(pipeline[i]);
-      exit(0);
-    } else if (pid < 0) {
-      perror("fork failed");
-    } else if (pid > 0) {
-      children_pids.push_back(pid);
+// a loop being run: its status so far and, for for, the words left
+struct LoopState {
+  int status = 0;
+  vector<string> words;
+  size_t next = 0;
+};
+
+// walk line.code. the pipelines were parsed and checked once; a loop only
+// jumps back, so each iteration costs its expansions and the commands
+static void run_code(const CommandLine &line) {
+  const vector<Instr> &code = line.code;
+  vector<LoopState> loops;
+  vector<string> subjects; // case words, innermost last
+  vector<string> words;
+  for (size_t pc = 0; pc < code.size();) {
+    const Instr &in = code[pc++];
+    switch (in.op) {
+    case OpRun:
+      run_pipeline(line, in.arg, false);
+      if (last_status == 128 + SIGINT) return; // ^C stops the loop too, not just the command
+      break;
+    case OpJump:
+      pc = in.target;
+      break;
+    case OpJumpIfFail:
+      if (last_status != 0) pc = in.target;
+      break;
+    case OpJumpIfOk:
+      if (last_status == 0) pc = in.target;
+      break;
+    case OpSetStatus:
+      last_status = in.arg;
+      break;
+    case OpLoopEnter:
+      loops.emplace_back();
+      break;
+    case OpForBegin:
+      loops.emplace_back();
+      words_of(line, in.arg, loops.back().words);
+      break;
+    case OpForNext: {
+      LoopState &loop = loops.back();
+      if (loop.next == loop.words.size()) pc = in.target;
+      else var_set(in.name, loop.words[loop.next++]);
+    } break;
+    case OpSaveStatus:
+      loops.back().status = last_status;
+      break;
+    case OpLoopExit:
+      last_status = loops.back().status;
+      loops.pop_back();
+      break;
+    case OpCaseBegin:
+      words_of(line, in.arg, words);
+      subjects.push_back(words.empty() ? "" : move(words[0]));
+      break;
+    case OpCaseMatch: {
+      words_of(line, in.arg, words);
+      bool hit = any_of(words.begin(), words.end(), [&](const string &pat) { return glob_match(pat, subjects.back()); });
+      if (hit) last_status = 0;
+      else pc = in.target;
+    } break;
+    case OpCasePop:
+      subjects.pop_back();
+      break;
     }
   }
+}
 
-  // parent must close all its copies of the pipes
-  for (int j = 0; j < 2 * (n - 1); j++) {
-      close(pipefds[j]);
+void execute_line(const CommandLine &line, bool exec_last) {
+  if (!line.error.empty() || line.incomplete) {
+    cerr << (line.error.empty() ? "syntax error: unexpected end of file" : line.error) << endl;
+    last_status = 2;
+    return;
   }
+  if (!line.code.empty()) {
+    run_code(line);
+    return;
+  }
+  for (size_t p = 0; p < line.pipelines.size(); p++) {
+    run_pipeline(line, p, exec_last && p + 1 == line.pipelines.size());
+  }
+}
 
- if (!pipeline.empty() && pipeline[0].is_background) {
-      // reconstruct the full command string: "cmd arg | cmd arg"
-      string cmd_str = "";
-      for (size_t i = 0; i < pipeline.size(); ++i) {
-          cmd_str += pipeline[i].value; // add command name 
+// everything until EOF on fd, read straight into the string's spare room
+static void read_all(int fd, string &out) {
+  size_t len = out.size();
+  while (true) {
+    if (out.size() - len < 4096) out.resize(max<size_t>(out.size() * 2, 16384));
+    ssize_t n = read(fd, &out[len], out.size() - len);
+    if (n < 0 && errno == EINTR) continue;
+    if (n <= 0) break;
+    len += n;
+  }
+  out.resize(len);
+}
 
-          // add all arguments
-          for (const auto& child : pipeline[i].children) {
-              cmd_str += " " + child.value;
-          }
+string command_output(string_view text) {
+  CommandLine line = check(parse(text));
+  string out;
+  if (line.pipelines.empty()) {
+    // nothing to run: $() is empty, or $(fi) didn't parse
+    if (line.error.empty() && !line.incomplete) {
+      last_status = 0;
+    } else {
+      cerr << (line.error.empty() ? "syntax error: unexpected end of file" : line.error) << endl;
+      last_status = 2;
+    }
+    return out;
+  }
 
-          // add pipe separator if this isn't the last command
-          if (i < pipeline.size() - 1) {
-              cmd_str += " | ";
-          }
-      }
+  CommandLine expanded;
+  bool single = line.pipelines.size() == 1 && line.code.empty() && line.error.empty() && !line.incomplete;
+  if (single && line.pipelines[0].expand) expanded = expand_pipeline(line, line.pipelines[0]);
+  const CommandLine &cur = single && line.pipelines[0].expand ? expanded : line;
 
-      // add the reconstructed string to the jobs list
-      jobs.push_back({children_pids.back(), cmd_str, true});
-      cout << "[" << jobs.size() << "] " << children_pids.back() << endl;
-      
-      sigprocmask(SIG_SETMASK, &oldmask, nullptr);
-      return; 
-  }
-  // then wait for the children/foreground
-  for (int i = 0; i < n; i++) {
-    waitpid(children_pids[i], nullptr, 0);
+  // a lone command, the one case that might not need a process
+  const Command *only = single && cur.pipelines[0].cmd_count == 1 ? &cur.command(cur.pipelines[0], 0) : nullptr;
+
+  if (only && only->type == Builtin && only->redir_count == 0 && builtin_capturable(cur.name_of(*only))) {
+    // no process at all: the builtin's put()s land in out
+    string *outer = set_capture(&out);
+    last_status = run_builtin(cur, *only, STDIN_FILENO, CAPTURE_FD, STDERR_FILENO);
+    set_capture(outer);
+  } else {
+    int fds[2];
+    if (pipe2(fds, O_CLOEXEC) < 0) {
+      perror("pipe");
+      last_status = 1;
+      return out;
+    }
+    trace_count(CountPipes);
+    vector<pid_t> pids;
+    pid_t last = -1; // whose status it is; without one, status as it stands
+    int status = 0;
+    if (single) {
+      // every stage a child (builtins forked too: the shell is busy reading)
+      PipelineIO io;
+      io.out = fds[1];
+      io.foreground = false;
+      LaunchedPipeline job = launch_pipeline(cur, cur.pipelines[0], -1, io);
+      pids = job.pids;
+      last = job.last_pid;
+      status = job.last_stage_status;
+    } else {
+      // several pipelines: a subshell runs them, so cd, exit and
+      // assignments in there stay in there
+      flush_output();
+      trace_count(CountForks);
+      pid_t pid = fork();
+      if (pid == 0) {
+        reset_child_signals();
+        interactive = false;
+        dup2(fds[1], STDOUT_FILENO);
+        close(fds[0]);
+        close(fds[1]);
+        execute_line(line, true);
+        flush_output();
+        _exit(last_status);
+      }
+      if (pid < 0) perror("fork failed");
+      else pids.push_back(last = pid);
+    }
+    close(fds[1]);
+    read_all(fds[0], out);
+    close(fds[0]);
+
+    for (pid_t pid : pids) {
+      int raw = 0;
+      while (waitpid(pid, &raw, 0) < 0 && errno == EINTR) {}
+      if (pid == last) status = exit_code(raw);
+    }
+    last_status = status;
   }
 
-  // reclaim terminal
-  tcsetpgrp(STDIN_FILENO, getpgrp());
-  tcsetattr(STDIN_FILENO, TCSADRAIN, &shell_tmodes);
-  sigprocmask(SIG_SETMASK, &oldmask, nullptr);
-}
\ No newline at end of file
+  while (!out.empty() && out.back() == '\n') out.pop_back();
+  return out;
+}
@@ -0,0 +1,264 @@
+#include "expand.h"
+#include "builtins.h" // is_builtin(), to classify expanded names
+#include "executor.h"
+#include "glob.h"
+#include "jobs.h"
+#include "utils.h"
+#include "vars.h"
+#include <unistd.h>
+using namespace std;
+
+namespace {
+
+bool glob_char(char c) { return c == '*' || c == '?' || c == '['; }
+
+// collects the fields of one word. in Fields mode text that came out of an
+// unquoted expansion gets split, and unquoted * ? [ make the field a glob
+// pattern; quoted text, even "", always counts as part of a field.
+// Pattern mode keeps the escaped pattern as its one field
+struct FieldBuilder {
+  vector<string> &fields;
+  bool split;
+  bool globbing; // track pattern
+  string_view ifs;
+  string cur;
+  string pattern;    // cur with its quoted glob characters escaped
+  bool have = false; // cur is a field even while empty
+  bool glob = false;
+
+  void literal(char c) {
+    cur += c;
+    have = true;
+    if (!globbing) return;
+    if (glob_char(c) || c == '\\') pattern += '\\';
+    pattern += c;
+  }
+  void literal(string_view s) {
+    for (char c : s) literal(c);
+    have = true;
+  }
+  // a character of the word itself, outside quotes
+  void bare(char c) {
+    cur += c;
+    have = true;
+    if (!globbing) return;
+    pattern += c;
+    glob = glob || glob_char(c);
+  }
+  void unquoted(string_view s) {
+    if (!split) {
+      if (globbing) {
+        for (char c : s) bare(c);
+      } else {
+        cur += s;
+      }
+      return;
+    }
+    for (char c : s) {
+      if (ifs.find(c) == string_view::npos) bare(c);
+      else end();
+    }
+  }
+  void end() {
+    // a pattern that matches nothing stays as it was written
+    if (!split) fields.push_back(move(globbing ? pattern : cur));
+    else if (have && !(glob && glob_expand(pattern, fields))) fields.push_back(move(cur));
+    cur.clear();
+    pattern.clear();
+    have = false;
+    glob = false;
+  }
+};
+
+bool name_char(char c) {
+  return c == '_' || (c >= 'a' && c <= 'z') || (c >= 'A' && c <= 'Z') || (c >= '0' && c <= '9');
+}
+
+size_t substitutions = 0; // run so far, for Pipeline::substituted
+
+// $(...) or `...` at raw[i]: the command's output, and the offset past it
+size_t substitution(string_view raw, size_t i, string &value) {
+  substitutions++;
+  size_t end = substitution_end(raw, i);
+  bool closed = raw[end - 1] == (raw[i] == '`' ? '`' : ')') && end - i > (raw[i] == '`' ? 1u : 2u);
+  if (raw[i] == '`') {
+    // inside backquotes a backslash only escapes $ ` and itself
+    string text;
+    for (size_t j = i + 1; j < end - closed; j++) {
+      if (raw[j] == '\\' && j + 1 < end - closed && (raw[j + 1] == '$' || raw[j + 1] == '`' || raw[j + 1] == '\\')) j++;
+      text += raw[j];
+    }
+    value = command_output(text);
+  } else {
+    value = command_output(raw.substr(i + 2, end - closed - i - 2));
+  }
+  return end;
+}
+
+// the expansion at raw[i] == '$': its value, and the offset right after
+// it. npos when nothing expands there (a lone $, ${ with no }, $(( which
+// would be arithmetic), the $ is just a character then
+size_t parameter(string_view raw, size_t i, string &value) {
+  size_t n = raw.size();
+  if (i + 1 >= n) return string_view::npos;
+  switch (raw[i + 1]) {
+  case '(':
+    if (i + 2 < n && raw[i + 2] == '(') return string_view::npos;
+    return substitution(raw, i, value);
+  case '?':
+    value = to_string(last_status);
+    return i + 2;
+  case '$':
+    value = to_string(getpid());
+    return i + 2;
+  case '!':
+    value = last_bg_pid ? to_string(last_bg_pid) : "";
+    return i + 2;
+  }
+
+  string_view name;
+  size_t next;
+  if (raw[i + 1] == '{') {
+    size_t close = raw.find('}', i + 2);
+    if (close == string_view::npos) return string_view::npos;
+    name = raw.substr(i + 2, close - i - 2);
+    next = close + 1;
+  } else {
+    next = i + 1;
+    while (next < n && name_char(raw[next])) next++;
+    name = raw.substr(i + 1, next - i - 1);
+  }
+  if (!valid_var_name(name)) return string_view::npos;
+  const char *v = var_get(name);
+  value = v ? v : "";
+  return next;
+}
+
+// here-document body: no quotes, a backslash only escapes $ ` \ and newline
+void expand_heredoc(string_view raw, string &out) {
+  string value;
+  size_t n = raw.size();
+  for (size_t i = 0; i < n;) {
+    char c = raw[i];
+    size_t next;
+    if (c == '\\' && i + 1 < n && (raw[i + 1] == '$' || raw[i + 1] == '`' || raw[i + 1] == '\\' || raw[i + 1] == '\n')) {
+      if (raw[i + 1] != '\n') out += raw[i + 1];
+      i += 2;
+    } else if ((c == '$' && (next = parameter(raw, i, value)) != string_view::npos) ||
+               (c == '`' && (next = substitution(raw, i, value)))) {
+      out += value;
+      i = next;
+    } else {
+      out += c;
+      i++;
+    }
+  }
+}
+
+} // namespace
+
+// one pass: quotes, backslashes, $, ` and globs are dealt with as they come, with the
+// same quoting rules parse() applies to words that don't expand
+void expand_word(string_view raw, ExpandMode mode, vector<string> &fields) {
+  if (mode == ExpandHereDoc) {
+    string out;
+    expand_heredoc(raw, out);
+    fields.push_back(move(out));
+    return;
+  }
+
+  const char *ifs = var_get("IFS");
+  FieldBuilder f{fields, mode == ExpandFields, mode == ExpandFields || mode == ExpandPattern, ifs ? ifs : " \t\n"};
+  string value;
+  bool dq = false;
+  size_t n = raw.size();
+  for (size_t i = 0; i < n;) {
+    char c = raw[i];
+    size_t next;
+    if (c == '\\') {
+      if (i + 1 >= n) {
+        i++; // a trailing backslash escapes nothing
+      } else if (!dq || raw[i + 1] == '"' || raw[i + 1] == '\\' || raw[i + 1] == '$' || raw[i + 1] == '`') {
+        f.literal(raw[i + 1]);
+        i += 2;
+      } else {
+        f.literal('\\');
+        i++;
+      }
+    } else if (c == '\'' && !dq) {
+      size_t close = raw.find('\'', i + 1);
+      if (close == string_view::npos) close = n;
+      f.literal(raw.substr(i + 1, close - i - 1));
+      i = close + 1;
+    } else if (c == '"') {
+      dq = !dq;
+      f.have = true;
+      i++;
+    } else if ((c == '$' && (next = parameter(raw, i, value)) != string_view::npos) ||
+               (c == '`' && (next = substitution(raw, i, value)))) {
+      if (dq) f.literal(value);
+      else f.unquoted(value);
+      i = next;
+    } else if (dq) {
+      f.literal(c);
+      i++;
+    } else {
+      f.bare(c);
+      i++;
+    }
+  }
+  f.end();
+}
+
+CommandLine expand_pipeline(const CommandLine &line, const Pipeline &p) {
+  CommandLine out;
+  vector<string> fields;
+  size_t ran = substitutions;
+  auto expanded = [&](size_t w, ExpandMode mode) {
+    fields.clear();
+    expand_word(line.argv[w], mode, fields);
+    for (const string &f : fields) out.argv.push_back(const_cast<char *>(out.arena.copy(f).data()));
+    return fields.size();
+  };
+
+  for (size_t c = 0; c < p.cmd_count; c++) {
+    const Command &cmd = line.command(p, c);
+    Command next = cmd;
+
+    next.assign_begin = out.argv.size();
+    for (size_t w = cmd.assign_begin; w < cmd.assign_begin + cmd.assign_count; w++) {
+      if (line.expand_of(w) == ExpandNone) out.argv.push_back(line.argv[w]);
+      else expanded(w, ExpandString);
+    }
+
+    next.argv_begin = out.argv.size();
+    next.argc = 0;
+    for (size_t w = cmd.argv_begin; w < cmd.argv_begin + cmd.argc; w++) {
+      if (line.expand_of(w) == ExpandNone) {
+        out.argv.push_back(line.argv[w]);
+        next.argc++;
+      } else {
+        next.argc += expanded(w, line.expand_of(w));
+      }
+    }
+    out.argv.push_back(nullptr);
+    // the name may only exist now, or be gone ($empty)
+    next.type = next.argc == 0 ? EmptyCommand : is_builtin(out.argv[next.argv_begin]) ? Builtin : ExecutableFile;
+
+    next.redir_begin = out.redirs.size();
+    const Redirect *rd = line.redirs_of(cmd);
+    for (size_t r = 0; r < cmd.redir_count; r++) {
+      Redirect copy = rd[r];
+      if (copy.expand != ExpandNone) {
+        fields.clear();
+        expand_word(copy.target, copy.expand, fields);
+        copy.target = out.arena.copy(fields[0]).data();
+        copy.expand = ExpandNone;
+      }
+      out.redirs.push_back(copy);
+    }
+    out.commands.push_back(next);
+  }
+  out.pipelines.push_back(Pipeline{0, p.cmd_count, p.background, false, substitutions != ran});
+  return out;
+}
@@ -0,0 +1,400 @@
+#include "glob.h"
+#include "trace.h"
+#include <algorithm>
+#include <array>
+#include <atomic>
+#include <cctype>
+#include <cstdint>
+#include <cstring>
+#include <map>
+#include <memory>
+#include <mutex>
+#include <thread>
+#include <dirent.h>
+#include <fcntl.h>
+#include <sys/stat.h>
+#include <sys/syscall.h>
+#include <unistd.h>
+using namespace std;
+
+namespace {
+
+// ---- matcher --------------------------------------------------------------
+// a component compiles to literal runs, ?, * and byte sets. matching is
+// linear with backtracking to the last *, and a * followed by a literal
+// jumps straight to where that literal next occurs
+
+struct Op {
+  enum Kind : uint8_t { Lit, One, Star, Set } kind;
+  string lit;                // Lit
+  array<uint64_t, 4> set{};  // Set: a bit per byte
+};
+
+struct Matcher {
+  vector<Op> ops;
+  string suffix;      // trailing literal, checked before anything else
+  size_t min_len = 0; // bytes any match needs at least
+  bool dot = false;   // starts with a literal '.', so may match hidden names
+
+  bool match(string_view name) const;
+};
+
+bool in_set(const array<uint64_t, 4> &set, unsigned char c) { return set[c >> 6] >> (c & 63) & 1; }
+
+bool Matcher::match(string_view name) const {
+  if (name.size() < min_len || (!name.empty() && name[0] == '.' && !dot)) return false;
+  if (!suffix.empty() && name.compare(name.size() - suffix.size(), suffix.size(), suffix) != 0) return false;
+
+  size_t oi = 0, ni = 0, star_oi = string::npos, star_ni = 0;
+  const size_t n = name.size();
+  while (true) {
+    if (oi < ops.size()) {
+      const Op &op = ops[oi];
+      if (op.kind == Op::Star) {
+        star_oi = oi++;
+        if (oi == ops.size()) return true; // a trailing * takes the rest
+        if (ops[oi].kind == Op::Lit) {
+          ni = name.find(ops[oi].lit, ni);
+          if (ni == string::npos) return false;
+        }
+        star_ni = ni;
+        continue;
+      }
+      if (ni < n) {
+        bool ok = op.kind == Op::One || (op.kind == Op::Set && in_set(op.set, name[ni])) ||
+                  (op.kind == Op::Lit && name.compare(ni, op.lit.size(), op.lit) == 0);
+        if (ok) {
+          ni += op.kind == Op::Lit ? op.lit.size() : 1;
+          oi++;
+          continue;
+        }
+      }
+    } else if (ni == n) {
+      return true;
+    }
+    // mismatch: the last * takes one more byte and we go again from there
+    if (star_oi == string::npos || star_ni >= n) return false;
+    oi = star_oi + 1;
+    star_ni++;
+    if (ops[oi].kind == Op::Lit) {
+      star_ni = name.find(ops[oi].lit, star_ni);
+      if (star_ni == string::npos) return false;
+    }
+    ni = star_ni;
+  }
+}
+
+// [...] starting at pat[i] == '[' into set. the offset past its ']', or
+// npos if there is no ']' (the '[' is an ordinary character then)
+size_t compile_set(string_view pat, size_t i, array<uint64_t, 4> &set) {
+  static const pair<string_view, int (*)(int)> classes[] = {
+    {"alpha", isalpha}, {"digit", isdigit}, {"alnum", isalnum}, {"upper", isupper},
+    {"lower", islower}, {"space", isspace}, {"punct", ispunct}, {"xdigit", isxdigit},
+  };
+  size_t n = pat.size(), j = i + 1;
+  bool negate = j < n && (pat[j] == '!' || pat[j] == '^');
+  if (negate) j++;
+  set = {};
+  auto add = [&](unsigned char lo, unsigned char hi) {
+    for (unsigned c = lo; c <= hi; c++) set[c >> 6] |= uint64_t(1) << (c & 63);
+  };
+
+  for (bool first = true; j < n && (pat[j] != ']' || first); first = false) {
+    if (pat[j] == '[' && j + 1 < n && pat[j + 1] == ':') {
+      size_t close = pat.find(":]", j + 2);
+      auto cls = find_if(begin(classes), end(classes),
+                         [&](const auto &c) { return close != string_view::npos && pat.substr(j + 2, close - j - 2) == c.first; });
+      if (cls != end(classes)) {
+        for (int c = 0; c < 256; c++) {
+          if (cls->second(c)) add(c, c);
+        }
+        j = close + 2;
+        continue;
+      }
+    }
+    if (pat[j] == '\\' && j + 1 < n) j++;
+    unsigned char lo = pat[j++], hi = lo;
+    if (j + 1 < n && pat[j] == '-' && pat[j + 1] != ']') {
+      j++;
+      if (pat[j] == '\\' && j + 1 < n) j++;
+      hi = pat[j++];
+    }
+    add(lo, hi);
+  }
+  if (j >= n) return string_view::npos;
+  if (negate) {
+    for (uint64_t &w : set) w = ~w;
+  }
+  return j + 1;
+}
+
+Matcher compile(string_view pat) {
+  Matcher m;
+  string lit;
+  auto flush = [&]() {
+    if (lit.empty()) return;
+    m.min_len += lit.size();
+    m.ops.push_back(Op{Op::Lit, move(lit)});
+    lit.clear();
+  };
+  for (size_t i = 0; i < pat.size();) {
+    char c = pat[i];
+    Op set{Op::Set, ""};
+    size_t end;
+    if (c == '\\' && i + 1 < pat.size()) {
+      lit += pat[i + 1];
+      i += 2;
+    } else if (c == '*') {
+      flush();
+      if (m.ops.empty() || m.ops.back().kind != Op::Star) m.ops.push_back(Op{Op::Star, ""});
+      i++;
+    } else if (c == '?') {
+      flush();
+      m.ops.push_back(Op{Op::One, ""});
+      m.min_len++;
+      i++;
+    } else if (c == '[' && (end = compile_set(pat, i, set.set)) != string_view::npos) {
+      flush();
+      m.ops.push_back(move(set));
+      m.min_len++;
+      i = end;
+    } else {
+      lit += c;
+      i++;
+    }
+  }
+  flush();
+  m.dot = !m.ops.empty() && m.ops[0].kind == Op::Lit && m.ops[0].lit[0] == '.';
+  if (!m.ops.empty() && m.ops.back().kind == Op::Lit) m.suffix = m.ops.back().lit;
+  return m;
+}
+
+string unescape(string_view pat) {
+  string out;
+  for (size_t i = 0; i < pat.size(); i++) {
+    if (pat[i] == '\\' && i + 1 < pat.size()) i++;
+    out += pat[i];
+  }
+  return out;
+}
+
+// ---- directory listings ---------------------------------------------------
+// every name of a directory in one buffer, with its d_type. cached by
+// device and inode, valid while the directory's mtime is unchanged
+
+struct linux_dirent64 {
+  ino64_t d_ino;
+  off64_t d_off;
+  unsigned short d_reclen;
+  unsigned char d_type;
+  char d_name[];
+};
+
+struct Listing {
+  string names;           // NUL separated
+  vector<uint32_t> start; // offset of each name
+  vector<uint8_t> type;   // its d_type
+  struct timespec mtime{};
+
+  size_t size() const { return start.size(); }
+  const char *name(size_t i) const { return names.data() + start[i]; }
+};
+
+const size_t CACHE_NAMES = size_t(1) << 21; // names cached in total before it starts over
+
+mutex cache_lock;
+map<pair<dev_t, ino_t>, shared_ptr<const Listing>> cache;
+size_t cached_names = 0;
+
+bool same_time(const struct timespec &a, const struct timespec &b) {
+  return a.tv_sec == b.tv_sec && a.tv_nsec == b.tv_nsec;
+}
+
+// dir's listing ("" is the current directory), nullptr if it can't be read
+shared_ptr<const Listing> list_dir(const string &dir) {
+  const char *path = dir.empty() ? "." : dir.c_str();
+  struct stat st;
+  trace_count(CountStats);
+  if (stat(path, &st) < 0 || !S_ISDIR(st.st_mode)) return nullptr;
+  auto key = make_pair(st.st_dev, st.st_ino);
+  {
+    lock_guard<mutex> guard(cache_lock);
+    auto it = cache.find(key);
+    if (it != cache.end() && same_time(it->second->mtime, st.st_mtim)) return it->second;
+  }
+
+  int fd = open(path, O_RDONLY | O_DIRECTORY | O_CLOEXEC);
+  if (fd < 0) return nullptr;
+  auto listing = make_shared<Listing>();
+  // stamped before reading, so a change made meanwhile shows up next time
+  if (fstat(fd, &st) == 0) listing->mtime = st.st_mtim;
+
+  alignas(linux_dirent64) char buf[64 * 1024];
+  while (true) {
+    long n = syscall(SYS_getdents64, fd, buf, sizeof(buf));
+    if (n <= 0) break;
+    for (long off = 0; off < n;) {
+      auto *d = reinterpret_cast<linux_dirent64 *>(buf + off);
+      off += d->d_reclen;
+      if (d->d_name[0] == '.' && (!d->d_name[1] || (d->d_name[1] == '.' && !d->d_name[2]))) continue;
+      listing->start.push_back(listing->names.size());
+      listing->type.push_back(d->d_type);
+      listing->names.append(d->d_name, strlen(d->d_name) + 1);
+    }
+  }
+  close(fd);
+
+  // an mtime within the last couple of seconds may not move again for a
+  // change made in the same clock tick; such a listing isn't kept
+  struct timespec now;
+  clock_gettime(CLOCK_REALTIME, &now);
+  if (now.tv_sec - listing->mtime.tv_sec >= 2) {
+    lock_guard<mutex> guard(cache_lock);
+    if (cached_names + listing->size() > CACHE_NAMES) {
+      cache.clear();
+      cached_names = 0;
+    }
+    auto &slot = cache[key];
+    if (slot) cached_names -= slot->size();
+    slot = listing;
+    cached_names += listing->size();
+  }
+  return listing;
+}
+
+// is dir + name a directory. follow: a symlink to one counts
+bool is_dir(const string &dir, const char *name, uint8_t type, bool follow) {
+  if (type == DT_DIR) return true;
+  if (type != DT_UNKNOWN && (type != DT_LNK || !follow)) return false;
+  struct stat st;
+  trace_count(CountStats);
+  string path = dir + name;
+  return (follow ? stat(path.c_str(), &st) : lstat(path.c_str(), &st)) == 0 && S_ISDIR(st.st_mode);
+}
+
+// fn(i, out) for every i < n, spread over the cores once there is enough
+// to go around; the outs are concatenated in no particular order
+template <class Fn> vector<string> gather(size_t n, Fn fn) {
+  const size_t PARALLEL_MIN = 4;
+  size_t workers = n < PARALLEL_MIN ? 1 : min<size_t>(n, max(1u, thread::hardware_concurrency()));
+  vector<vector<string>> outs(workers);
+  atomic<size_t> next{0};
+  auto worker = [&](size_t w) {
+    for (size_t i; (i = next++) < n;) fn(i, outs[w]);
+  };
+  vector<thread> pool;
+  for (size_t w = 1; w < workers; w++) pool.emplace_back(worker, w);
+  worker(0);
+  for (thread &t : pool) t.join();
+
+  vector<string> all = move(outs[0]);
+  for (size_t w = 1; w < workers; w++) all.insert(all.end(), make_move_iterator(outs[w].begin()), make_move_iterator(outs[w].end()));
+  return all;
+}
+
+// dirs and every directory below them, a level at a time with each level's
+// directories read in parallel
+vector<string> walk(vector<string> dirs) {
+  vector<string> level = dirs;
+  while (!level.empty()) {
+    level = gather(level.size(), [&](size_t i, vector<string> &out) {
+      shared_ptr<const Listing> l = list_dir(level[i]);
+      if (!l) return;
+      for (size_t e = 0; e < l->size(); e++) {
+        const char *name = l->name(e);
+        if (name[0] != '.' && is_dir(level[i], name, l->type[e], false)) out.push_back(level[i] + name + '/');
+      }
+    });
+    dirs.insert(dirs.end(), level.begin(), level.end());
+  }
+  return dirs;
+}
+
+} // namespace
+
+bool glob_has_meta(string_view pattern) {
+  for (size_t i = 0; i < pattern.size(); i++) {
+    char c = pattern[i];
+    if (c == '\\') i++;
+    else if (c == '*' || c == '?' || c == '[') return true;
+  }
+  return false;
+}
+
+void glob_cache_clear() {
+  lock_guard<mutex> guard(cache_lock);
+  cache.clear();
+  cached_names = 0;
+}
+
+bool glob_expand(string_view pattern, vector<string> &out) {
+  if (!glob_has_meta(pattern)) return false;
+  string detail(pattern.substr(0, 34));
+  TraceSpan span(PhaseGlob, detail.c_str());
+
+  vector<string_view> comps;
+  for (size_t at = 0; at < pattern.size();) {
+    size_t slash = min(pattern.find('/', at), pattern.size());
+    if (slash > at) comps.push_back(pattern.substr(at, slash - at));
+    at = slash + 1;
+  }
+  // a trailing / keeps only directories, and stays on them
+  bool dirs_only = pattern.back() == '/';
+
+  // every path matched so far; all but the last component end in '/'
+  vector<string> paths{pattern[0] == '/' ? "/" : ""};
+  for (size_t k = 0; k < comps.size() && !paths.empty(); k++) {
+    bool last = k + 1 == comps.size() && !dirs_only;
+    string_view comp = comps[k];
+
+    if (comp == "**") {
+      paths = walk(move(paths));
+      if (!last) continue;
+      comp = "*"; // ending in **: everything in all of them
+    }
+
+    if (!glob_has_meta(comp)) {
+      // no scan for a literal; one in the middle that isn't there shows up
+      // as an unreadable directory at the next component
+      string lit = unescape(comp);
+      vector<string> kept;
+      for (string &p : paths) {
+        p += lit;
+        if (k + 1 == comps.size()) {
+          struct stat st;
+          trace_count(CountStats);
+          if ((dirs_only ? stat(p.c_str(), &st) : lstat(p.c_str(), &st)) < 0) continue;
+          if (dirs_only && !S_ISDIR(st.st_mode)) continue;
+        }
+        if (!last) p += '/';
+        kept.push_back(move(p));
+      }
+      paths = move(kept);
+      continue;
+    }
+
+    Matcher m = compile(comp);
+    paths = gather(paths.size(), [&](size_t i, vector<string> &next) {
+      const string &dir = paths[i];
+      shared_ptr<const Listing> l = list_dir(dir);
+      if (!l) return;
+      for (size_t e = 0; e < l->size(); e++) {
+        const char *name = l->name(e);
+        if (!m.match(name)) continue;
+        if (last) next.push_back(dir + name);
+        else if (is_dir(dir, name, l->type[e], true)) next.push_back(dir + name + '/');
+      }
+    });
+  }
+  if (paths.empty()) return false;
+
+  sort(paths.begin(), paths.end());
+  out.insert(out.end(), make_move_iterator(paths.begin()), make_move_iterator(paths.end()));
+  return true;
+}
+
+bool glob_match(string_view pattern, string_view text) {
+  Matcher m = compile(pattern);
+  m.dot = true; // not a file name: a leading . is nothing special
+  return m.match(text);
+}
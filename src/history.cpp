@@ -0,0 +1,383 @@
+#include "history.h"
+#include "utils.h"
+#include "vars.h"
+#include <algorithm>
+#include <atomic>
+#include <cerrno>
+#include <cstdlib>
+#include <cstring>
+#include <ctime>
+#include <iostream>
+#include <string>
+#include <thread>
+#include <vector>
+#include <fcntl.h>
+#include <limits.h>
+#include <sys/file.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+using namespace std;
+
+// file layout: a one page header, then records back to back up to capacity.
+//
+//   record: size, state, seq, status, time, cwd_len, cmd_len, cwd, cmd,
+//           padding to 8, size again (so the log can be walked backwards)
+//
+// a writer reserves size bytes with one fetch_add on tail, writes both size
+// fields, then the body, then flips state to committed. the tail packs the
+// record count above the offset so numbering comes from the same atomic add
+// and always follows file order.
+// once a reservation runs past capacity the file is sealed: the tail never
+// comes back, so every later append overflows too and goes off to compact
+
+static const char LOG_MAGIC[8] = {'M', 'Y', 'S', 'H', 'H', 'I', 'S', 'T'};
+static const uint32_t LOG_VERSION = 1;
+static const uint64_t HEADER_SIZE = 4096;
+static const uint64_t LOG_CAPACITY = 4 << 20; // to start with: compaction grows it
+static const size_t MAX_CMD = 65536; // longer lines are cut, like a tty would
+static const int OFFSET_BITS = 40;
+static const uint64_t OFFSET_MASK = (uint64_t(1) << OFFSET_BITS) - 1;
+
+enum RecordState : uint32_t { InFlight = 0, Committed = 1, Filler = 2 };
+
+struct LogHeader {
+  char magic[8];
+  uint32_t version;
+  uint32_t header_size;
+  uint64_t capacity;
+  uint64_t base_seq; // records dropped by earlier compactions
+  atomic<uint64_t> tail; // (seq << OFFSET_BITS) | offset of the next record
+};
+
+struct LogRecord {
+  atomic<uint32_t> size; // whole record, trailer included
+  atomic<uint32_t> state;
+  uint32_t seq;
+  atomic<int32_t> status;
+  int64_t time;
+  uint32_t cwd_len;
+  uint32_t cmd_len;
+};
+
+static_assert(atomic<uint64_t>::is_always_lock_free, "tail must work across processes");
+static_assert(atomic<uint32_t>::is_always_lock_free, "record fields must work across processes");
+static_assert(sizeof(LogRecord) == 32, "on-disk layout");
+
+static char *base = nullptr;
+static LogHeader *hdr = nullptr;
+static int log_fd = -1;        // -1: private in-memory log
+static string log_path;
+static uint64_t map_size = 0;   // of the mapping, at least hdr->capacity
+static uint64_t generation = 0; // bumped on every remap, so stale marks are ignored
+
+static uint64_t align8(uint64_t n) { return (n + 7) & ~uint64_t(7); }
+
+static LogRecord *record_at(uint64_t off) { return reinterpret_cast<LogRecord *>(base + off); }
+
+static atomic<uint32_t> *trailer_at(uint64_t end) {
+  return reinterpret_cast<atomic<uint32_t> *>(base + end - sizeof(uint32_t));
+}
+
+// a writer that reserved space fills it right away; give it a moment
+// before treating the slot as abandoned
+static uint32_t wait_nonzero(atomic<uint32_t> *word) {
+  for (int i = 0; i < 10000; i++) {
+    uint32_t v = word->load(memory_order_acquire);
+    if (v) return v;
+    if (i > 100) this_thread::yield();
+  }
+  return 0;
+}
+
+static void init_header(char *mem, uint64_t capacity, uint64_t base_seq) {
+  LogHeader *h = reinterpret_cast<LogHeader *>(mem);
+  memcpy(h->magic, LOG_MAGIC, sizeof(LOG_MAGIC));
+  h->version = LOG_VERSION;
+  h->header_size = HEADER_SIZE;
+  h->capacity = capacity;
+  h->base_seq = base_seq;
+  h->tail.store(HEADER_SIZE, memory_order_release);
+}
+
+// any capacity that fits the file: compaction writes bigger ones than
+// LOG_CAPACITY, and a file that got longer behind our back is still fine
+static bool valid_header(const char *mem, uint64_t file_size) {
+  const LogHeader *h = reinterpret_cast<const LogHeader *>(mem);
+  return memcmp(h->magic, LOG_MAGIC, sizeof(LOG_MAGIC)) == 0 && h->version == LOG_VERSION &&
+         h->header_size == HEADER_SIZE && h->capacity > HEADER_SIZE && h->capacity <= file_size &&
+         h->capacity <= OFFSET_MASK;
+}
+
+static void unmap() {
+  if (base) munmap(base, map_size);
+  shell_fd_close(log_fd);
+  base = nullptr;
+  hdr = nullptr;
+  log_fd = -1;
+  generation++;
+}
+
+static void map_private() {
+  void *mem = mmap(nullptr, LOG_CAPACITY, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_ANONYMOUS, -1, 0);
+  if (mem == MAP_FAILED) return;
+  base = static_cast<char *>(mem);
+  init_header(base, LOG_CAPACITY, 0);
+  hdr = reinterpret_cast<LogHeader *>(base);
+  map_size = LOG_CAPACITY;
+}
+
+// (re)open log_path, initialising it if it's new. false if it's unusable
+static bool map_file() {
+  int fd = open(log_path.c_str(), O_RDWR | O_CREAT | O_CLOEXEC, 0600);
+  if (fd < 0) return false;
+
+  flock(fd, LOCK_EX); // only to serialise creating the header
+  struct stat st;
+  bool ok = fstat(fd, &st) == 0;
+  if (ok && st.st_size == 0) ok = ftruncate(fd, LOG_CAPACITY) == 0 && fstat(fd, &st) == 0;
+
+  void *mem = ok ? mmap(nullptr, st.st_size, PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0) : MAP_FAILED;
+  if (mem != MAP_FAILED) {
+    char *m = static_cast<char *>(mem);
+    if (reinterpret_cast<LogHeader *>(m)->magic[0] == 0) init_header(m, st.st_size, 0);
+    if (!valid_header(m, st.st_size)) {
+      munmap(mem, st.st_size);
+      mem = MAP_FAILED;
+    }
+  }
+  flock(fd, LOCK_UN);
+
+  if (mem == MAP_FAILED) {
+    close(fd);
+    return false;
+  }
+  base = static_cast<char *>(mem);
+  hdr = reinterpret_cast<LogHeader *>(base);
+  map_size = st.st_size;
+  log_fd = shell_fd(fd);
+  return true;
+}
+
+void history_open() {
+  const char *file = var_get("HISTFILE");
+  const char *home = var_get("HOME");
+  if (file && *file) log_path = file;
+  else if (home && *home) log_path = string(home) + "/.myshell_history";
+
+  if (!log_path.empty() && map_file()) return;
+  if (!log_path.empty()) cerr << "history: " << log_path << ": not usable, keeping history in memory" << endl;
+  log_path.clear();
+  map_private();
+}
+
+// offsets of the newest committed records, newest first, at most n of them
+// (every one when n is 0), stopping early once keep_bytes worth are in or
+// at the first one numbered `after` or lower
+static vector<uint64_t> newest(size_t n, uint64_t keep_bytes = 0, uint64_t after = 0) {
+  vector<uint64_t> offs;
+  uint64_t end = min(hdr->tail.load(memory_order_acquire) & OFFSET_MASK, hdr->capacity);
+  uint64_t kept = 0;
+  while (end > HEADER_SIZE && (n == 0 || offs.size() < n)) {
+    uint32_t size = wait_nonzero(trailer_at(end));
+    if (size == 0 || size > end - HEADER_SIZE) break; // writer died mid-append
+    end -= size;
+    if (size < sizeof(LogRecord)) continue; // filler
+    LogRecord *rec = record_at(end);
+    if (wait_nonzero(&rec->state) != Committed) continue;
+    if (after && hdr->base_seq + rec->seq + 1 <= after) break;
+    kept += size;
+    if (keep_bytes && kept > keep_bytes) break;
+    offs.push_back(end);
+  }
+  return offs;
+}
+
+static HistoryEntry entry_at(uint64_t off) {
+  LogRecord *rec = record_at(off);
+  const char *text = base + off + sizeof(LogRecord);
+  return HistoryEntry{hdr->base_seq + rec->seq + 1, rec->time, rec->status.load(memory_order_relaxed),
+                      string_view(text, rec->cwd_len), string_view(text + rec->cwd_len, rec->cmd_len)};
+}
+
+// the file we have mapped got compacted and replaced? then map the new one
+static bool refresh() {
+  if (log_fd < 0) return false;
+  struct stat ours, current;
+  if (fstat(log_fd, &ours) < 0 || stat(log_path.c_str(), &current) < 0) return false;
+  if (ours.st_ino == current.st_ino && ours.st_dev == current.st_dev) return false;
+  unmap();
+  if (!map_file()) map_private();
+  return true;
+}
+
+// our append ran past the end: copy every record into a new log with room
+// for as much again and put it in place, so history is never dropped, only
+// the filler and abandoned slots are. the file lock only makes sure one
+// session does the copy; appends never take it
+static void compact() {
+  if (log_fd >= 0) {
+    flock(log_fd, LOCK_EX);
+    if (refresh()) {
+      flock(log_fd, LOCK_UN); // somebody else already did it
+      return;
+    }
+  }
+
+  // sealed: nothing new lands in this file, only in-flight writers finish
+  vector<uint64_t> keep = newest(0);
+  uint64_t live = 0;
+  for (uint64_t off : keep) live += record_at(off)->size.load(memory_order_relaxed);
+  uint64_t capacity = max(LOG_CAPACITY, (HEADER_SIZE + live) * 2);
+  capacity = (capacity + HEADER_SIZE - 1) / HEADER_SIZE * HEADER_SIZE;
+  if (capacity > OFFSET_MASK) {
+    // past what an offset in the tail can say (a terabyte): the newest half
+    keep = newest(0, OFFSET_MASK / 4);
+    capacity = OFFSET_MASK / 2 / HEADER_SIZE * HEADER_SIZE;
+  }
+  uint64_t base_seq = hdr->base_seq + (keep.empty() ? 0 : record_at(keep.back())->seq);
+  if (keep.empty()) base_seq = hdr->base_seq + (hdr->tail.load() >> OFFSET_BITS);
+
+  int fd = -1;
+  string tmp;
+  void *mem;
+  if (log_fd >= 0) {
+    tmp = log_path + ".tmp." + to_string(getpid());
+    fd = open(tmp.c_str(), O_RDWR | O_CREAT | O_TRUNC | O_CLOEXEC, 0600);
+    mem = fd >= 0 && ftruncate(fd, capacity) == 0
+              ? mmap(nullptr, capacity, PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0)
+              : MAP_FAILED;
+  } else {
+    mem = mmap(nullptr, capacity, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_ANONYMOUS, -1, 0);
+  }
+  if (mem == MAP_FAILED) {
+    // can't make the new file: start over in memory rather than lose appends
+    if (fd >= 0) {
+      close(fd);
+      unlink(tmp.c_str());
+    }
+    if (log_fd >= 0) flock(log_fd, LOCK_UN);
+    unmap();
+    map_private();
+    return;
+  }
+
+  char *fresh = static_cast<char *>(mem);
+  init_header(fresh, capacity, base_seq);
+  uint64_t off = HEADER_SIZE;
+  uint32_t seq = 0;
+  for (size_t i = keep.size(); i-- > 0;) {
+    LogRecord *rec = record_at(keep[i]);
+    uint32_t size = rec->size.load(memory_order_relaxed);
+    memcpy(fresh + off, rec, size);
+    reinterpret_cast<LogRecord *>(fresh + off)->seq = seq++;
+    off += size;
+  }
+  reinterpret_cast<LogHeader *>(fresh)->tail.store((uint64_t(seq) << OFFSET_BITS) | off);
+
+  if (log_fd >= 0) {
+    if (rename(tmp.c_str(), log_path.c_str()) < 0) unlink(tmp.c_str());
+    flock(log_fd, LOCK_UN);
+  }
+  unmap();
+  base = fresh;
+  hdr = reinterpret_cast<LogHeader *>(base);
+  map_size = capacity;
+  log_fd = shell_fd(fd);
+}
+
+HistoryMark history_append(string_view line) {
+  if (!hdr) return HistoryMark{0, 0};
+  if (line.size() > MAX_CMD) line = line.substr(0, MAX_CMD);
+  char cwd_buf[PATH_MAX];
+  string_view cwd = getcwd(cwd_buf, sizeof(cwd_buf)) ? cwd_buf : "";
+
+  uint32_t size = align8(sizeof(LogRecord) + cwd.size() + line.size() + sizeof(uint32_t));
+  // a retry only fails again if other sessions fill the whole new file
+  // in between, so this bound is never reached in practice
+  for (int attempt = 0; attempt < 64 && hdr; attempt++) {
+    uint64_t t = hdr->tail.fetch_add((uint64_t(1) << OFFSET_BITS) | size, memory_order_acq_rel);
+    uint64_t off = t & OFFSET_MASK;
+
+    if (off + size > hdr->capacity) {
+      // pad out whatever was left so backwards walks still line up
+      if (off < hdr->capacity) {
+        uint32_t rest = hdr->capacity - off;
+        if (rest >= sizeof(LogRecord)) record_at(off)->state.store(Filler, memory_order_relaxed);
+        record_at(off)->size.store(rest, memory_order_relaxed);
+        trailer_at(hdr->capacity)->store(rest, memory_order_release);
+      }
+      compact();
+      continue;
+    }
+
+    LogRecord *rec = record_at(off);
+    rec->size.store(size, memory_order_relaxed);
+    trailer_at(off + size)->store(size, memory_order_release);
+    rec->seq = t >> OFFSET_BITS;
+    rec->status.store(-1, memory_order_relaxed);
+    rec->time = time(nullptr);
+    rec->cwd_len = cwd.size();
+    rec->cmd_len = line.size();
+    char *text = base + off + sizeof(LogRecord);
+    memcpy(text, cwd.data(), cwd.size());
+    memcpy(text + cwd.size(), line.data(), line.size());
+    rec->state.store(Committed, memory_order_release);
+    return HistoryMark{generation, off};
+  }
+  return HistoryMark{0, 0};
+}
+
+void history_finish(HistoryMark mark, int status) {
+  // a compaction in between moved the record; its status stays unknown
+  if (!hdr || mark.offset == 0 || mark.generation != generation) return;
+  record_at(mark.offset)->status.store(status, memory_order_relaxed);
+}
+
+void history_tail(size_t n, const function<void(const HistoryEntry &)> &fn) {
+  if (!hdr) return;
+  // a sealed file is about to be replaced; read the new one if it's there
+  if ((hdr->tail.load(memory_order_acquire) & OFFSET_MASK) > hdr->capacity) refresh();
+  vector<uint64_t> offs = newest(n);
+  for (size_t i = offs.size(); i-- > 0;) fn(entry_at(offs[i]));
+}
+
+void history_since(uint64_t after, const function<void(const HistoryEntry &)> &fn) {
+  if (!hdr) return;
+  if ((hdr->tail.load(memory_order_acquire) & OFFSET_MASK) > hdr->capacity) refresh();
+  vector<uint64_t> offs = newest(0, 0, after);
+  for (size_t i = offs.size(); i-- > 0;) fn(entry_at(offs[i]));
+}
+
+void history_snapshot(const function<void(const HistoryEntry &)> &fn) {
+  if (log_path.empty()) return;
+  int fd = open(log_path.c_str(), O_RDONLY | O_CLOEXEC);
+  if (fd < 0) return;
+  struct stat st;
+  void *mem = fstat(fd, &st) == 0 && uint64_t(st.st_size) > HEADER_SIZE
+                  ? mmap(nullptr, st.st_size, PROT_READ, MAP_SHARED, fd, 0)
+                  : MAP_FAILED;
+  close(fd);
+  if (mem == MAP_FAILED) return;
+
+  // its own view of the file: a compaction that replaces it leaves this
+  // one mapped, so nothing here cares what the shell's appends do
+  const char *view = static_cast<const char *>(mem);
+  const LogHeader *h = reinterpret_cast<const LogHeader *>(view);
+  if (valid_header(view, st.st_size)) {
+    uint64_t end = min(h->tail.load(memory_order_acquire) & OFFSET_MASK, h->capacity);
+    for (uint64_t off = HEADER_SIZE; off + sizeof(uint32_t) <= end;) {
+      const LogRecord *rec = reinterpret_cast<const LogRecord *>(view + off);
+      uint32_t size = rec->size.load(memory_order_acquire);
+      if (size == 0 || size > end - off) break; // mid-append: the rest is catch up's
+      if (size >= sizeof(LogRecord) && rec->state.load(memory_order_acquire) == Committed &&
+          sizeof(LogRecord) + uint64_t(rec->cwd_len) + rec->cmd_len <= size) {
+        const char *text = view + off + sizeof(LogRecord);
+        fn(HistoryEntry{h->base_seq + rec->seq + 1, rec->time, rec->status.load(memory_order_relaxed),
+                        string_view(text, rec->cwd_len), string_view(text + rec->cwd_len, rec->cmd_len)});
+      }
+      off += size;
+    }
+  }
+  munmap(mem, st.st_size);
+}
@@ -0,0 +1,252 @@
+#include "histsearch.h"
+#include "history.h"
+#include <algorithm>
+#include <atomic>
+#include <cmath>
+#include <functional>
+#include <memory>
+#include <string>
+#include <thread>
+#include <signal.h>
+using namespace std;
+
+static inline unsigned char lower(unsigned char c) { return c >= 'A' && c <= 'Z' ? c + 32 : c; }
+
+static inline uint32_t trigram(const unsigned char *p) {
+  return (uint32_t(lower(p[0])) << 16) | (uint32_t(lower(p[1])) << 8) | lower(p[2]);
+}
+
+// distinct trigrams of s, sorted
+static void trigrams(string_view s, vector<uint32_t> &out) {
+  out.clear();
+  const unsigned char *p = reinterpret_cast<const unsigned char *>(s.data());
+  for (size_t i = 0; i + 3 <= s.size(); i++) out.push_back(trigram(p + i));
+  sort(out.begin(), out.end());
+  out.erase(unique(out.begin(), out.end()), out.end());
+}
+
+// case-insensitive substring test; needle is already lowercase
+static bool contains(string_view hay, string_view needle) {
+  if (needle.size() > hay.size()) return false;
+  for (size_t i = 0; i + needle.size() <= hay.size(); i++) {
+    if (lower(hay[i]) != static_cast<unsigned char>(needle[0])) continue;
+    size_t k = 1;
+    while (k < needle.size() && lower(hay[i + k]) == static_cast<unsigned char>(needle[k])) k++;
+    if (k == needle.size()) return true;
+  }
+  return false;
+}
+
+void HistoryIndex::add(string_view cmd, uint64_t number) {
+  entries_++;
+  last_number_ = number;
+  auto it = ids_.find(cmd);
+  if (it != ids_.end()) {
+    Cmd &c = cmds_[it->second];
+    c.last = number;
+    c.count++;
+    max_count_ = max(max_count_, c.count);
+    recent_.push_back({number, it->second});
+    return;
+  }
+
+  uint32_t id = cmds_.size();
+  recent_.push_back({number, id});
+  string_view text = text_.copy(cmd);
+  cmds_.push_back(Cmd{text, number, 1});
+  ids_.emplace(text, id);
+
+  static thread_local vector<uint32_t> tris;
+  trigrams(text, tris);
+  // ids only ever grow, so every posting list stays sorted for free
+  for (uint32_t t : tris) postings_[t].push_back(id);
+}
+
+// recent and frequent both count: every doubling of uses is worth as much
+// as halving how many commands ago it was last run. kept as the ratio
+// rather than its log2, which ranks the same and costs one division
+double HistoryIndex::score(const Cmd &c) const {
+  return (1.0 + c.count) / (1.0 + (last_number_ - c.last));
+}
+
+// ids in both a and b. similar sizes merge linearly (streams through
+// memory); a much shorter a gallops through b instead
+static void intersect(const vector<uint32_t> &a, const vector<uint32_t> &b, vector<uint32_t> &out) {
+  out.clear();
+  if (b.size() < a.size() * 16) {
+    set_intersection(a.begin(), a.end(), b.begin(), b.end(), back_inserter(out));
+    return;
+  }
+  size_t lo = 0;
+  for (uint32_t id : a) {
+    size_t step = 1;
+    while (lo + step < b.size() && b[lo + step] < id) step *= 2;
+    lo = lower_bound(b.begin() + lo, b.begin() + min(lo + step + 1, b.size()), id) - b.begin();
+    if (lo == b.size()) break;
+    if (b[lo] == id) out.push_back(id);
+  }
+}
+
+vector<HistoryIndex::Match> HistoryIndex::search(string_view query, size_t limit, uint64_t before) const {
+  vector<string> terms;
+  for (size_t i = 0; i < query.size();) {
+    size_t j = query.find_first_of(" \t", i);
+    if (j == string_view::npos) j = query.size();
+    if (j > i) {
+      string term(query.substr(i, j - i));
+      for (char &c : term) c = lower(c);
+      terms.push_back(move(term));
+    }
+    i = j + 1;
+  }
+  if (terms.empty() || limit == 0) return {};
+
+  // the terms' trigrams; a term of exactly three characters is proven by its
+  // posting list, anything else still gets checked against the text
+  vector<uint32_t> tris, term_tris;
+  vector<const string *> verify;
+  for (const string &term : terms) {
+    trigrams(term, term_tris);
+    tris.insert(tris.end(), term_tris.begin(), term_tris.end());
+    if (term.size() != 3) verify.push_back(&term);
+  }
+  sort(tris.begin(), tris.end());
+  tris.erase(unique(tris.begin(), tris.end()), tris.end());
+
+  auto verified = [&](uint32_t id) {
+    for (const string *term : verify) {
+      if (!contains(cmds_[id].text, *term)) return false;
+    }
+    return true;
+  };
+  // best `limit` so far in a min-heap on score. the text is only checked
+  // for candidates that would make it in, which after the first few is rare
+  vector<pair<double, uint32_t>> heap;
+  auto consider = [&](uint32_t id, double weight, bool check) {
+    if (cmds_[id].last >= before) return;
+    double s = score(cmds_[id]) * weight;
+    if (heap.size() == limit && s <= heap.front().first) return;
+    if (check && !verified(id)) return;
+    if (heap.size() < limit) {
+      heap.push_back({s, id});
+      push_heap(heap.begin(), heap.end(), greater<>());
+    } else {
+      pop_heap(heap.begin(), heap.end(), greater<>());
+      heap.back() = {s, id};
+      push_heap(heap.begin(), heap.end(), greater<>());
+    }
+  };
+
+  vector<const vector<uint32_t> *> lists;
+  bool all_present = true;
+  for (uint32_t t : tris) {
+    auto it = postings_.find(t);
+    if (it == postings_.end()) all_present = false;
+    else lists.push_back(&it->second);
+  }
+
+  if (tris.empty()) {
+    // every term is under three characters: nothing to look up, so scan
+    // newest first and stop once even the most used command couldn't
+    // outrank what's already found at that age
+    for (size_t r = recent_.size(); r-- > 0;) {
+      auto [number, id] = recent_[r];
+      if (heap.size() == limit && (1.0 + max_count_) / (1.0 + (last_number_ - number)) <= heap.front().first) break;
+      if (cmds_[id].last != number) continue; // run again later, seen already
+      consider(id, 1, true);
+    }
+  } else if (all_present) {
+    // intersect a few short lists, shortest first so the candidates only
+    // shrink: each term's rarest trigram (the trigrams of one word mostly
+    // come from the same commands), topped up with the next rarest. merging
+    // more lists narrows things less than it costs; the text check covers
+    // whatever they would have ruled out
+    auto shorter = [](const vector<uint32_t> *a, const vector<uint32_t> *b) { return a->size() < b->size(); };
+    vector<const vector<uint32_t> *> pick;
+    for (const string &term : terms) {
+      const vector<uint32_t> *rarest = nullptr;
+      trigrams(term, term_tris);
+      for (uint32_t t : term_tris) {
+        const vector<uint32_t> *list = &postings_.find(t)->second;
+        if (!rarest || shorter(list, rarest)) rarest = list;
+      }
+      if (rarest && find(pick.begin(), pick.end(), rarest) == pick.end()) pick.push_back(rarest);
+    }
+    sort(lists.begin(), lists.end(), shorter);
+    const size_t MAX_LISTS = 3;
+    for (size_t l = 0; l < lists.size() && pick.size() < MAX_LISTS; l++) {
+      if (find(pick.begin(), pick.end(), lists[l]) == pick.end()) pick.push_back(lists[l]);
+    }
+    if (pick.size() < lists.size()) {
+      verify.clear();
+      for (const string &term : terms) verify.push_back(&term);
+    }
+    sort(pick.begin(), pick.end(), shorter);
+
+    vector<uint32_t> cand(*pick[0]), next;
+    for (size_t l = 1; l < pick.size() && !cand.empty(); l++) {
+      intersect(cand, *pick[l], next);
+      cand.swap(next);
+    }
+    for (uint32_t id : cand) consider(id, 1, true);
+  }
+
+  if (heap.empty() && tris.size() >= 2) {
+    // fuzzy: whatever shares most of the trigrams, the overlap ranking first
+    vector<uint16_t> hits(cmds_.size(), 0);
+    vector<uint32_t> touched;
+    for (const vector<uint32_t> *list : lists) {
+      for (uint32_t id : *list) {
+        if (hits[id]++ == 0) touched.push_back(id);
+      }
+    }
+    size_t need = max<size_t>(2, (tris.size() + 1) / 2);
+    for (uint32_t id : touched) {
+      if (hits[id] >= need) consider(id, exp2(64.0 * hits[id] / tris.size()), false);
+    }
+  }
+
+  sort_heap(heap.begin(), heap.end(), greater<>());
+  vector<Match> out;
+  out.reserve(heap.size());
+  for (auto &[s, id] : heap) out.push_back(Match{cmds_[id].text, cmds_[id].last, cmds_[id].count});
+  return out;
+}
+
+// never destroyed: the loader may still be at it when the shell exits
+static HistoryIndex &shell_index = *new HistoryIndex;
+static thread &loader = *new thread;
+static atomic<bool> loading{false};
+
+static void catch_up() {
+  history_since(shell_index.last_number(), [](const HistoryEntry &e) { shell_index.add(e.cmd, e.number); });
+}
+
+void history_index_load() {
+  loading = true;
+  // like the completion scanner: no signals meant for the shell
+  sigset_t all, old;
+  sigfillset(&all);
+  pthread_sigmask(SIG_BLOCK, &all, &old);
+  loader = thread([] {
+    // the file, mapped again: the shell's own mapping can go away under a
+    // compaction, and startup shouldn't wait on reading all of it
+    history_snapshot([](const HistoryEntry &e) { shell_index.add(e.cmd, e.number); });
+    loading = false;
+  });
+  pthread_sigmask(SIG_SETMASK, &old, nullptr);
+}
+
+void history_index_update() {
+  if (loader.joinable()) {
+    if (loading) return; // it catches up once the load is in
+    loader.join();
+  }
+  catch_up();
+}
+
+HistoryIndex &history_index() {
+  if (loader.joinable()) loader.join();
+  catch_up();
+  return shell_index;
+}
@@ -0,0 +1,516 @@
+#include "jobs.h"
+#include "utils.h"
+#include "trace.h"
+#include "vars.h"
+#include <algorithm>
+#include <cerrno>
+#include <csignal>
+#include <cstdint>
+#include <cstdlib>
+#include <iostream>
+#include <readline/readline.h>
+#include <sys/epoll.h>
+#include <sys/signalfd.h>
+#include <sys/syscall.h>
+#include <sys/wait.h>
+#include <termios.h>
+#include <unistd.h>
+using namespace std;
+
+unordered_map<int, Job> job_table;
+pid_t last_bg_pid = 0;
+
+// every live background process is an epoll source: its pidfd, for the
+// exit, next to the one signalfd that SIGCHLD arrives on, which is what
+// tells about stops and continues (a pidfd only wakes at the exit). on
+// kernels without pidfd_open the signalfd does it all
+static int job_ep = -1;
+static int sig_fd = -1;
+static bool use_pidfd = false;
+
+static unordered_map<pid_t, int> pid_jobs; // running pid -> job id
+static const size_t MAX_KEPT_DONE = 256;
+static vector<int> finished;               // done, notice not printed yet
+static size_t queued_count = 0;           // jobs in JobQueued
+static int current_id = 0, previous_id = 0;
+static bool at_prompt = false;
+static pid_t shell_pgid = 0;
+
+static int open_pidfd(pid_t pid) {
+#ifdef SYS_pidfd_open
+  return syscall(SYS_pidfd_open, pid, 0);
+#else
+  errno = ENOSYS;
+  return -1;
+#endif
+}
+
+void jobs_init() {
+  job_ep = shell_fd(epoll_create1(EPOLL_CLOEXEC));
+  shell_pgid = getpgrp();
+
+  if (interactive) {
+    // wait until we're in the foreground, then take our own group and the
+    // terminal. the job control signals are for our children, not us
+    while (tcgetpgrp(STDIN_FILENO) != (shell_pgid = getpgrp())) kill(-shell_pgid, SIGTTIN);
+    for (int sig : {SIGINT, SIGQUIT, SIGTSTP, SIGTTIN, SIGTTOU}) signal(sig, SIG_IGN);
+    setpgid(0, 0);
+    shell_pgid = getpid();
+    tcsetpgrp(STDIN_FILENO, shell_pgid);
+  }
+
+  int probe = open_pidfd(getpid());
+  if (probe >= 0) {
+    close(probe);
+    use_pidfd = true;
+  }
+
+  // SIGCHLD through a signalfd; without pidfds everything is reaped with
+  // waitpid(-1) from there
+  sigset_t set;
+  sigemptyset(&set);
+  sigaddset(&set, SIGCHLD);
+  sigprocmask(SIG_BLOCK, &set, nullptr);
+  sig_fd = shell_fd(signalfd(-1, &set, SFD_NONBLOCK | SFD_CLOEXEC));
+  struct epoll_event ev = {};
+  ev.events = EPOLLIN;
+  ev.data.u64 = 0;
+  epoll_ctl(job_ep, EPOLL_CTL_ADD, sig_fd, &ev);
+}
+
+int jobs_event_fd() { return job_ep; }
+
+void jobs_set_at_prompt(bool p) { at_prompt = p; }
+
+static void watch_proc(JobProc &p, int id) {
+  pid_jobs[p.pid] = id;
+  if (!use_pidfd) return;
+  p.pidfd = shell_fd(open_pidfd(p.pid));
+  if (p.pidfd < 0) return;
+  struct epoll_event ev = {};
+  ev.events = EPOLLIN;
+  ev.data.u64 = (static_cast<uint64_t>(p.pidfd) << 32) | static_cast<uint32_t>(p.pid);
+  epoll_ctl(job_ep, EPOLL_CTL_ADD, p.pidfd, &ev);
+}
+
+static void unwatch_proc(JobProc &p) {
+  pid_jobs.erase(p.pid);
+  if (p.pidfd >= 0) {
+    epoll_ctl(job_ep, EPOLL_CTL_DEL, p.pidfd, nullptr);
+    shell_fd_close(p.pidfd);
+    p.pidfd = -1;
+  }
+}
+
+static JobProc *proc_of(Job &job, pid_t pid) {
+  for (auto &p : job.procs) {
+    if (p.pid == pid) return &p;
+  }
+  return nullptr;
+}
+
+// a waitpid() result for one of our background processes
+static void proc_changed(pid_t pid, int status) {
+  auto it = pid_jobs.find(pid);
+  if (it == pid_jobs.end()) return;
+  Job &job = job_table[it->second];
+  JobProc *p = proc_of(job, pid);
+  if (!p) return;
+
+  if (WIFSTOPPED(status)) {
+    p->stopped = true;
+    p->status = status; // for the 128 + signal status
+    job.state = JobStopped;
+    return;
+  }
+  if (WIFCONTINUED(status)) {
+    p->stopped = false;
+    job.state = JobRunning;
+    return;
+  }
+
+  p->done = true;
+  p->status = status;
+  unwatch_proc(*p);
+  if (all_of(job.procs.begin(), job.procs.end(), [](const JobProc &q) { return q.done; })) {
+    job.state = JobDone;
+    finished.push_back(job.id);
+  }
+}
+
+// $JOBS_MAX, 0 (no cap) when unset or not a positive number
+static size_t jobs_max() {
+  const char *v = var_get("JOBS_MAX");
+  if (!v || !*v) return 0;
+  char *end;
+  long n = strtol(v, &end, 10);
+  return !*end && n > 0 ? n : 0;
+}
+
+bool jobs_slot_free() {
+  size_t max = jobs_max();
+  if (!max) return true;
+  size_t running = 0;
+  for (const auto &[id, job] : job_table) running += job.state == JobRunning;
+  return running < max;
+}
+
+bool jobs_queued() { return queued_count > 0; }
+
+// a queued job gets its processes and is an ordinary running job from
+// here on
+static void start_job(Job &job) {
+  JobStart start = move(job.start);
+  job.start = nullptr;
+  queued_count--;
+  auto [pgid, pids] = start();
+  job.pgid = pgid;
+  job.state = JobRunning;
+  for (pid_t pid : pids) job.procs.push_back(JobProc{pid, -1, 0, false, false});
+  for (auto &p : job.procs) watch_proc(p, job.id);
+  if (!pids.empty()) {
+    last_bg_pid = pids.back();
+  } else {
+    job.state = JobDone; // nothing could be started
+    finished.push_back(job.id);
+  }
+}
+
+// start queued jobs, oldest first, while there are free slots
+static void start_queued() {
+  if (!queued_count) return;
+  vector<int> ids;
+  for (const auto &[id, job] : job_table) {
+    if (job.state == JobQueued) ids.push_back(id);
+  }
+  sort(ids.begin(), ids.end());
+  for (int id : ids) {
+    if (!jobs_slot_free()) break;
+    start_job(job_table[id]);
+  }
+}
+
+// take whatever news the kernel has on background pid. false if none
+static bool reap(pid_t pid) {
+  if (!pid_jobs.count(pid)) return false;
+  int status;
+  bool any = false;
+  while (waitpid(pid, &status, WNOHANG | WUNTRACED | WCONTINUED) > 0) {
+    proc_changed(pid, status);
+    any = true;
+  }
+  return any;
+}
+
+// SIGCHLDs that come in while one is pending merge into it, so the pids the
+// signalfd named may not be all of them. ask the kernel (without reaping)
+// which child has news: ours gets reaped, and only a foreground child in
+// the way, left for whoever waits on it, costs a sweep of every job
+static void reap_merged() {
+  for (;;) {
+    siginfo_t info = {};
+    if (waitid(P_ALL, 0, &info, WEXITED | WSTOPPED | WCONTINUED | WNOHANG | WNOWAIT) < 0 || info.si_pid == 0) return;
+    if (reap(info.si_pid)) continue;
+    vector<pid_t> pids;
+    for (const auto &[p, id] : pid_jobs) pids.push_back(p);
+    for (pid_t p : pids) reap(p);
+    return;
+  }
+}
+
+// one round of epoll; timeout -1 blocks. slots freed by jobs that ended
+// go to the queue straight away
+static void handle_events(int timeout) {
+  struct epoll_event evs[64];
+  int n = epoll_wait(job_ep, evs, 64, timeout);
+  for (int i = 0; i < n; i++) {
+    int status;
+    pid_t pid;
+    if (evs[i].data.u64 != 0) {
+      // a pidfd: that process exited
+      pid = static_cast<pid_t>(evs[i].data.u64 & 0xffffffffu);
+      if (waitpid(pid, &status, WNOHANG) > 0) proc_changed(pid, status);
+      continue;
+    }
+    struct signalfd_siginfo si;
+    vector<pid_t> named;
+    while (read(sig_fd, &si, sizeof(si)) == sizeof(si)) named.push_back(si.ssi_pid);
+    if (!use_pidfd) {
+      while ((pid = waitpid(-1, &status, WNOHANG | WUNTRACED | WCONTINUED)) > 0) {
+        proc_changed(pid, status);
+      }
+      continue;
+    }
+    // only our background processes, by the pid the signal names: a
+    // foreground one is waited for by whoever started it
+    for (pid_t p : named) reap(p);
+    reap_merged();
+  }
+  start_queued();
+}
+
+static int job_status(const Job &job) {
+  return job.procs.empty() ? 0 : exit_code(job.procs.back().status);
+}
+
+static void forget_job(int id) {
+  auto it = job_table.find(id);
+  if (it == job_table.end()) return;
+  for (auto &p : it->second.procs) unwatch_proc(p);
+  job_table.erase(it);
+  finished.erase(remove(finished.begin(), finished.end(), id), finished.end());
+  if (current_id == id) {
+    current_id = previous_id;
+    previous_id = 0;
+  } else if (previous_id == id) {
+    previous_id = 0;
+  }
+}
+
+string job_state_text(const Job &job) {
+  if (job.state == JobRunning) return "Running";
+  if (job.state == JobStopped) return "Stopped";
+  if (job.state == JobQueued) return "Queued";
+  int status = job.procs.empty() ? 0 : job.procs.back().status;
+  if (WIFSIGNALED(status)) return WTERMSIG(status) == SIGTERM ? "Terminated" : "Killed";
+  if (WEXITSTATUS(status) != 0) return "Exit " + to_string(WEXITSTATUS(status));
+  return "Done";
+}
+
+void jobs_poll() {
+  handle_events(0);
+  // scripts keep finished jobs around so a later `wait %n` still gets the
+  // status; `jobs` clears them once it has listed them. only the newest
+  // few, so a loop spawning jobs doesn't grow the table forever
+  if (!interactive) {
+    while (finished.size() > MAX_KEPT_DONE) forget_job(finished.front());
+    return;
+  }
+  if (finished.empty()) return;
+
+  bool redraw = interactive && at_prompt;
+  if (redraw) rl_clear_visible_line();
+  for (int id : vector<int>(finished)) {
+    Job &job = job_table[id];
+    if (interactive) {
+      cout << (redraw ? "" : "\n") << "[" << id << "]  " << job_state_text(job) << "  " << job.command << endl;
+    }
+    forget_job(id);
+  }
+  if (redraw) rl_forced_update_display();
+}
+
+void jobs_clear_done() {
+  for (int id : vector<int>(finished)) forget_job(id);
+}
+
+static int new_job_id() {
+  // like bash: numbering restarts once every job is gone
+  static int next_id = 1;
+  if (job_table.empty()) next_id = 1;
+  return next_id++;
+}
+
+int job_enqueue(const string &command, JobStart start) {
+  int id = new_job_id();
+  job_table[id] = Job{id, 0, command, {}, JobQueued, move(start)};
+  queued_count++;
+  previous_id = current_id;
+  current_id = id;
+  return id;
+}
+
+void jobs_finish_queue() {
+  while (queued_count) {
+    start_queued();
+    if (queued_count) handle_events(-1);
+  }
+}
+
+int job_add(pid_t pgid, const vector<pid_t> &pids, const string &command) {
+  int id = new_job_id();
+
+  Job &job = job_table[id];
+  job = Job{id, pgid, command, {}, JobRunning};
+  for (pid_t pid : pids) {
+    job.procs.push_back(JobProc{pid, -1, 0, false, false});
+  }
+  for (auto &p : job.procs) watch_proc(p, id);
+
+  previous_id = current_id;
+  current_id = id;
+  if (!pids.empty()) last_bg_pid = pids.back();
+  return id;
+}
+
+void give_terminal(pid_t pgid) {
+  if (!interactive || pgid <= 0) return;
+  tcsetpgrp(STDIN_FILENO, pgid);
+}
+
+// take the terminal back and restore our own modes
+static void reclaim_terminal() {
+  if (!interactive) return;
+  tcsetpgrp(STDIN_FILENO, shell_pgid);
+  tcsetattr(STDIN_FILENO, TCSADRAIN, &shell_tmodes);
+}
+
+// wait for every unfinished proc of job in the foreground. returns true if
+// it got stopped instead of finishing
+static bool wait_in_foreground(Job &job) {
+  TraceSpan span(PhaseWait, job.command.c_str());
+  give_terminal(job.pgid);
+  for (auto &p : job.procs) {
+    if (p.done) continue;
+    bool nudged = false;
+    while (true) {
+      int status;
+      pid_t r = waitpid(p.pid, &status, WUNTRACED);
+      if (r < 0) {
+        if (errno == EINTR) continue;
+        p.done = true; // not ours anymore
+        break;
+      }
+      if (WIFSTOPPED(status)) {
+        int sig = WSTOPSIG(status);
+        // it touched the tty before we handed it over; let it carry on
+        if ((sig == SIGTTIN || sig == SIGTTOU) && !nudged && job.pgid > 0) {
+          nudged = true;
+          kill(-job.pgid, SIGCONT);
+          continue;
+        }
+        p.stopped = true;
+        p.status = status;
+        job.state = JobStopped;
+        reclaim_terminal();
+        return true;
+      }
+      p.done = true;
+      p.status = status;
+      break;
+    }
+  }
+  job.state = JobDone;
+  reclaim_terminal();
+  return false;
+}
+
+static int stopped_status(const Job &job) {
+  for (const auto &p : job.procs) {
+    if (p.stopped) return 128 + WSTOPSIG(p.status);
+  }
+  return 128 + SIGTSTP;
+}
+
+static void announce_stop(const Job &job) {
+  cout << "\n[" << job.id << "]+  Stopped  " << job.command << endl;
+}
+
+int wait_foreground(pid_t pgid, const vector<pid_t> &pids, const string &command) {
+  if (pids.empty()) return 0;
+  Job job{0, pgid, command, {}, JobRunning};
+  for (pid_t pid : pids) job.procs.push_back(JobProc{pid, -1, 0, false, false});
+
+  if (!wait_in_foreground(job)) return job_status(job);
+
+  // Ctrl-Z: it becomes a regular (stopped) job
+  int id = job_add(pgid, {}, command);
+  Job &added = job_table[id];
+  added.procs = job.procs;
+  added.state = JobStopped;
+  for (auto &p : added.procs) {
+    if (!p.done) watch_proc(p, id);
+  }
+  announce_stop(added);
+  return stopped_status(added);
+}
+
+Job *find_job(const string &spec) {
+  int id = 0;
+  if (spec.empty() || spec == "%%" || spec == "%+" || spec == "%") {
+    id = current_id;
+  } else if (spec == "%-") {
+    id = previous_id;
+  } else if (spec[0] == '%') {
+    id = atoi(spec.c_str() + 1);
+  } else {
+    // a pid: whichever job it belongs to
+    auto it = pid_jobs.find(static_cast<pid_t>(atoi(spec.c_str())));
+    if (it == pid_jobs.end()) return nullptr;
+    id = it->second;
+  }
+  auto it = job_table.find(id);
+  return it == job_table.end() ? nullptr : &it->second;
+}
+
+Job *current_job() { return find_job("%+"); }
+
+int job_foreground(Job &job) {
+  cout << job.command << endl;
+  if (job.state == JobQueued) start_job(job); // fg goes past $JOBS_MAX
+  // we wait for it synchronously now, so its pidfds go quiet
+  for (auto &p : job.procs) unwatch_proc(p);
+  give_terminal(job.pgid);
+  if (job.pgid > 0) kill(-job.pgid, SIGCONT);
+  for (auto &p : job.procs) p.stopped = false;
+  job.state = JobRunning;
+
+  int id = job.id;
+  if (!wait_in_foreground(job)) {
+    int status = job_status(job);
+    forget_job(id);
+    return status;
+  }
+  for (auto &p : job.procs) {
+    if (!p.done) watch_proc(p, id);
+  }
+  previous_id = current_id == id ? previous_id : current_id;
+  current_id = id;
+  announce_stop(job);
+  return stopped_status(job);
+}
+
+void job_background(Job &job) {
+  if (job.state == JobQueued) start_job(job); // so does bg
+  if (job.pgid > 0) kill(-job.pgid, SIGCONT);
+  for (auto &p : job.procs) p.stopped = false;
+  job.state = JobRunning;
+  cout << "[" << job.id << "]+ " << job.command << " &" << endl;
+}
+
+int job_wait(Job &job) {
+  int id = job.id;
+  start_queued();
+  while (job_table.count(id) && (job_table[id].state == JobRunning || job_table[id].state == JobQueued)) {
+    handle_events(-1);
+  }
+  auto it = job_table.find(id);
+  if (it == job_table.end()) return 127;
+  if (it->second.state == JobStopped) return stopped_status(it->second);
+  int status = job_status(it->second);
+  forget_job(id); // waited for, so no "Done" notice
+  return status;
+}
+
+int job_wait_any(int *status) {
+  while (finished.empty()) {
+    bool any_running = false;
+    for (const auto &[id, job] : job_table) {
+      any_running = any_running || job.state == JobRunning || job.state == JobQueued;
+    }
+    if (!any_running) return -1;
+    handle_events(-1);
+  }
+  int id = finished.front();
+  *status = job_status(job_table[id]);
+  forget_job(id);
+  return id;
+}
+
+vector<int> job_ids() {
+  vector<int> ids;
+  ids.reserve(job_table.size());
+  for (const auto &[id, job] : job_table) ids.push_back(id);
+  sort(ids.begin(), ids.end());
+  return ids;
+}
@@ -0,0 +1,255 @@
+#include "launcher.h"
+#include "builtins.h"
+#include "trace.h"
+#include <spawn.h>
+#include <algorithm>
+#include <cerrno>
+#include <cstdlib>
+#include <cstring>
+#include <iostream>
+#include <fcntl.h>
+#include <sys/syscall.h>
+#include <sys/wait.h>
+#include <unistd.h>
+using namespace std;
+
+extern char **environ;
+
+// signals the interactive shell ignores or blocks; children get them back
+static const int job_signals[] = {SIGINT, SIGQUIT, SIGTSTP, SIGTTIN, SIGTTOU, SIGPIPE, SIGCHLD};
+
+void reset_child_signals() {
+  for (int sig : job_signals) signal(sig, SIG_DFL);
+  sigset_t empty;
+  sigemptyset(&empty);
+  sigprocmask(SIG_SETMASK, &empty, nullptr);
+}
+
+const char *const sched_vars[4] = {"JOB_CPUS", "JOB_NICE", "JOB_IONICE", "JOB_RLIMITS"};
+
+// a whole non-negative number (with K M G suffixes when scaled), or
+// "unlimited"
+static bool parse_limit(string_view text, bool scaled, rlim_t &out) {
+  if (text == "unlimited") {
+    out = RLIM_INFINITY;
+    return true;
+  }
+  rlim_t v = 0;
+  size_t i = 0;
+  for (; i < text.size() && text[i] >= '0' && text[i] <= '9'; i++) v = v * 10 + (text[i] - '0');
+  if (i == 0) return false;
+  if (scaled && i + 1 == text.size()) {
+    const char *units = "KMG";
+    const char *u = strchr(units, text[i] & ~0x20);
+    if (!u || !*u) return false;
+    v <<= 10 * (u - units + 1);
+    i++;
+  }
+  out = v;
+  return i == text.size();
+}
+
+static bool parse_int(string_view text, int lo, int hi, int &out) {
+  bool neg = !text.empty() && text[0] == '-';
+  rlim_t v;
+  if (!parse_limit(text.substr(neg), false, v) || v > 1000) return false;
+  out = neg ? -int(v) : int(v);
+  return out >= lo && out <= hi;
+}
+
+bool sched_set(SchedSpec &s, string_view var, string_view value) {
+  if (var == "JOB_CPUS") {
+    // 0-3,8: ranges and single CPUs
+    cpu_set_t cpus;
+    CPU_ZERO(&cpus);
+    for (size_t i = 0; i <= value.size();) {
+      size_t comma = min(value.find(',', i), value.size());
+      string_view part = value.substr(i, comma - i);
+      size_t dash = part.find('-');
+      int lo, hi;
+      if (!parse_int(part.substr(0, dash), 0, CPU_SETSIZE - 1, lo)) return false;
+      hi = lo;
+      if (dash != string_view::npos && !parse_int(part.substr(dash + 1), lo, CPU_SETSIZE - 1, hi)) return false;
+      for (int c = lo; c <= hi; c++) CPU_SET(c, &cpus);
+      i = comma + 1;
+    }
+    s.pin = true;
+    s.cpus = cpus;
+    return true;
+  }
+  if (var == "JOB_NICE") {
+    if (!parse_int(value, -20, 19, s.nice)) return false;
+    s.renice = true;
+    return true;
+  }
+  if (var == "JOB_IONICE") {
+    // ioprio_set(2): class in the top bits, level 0 (most) to 7 (least)
+    static const pair<string_view, int> classes[] = {{"realtime", 1}, {"best-effort", 2}, {"idle", 3}};
+    size_t colon = value.find(':');
+    string_view name = value.substr(0, colon);
+    int level = 4;
+    if (colon != string_view::npos && !parse_int(value.substr(colon + 1), 0, 7, level)) return false;
+    for (const auto &[cls, id] : classes) {
+      if (cls != name) continue;
+      s.ioprio = id << 13 | (id == 3 ? 0 : level);
+      return true;
+    }
+    return false;
+  }
+  if (var == "JOB_RLIMITS") {
+    static const pair<string_view, int> names[] = {
+      {"as", RLIMIT_AS},       {"core", RLIMIT_CORE},       {"cpu", RLIMIT_CPU},     {"data", RLIMIT_DATA},
+      {"fsize", RLIMIT_FSIZE}, {"memlock", RLIMIT_MEMLOCK}, {"nofile", RLIMIT_NOFILE}, {"nproc", RLIMIT_NPROC},
+      {"rss", RLIMIT_RSS},     {"stack", RLIMIT_STACK},
+    };
+    vector<pair<int, rlimit>> limits;
+    for (size_t i = 0; i < value.size();) {
+      size_t stop = min(value.find_first_of(" ,", i), value.size());
+      string_view item = value.substr(i, stop - i);
+      i = stop + 1;
+      if (item.empty()) continue;
+      size_t eq = item.find('=');
+      if (eq == string_view::npos) return false;
+      auto it = find_if(begin(names), end(names), [&](const auto &n) { return n.first == item.substr(0, eq); });
+      rlim_t v;
+      // cpu is seconds and nofile/nproc counts; the rest are bytes
+      bool bytes = it != end(names) && it->second != RLIMIT_CPU && it->second != RLIMIT_NOFILE && it->second != RLIMIT_NPROC;
+      if (it == end(names) || !parse_limit(item.substr(eq + 1), bytes, v)) return false;
+      limits.push_back({it->second, rlimit{v, v}});
+    }
+    s.rlimits = move(limits);
+    return true;
+  }
+  return false;
+}
+
+void apply_sched(const SchedSpec &s, const char *name) {
+  auto warn = [&](const char *what) { cerr << name << ": " << what << ": " << strerror(errno) << endl; };
+  if (s.pin && sched_setaffinity(0, sizeof(s.cpus), &s.cpus) < 0) warn("JOB_CPUS");
+  if (s.renice && setpriority(PRIO_PROCESS, 0, s.nice) < 0) warn("JOB_NICE");
+  if (s.ioprio >= 0 && syscall(SYS_ioprio_set, 1 /* IOPRIO_WHO_PROCESS */, 0, s.ioprio) < 0) warn("JOB_IONICE");
+  for (const auto &[resource, limit] : s.rlimits) {
+    if (setrlimit(resource, &limit) < 0) warn("JOB_RLIMITS");
+  }
+}
+
+// what posix_spawn does, by hand in a forked child, with the scheduling
+// applied right before the exec. an exec (or open) failure comes back over
+// a close-on-exec pipe, so the caller sees it the same way
+static pid_t fork_spawn(const SpawnSpec &spec) {
+  int report[2];
+  if (pipe2(report, O_CLOEXEC) < 0) return -1;
+  flush_output();
+
+  TraceSpan span(PhaseFork, spec.argv ? spec.argv[0] : nullptr);
+  trace_count(CountForks);
+  pid_t pid = fork();
+  if (pid == 0) {
+    close(report[0]);
+    if (spec.pgid >= 0) setpgid(0, spec.pgid);
+    bool ok = true;
+    for (const auto &a : spec.actions) {
+      switch (a.kind) {
+      case FdAction::Open: {
+        int fd = open(a.path.c_str(), a.flags, a.mode);
+        ok = fd >= 0;
+        if (ok && fd != a.fd) {
+          ok = dup2(fd, a.fd) >= 0;
+          close(fd);
+        }
+      } break;
+      case FdAction::Dup2:
+        // like posix_spawn: dup'ing a descriptor onto itself keeps it open across the exec
+        ok = a.src_fd == a.fd ? fcntl(a.fd, F_SETFD, 0) >= 0 : dup2(a.src_fd, a.fd) >= 0;
+        break;
+      case FdAction::Close:
+        close(a.fd);
+        break;
+      }
+      if (!ok) break;
+    }
+    if (ok) {
+      apply_sched(*spec.sched, spec.argv ? spec.argv[0] : spec.path.c_str());
+      reset_child_signals();
+      if (spec.sigmask) sigprocmask(SIG_SETMASK, spec.sigmask, nullptr);
+      execve(spec.path.c_str(), spec.argv, spec.envp ? spec.envp : environ);
+    }
+    int err = errno;
+    if (write(report[1], &err, sizeof(err)) < 0) {}
+    _exit(127);
+  }
+  close(report[1]);
+  if (pid < 0) {
+    close(report[0]);
+    return -1;
+  }
+  if (spec.pgid >= 0) setpgid(pid, spec.pgid ? spec.pgid : pid); // both sides, whoever runs first
+
+  int err = 0;
+  ssize_t n;
+  while ((n = read(report[0], &err, sizeof(err))) < 0 && errno == EINTR) {}
+  close(report[0]);
+  if (n == sizeof(err)) {
+    waitpid(pid, nullptr, 0);
+    errno = err;
+    return -1;
+  }
+  trace_count(CountExecs);
+  return pid;
+}
+
+pid_t spawn_process(const SpawnSpec &spec) {
+  if (spec.sched && !spec.sched->empty()) return fork_spawn(spec);
+
+  posix_spawn_file_actions_t fa;
+  posix_spawnattr_t attr;
+  posix_spawn_file_actions_init(&fa);
+  posix_spawnattr_init(&attr);
+
+  for (const auto &a : spec.actions) {
+    switch (a.kind) {
+    case FdAction::Open:
+      posix_spawn_file_actions_addopen(&fa, a.fd, a.path.c_str(), a.flags, a.mode);
+      break;
+    case FdAction::Dup2:
+      posix_spawn_file_actions_adddup2(&fa, a.src_fd, a.fd);
+      break;
+    case FdAction::Close:
+      posix_spawn_file_actions_addclose(&fa, a.fd);
+      break;
+    }
+  }
+
+  short flags = POSIX_SPAWN_SETSIGMASK | POSIX_SPAWN_SETSIGDEF;
+  if (spec.pgid >= 0) {
+    flags |= POSIX_SPAWN_SETPGROUP;
+    posix_spawnattr_setpgroup(&attr, spec.pgid);
+  }
+  sigset_t mask, defaults;
+  sigemptyset(&mask);
+  posix_spawnattr_setsigmask(&attr, spec.sigmask ? spec.sigmask : &mask);
+  sigemptyset(&defaults);
+  for (int sig : job_signals) sigaddset(&defaults, sig);
+  posix_spawnattr_setsigdefault(&attr, &defaults);
+  posix_spawnattr_setflags(&attr, flags);
+
+  // anything still sitting in our buffers has to land before the child writes
+  flush_output();
+
+  pid_t pid;
+  TraceSpan span(PhaseSpawn, spec.argv ? spec.argv[0] : nullptr);
+  trace_count(CountSpawns);
+  int err = posix_spawn(&pid, spec.path.c_str(), &fa, &attr, spec.argv,
+                        spec.envp ? spec.envp : environ);
+
+  posix_spawn_file_actions_destroy(&fa);
+  posix_spawnattr_destroy(&attr);
+
+  if (err != 0) {
+    errno = err;
+    return -1;
+  }
+  // glibc reports a failed exec as a spawn error, so this one exec'd
+  trace_count(CountExecs);
+  return pid;
+}
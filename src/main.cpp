@@ -6,162 +6,366 @@
 #include <signal.h>
 #include <unistd.h>
 #include <cstring>
-#include <sys/wait.h>
+#include <sys/epoll.h>
+#include <fcntl.h>
 #include "parser.h"
 #include "executor.h"
+#include "builtins.h"
 #include "utils.h"
+#include "jobs.h"
+#include "history.h"
+#include "histsearch.h"
+#include "completion.h"
+#include "trace.h"
+#include "vars.h"
+#include "script_cache.h"
 
 using namespace std;
-// a flag to tell main loop something changed
-volatile sig_atomic_t child_changed = 0;
+// parse and check one input line
+static CommandLine compile_line(const string &input) {
+    ParsedLine parsed;
+    {
+        TraceSpan span(PhaseParse);
+        parsed = parse(input);
+    }
+    TraceSpan span(PhaseCheck);
+    return check(move(parsed));
+}
+
+// run one input line: split into ';' / '&' groups, each group into a pipeline.
+// exec_last: this is the final line of a -c string or script, so its last
+// simple foreground command may replace the shell instead of fork+wait
+void run_line(const string &input, bool exec_last) {
+    CommandLine line = compile_line(input);
+
+    /*cout << line;*/
 
-void sigchld_handler(int sig) {
-    // save errno because waitpid might overwrite it, 
-    // and we want to restore it so the main loop doesn't get confused
-    int saved_errno = errno;
+    execute_line(line, exec_last);
+}
+
+// the here-documents a line opens without also holding their bodies
+static vector<OpenHereDoc> open_heredocs(const string &text) {
+    if (text.find("<<") == string::npos) return {};
+    return parse(text).open_heredocs;
+}
 
-    // reap all dead children, using loop cuz if multiple children die at once, kernel 
-    // might send only one signal
-    // WNOHANG: return immediately if no more dead children
-    while (waitpid(-1, nullptr, WNOHANG) > 0) {
-        child_changed = 1;
+// a line that opens here-documents owns the lines after it, up to each
+// delimiter line. next() fetches one more, false at the end of the input
+template <class Next> static void take_heredocs(string &line, Next next) {
+    string more;
+    for (const OpenHereDoc &doc : open_heredocs(line)) {
+        while (next(more)) {
+            line += '\n';
+            line += more;
+            if (heredoc_ends(more, doc)) break;
+        }
     }
+}
 
-    errno = saved_errno;
+// does text stop inside an if/while/until/for/case, or right after | &&
+// or ||, so that the next line belongs to it. only text that could is
+// parsed to find out
+static bool line_incomplete(const string &text) {
+    size_t end = text.find_last_not_of(" \t\r");
+    bool trailing_op = end != string::npos && (text[end] == '|' || (text[end] == '&' && end > 0 && text[end - 1] == '&'));
+    if (!trailing_op) {
+        static const char *const openers[] = {"if", "while", "until", "for", "case"};
+        bool maybe = false;
+        for (const char *w : openers) maybe = maybe || text.find(w) != string::npos;
+        if (!maybe) return false;
+    }
+    return check(parse(text)).incomplete;
 }
 
-void setup_sigchld() {
-    struct sigaction sa;
-    memset(&sa, 0, sizeof(sa));
-    sa.sa_handler = &sigchld_handler;
-    sigemptyset(&sa.sa_mask);
-    
-    // SA_RESTART: automatically restart interrupted system calls (like readline)
-    // SA_NOCLDSTOP: don't send signal when child is stopped (Ctrl+Z), only when dead.
-    sa.sa_flags = SA_RESTART | SA_NOCLDSTOP;
+// a line that leaves a compound command (or an && ...) open takes the
+// lines after it until it is whole, here-documents in them included
+template <class Next> static void take_continuation(string &line, Next next) {
+    string more;
+    while (line_incomplete(line) && next(more)) {
+        line += '\n';
+        line += more;
+        take_heredocs(line, next);
+    }
+}
 
-    if (sigaction(SIGCHLD, &sa, nullptr) == -1) {
-        perror("sigaction");
-        exit(1);
+// each line of a script held in memory as it runs: here-documents and
+// continuation lines taken along, blank lines skipped. fn(line, last),
+// last when nothing but blank lines comes after it
+template <class Fn> static void script_lines(const string &text, Fn fn) {
+    size_t pos = 0;
+    auto next_line = [&](string &out) {
+        if (pos >= text.size()) return false;
+        size_t nl = text.find('\n', pos);
+        if (nl == string::npos) nl = text.size();
+        out.assign(text, pos, nl - pos);
+        pos = nl + 1;
+        return true;
+    };
+    string line;
+    while (next_line(line)) {
+        take_heredocs(line, next_line);
+        take_continuation(line, next_line);
+
+        // is there anything but blank lines left after this one?
+        bool last = text.find_first_not_of(" \t\r\n", pos) == string::npos || pos >= text.size();
+        if (line.find_first_not_of(" \t\r") == string::npos) continue;
+        fn(line, last);
     }
 }
 
-int main() {
-  // save the terminal state of the shell itself at startup
-  if (tcgetattr(STDIN_FILENO, &shell_tmodes) < 0) {
-        perror("tcgetattr");
-  }
+// run a whole script held in memory, line by line
+static int run_script(const string &text) {
+    script_lines(text, [](const string &line, bool last) {
+        run_line(line, last);
+        jobs_poll();
+    });
+    jobs_finish_queue(); // jobs still waiting for a $JOBS_MAX slot get theirs
+    return last_status;
+}
 
-  setup_sigchld();
+// a script file. with the cache on, an unchanged file runs straight from
+// its compiled form; otherwise it is compiled whole, saved, then run
+static int run_script_file(int fd, bool use_cache) {
+    struct stat st;
+    use_cache = use_cache && fstat(fd, &st) == 0;
+    CompiledScript script;
+    bool cached = use_cache && script_cache_load(st, script);
+    if (!cached) {
+      string text;
+      char buf[65536];
+      ssize_t got;
+      while ((got = read(fd, buf, sizeof(buf))) > 0) text.append(buf, got);
+      if (!use_cache) {
+        close(fd);
+        return run_script(text);
+      }
+      script_lines(text, [&](const string &line, bool last) {
+          script.lines.push_back(compile_line(line));
+          script.last.push_back(last);
+      });
+      script_cache_store(st, script);
+    }
+    close(fd);
+    for (size_t i = 0; i < script.lines.size(); i++) {
+      execute_line(script.lines[i], script.last[i]);
+      jobs_poll();
+    }
+    jobs_finish_queue();
+    return last_status;
+}
 
-  std::ios_base::sync_with_stdio(false);
-  // flush after every cout / cerr
-  cout << unitbuf;
-  cerr << unitbuf;
-
-  while (1) {
-    // reap all: cleans up kernel's process table
-    // we do this every loop iteration, even if child_changed == 0, to be safe against mixed signals
-    int status;
-    pid_t reaped_pid;
-    while ((reaped_pid = waitpid(-1, &status, WNOHANG)) > 0) {
-        // find the job in the list and mark it as finished
-        for (size_t i = 0; i < jobs.size(); ++i) {
-            if (jobs[i].pid == reaped_pid) {
-                cout << "\n[" << (i + 1) << "]  Done  " << jobs[i].command << endl;
-                jobs.erase(jobs.begin() + i);
-                break; 
-            }
+// one line of fd 0 and not a byte past it: whatever comes after belongs
+// to the commands, like the "hello" in printf 'cat\nhello\n' | myshell.
+// a file can be read ahead and seeked back over, a pipe has to be read a
+// byte at a time. false at end of input
+static bool read_stdin_line(string &out) {
+    out.clear();
+    char buf[4096];
+    bool seekable = lseek(STDIN_FILENO, 0, SEEK_CUR) >= 0;
+    bool any = false;
+    while (true) {
+        ssize_t n = read(STDIN_FILENO, buf, seekable ? sizeof(buf) : 1);
+        if (n < 0 && errno == EINTR) continue;
+        if (n <= 0) return any;
+        any = true;
+        char *nl = static_cast<char *>(memchr(buf, '\n', n));
+        if (!nl) {
+            out.append(buf, n);
+            continue;
         }
+        out.append(buf, nl - buf);
+        ssize_t unread = buf + n - (nl + 1);
+        if (unread > 0) lseek(STDIN_FILENO, -unread, SEEK_CUR);
+        return true;
+    }
+}
+
+// commands piped in on a non-tty stdin: no readline, no termios
+static int run_stdin() {
+    string line;
+    auto next_line = [](string &out) { return read_stdin_line(out); };
+    while (next_line(line)) {
+        take_heredocs(line, next_line);
+        take_continuation(line, next_line);
+        if (line.find_first_not_of(" \t\r") == string::npos) continue;
+        run_line(line, false);
+        jobs_poll();
+    }
+    jobs_finish_queue();
+    return last_status;
+}
+
+static int usage() {
+    cerr << "usage: myshell [--no-cache] [-c command | script]" << endl;
+    return 2;
+}
+
+// Ctrl-R: the line typed so far is the query; the best indexed match
+// replaces it, and pressing again steps to the next one
+static int fuzzy_reverse_search(int, int) {
+    static string query;
+    static size_t next = 0;
+    if (rl_last_func != fuzzy_reverse_search) {
+      query = rl_line_buffer;
+      next = 0;
     }
-    child_changed = 0; // reset after reaping everything current
-    char* input_ptr = readline("$ ");
+    auto matches = history_index().search(query, next + 1);
+    if (next >= matches.size()) {
+      rl_ding();
+      return 0;
+    }
+    rl_replace_line(string(matches[next].cmd).c_str(), 0);
+    rl_point = rl_end;
+    next++;
+    return 0;
+}
+
+static bool shell_done = false;
+
+// a line still being typed: here-document bodies, or the rest of an
+// if/while/for/case. heredoc_wait is the delimiters it waits for
+static string pending_input;
+static vector<OpenHereDoc> heredoc_wait;
+
+static void run_input(const string &input) {
+    add_history(input.c_str());
+    HistoryMark mark = history_append(input);
+    history_index_update();
+
+    jobs_set_at_prompt(false);
+    run_line(input, false);
+    history_finish(mark, last_status);
+    jobs_poll();
+    flush_output(); // everything out before the prompt comes back
+    jobs_set_at_prompt(true);
+}
+
+// readline hands us each complete line here
+static void on_line(char *input_ptr) {
     if (input_ptr == nullptr) {
+      if (!heredoc_wait.empty()) {
+        // like bash: end of input ends the bodies, the line still runs
+        cerr << endl << "warning: here-document delimited by end-of-file (wanted `"
+             << heredoc_wait.front().delim << "')" << endl;
+        heredoc_wait.clear();
+      }
+      if (!pending_input.empty()) run_input(pending_input);
       cout << endl;
-      break;
+      shell_done = true;
+      rl_callback_handler_remove();
+      return;
     }
     string input(input_ptr);
+    free(input_ptr);
 
-    if(input.empty()){
-      free(input_ptr);
-      continue;
+    if (pending_input.empty()) {
+      if (input.empty()) return;
+      pending_input = move(input);
+      heredoc_wait = open_heredocs(pending_input);
+    } else {
+      pending_input += '\n';
+      pending_input += input;
+      if (!heredoc_wait.empty()) {
+        if (heredoc_ends(input, heredoc_wait.front())) heredoc_wait.erase(heredoc_wait.begin());
+      } else {
+        heredoc_wait = open_heredocs(pending_input);
+      }
     }
-
-    add_history(input_ptr);
-    manual_history_list.push_back(input);
-    history_count++;
-    if (manual_history_list.size() > MAX_HISTORY) {
-      manual_history_list.pop_front();
+    if (!heredoc_wait.empty() || line_incomplete(pending_input)) {
+      rl_set_prompt("> ");
+      return;
     }
+    rl_set_prompt("$ ");
+    string ready = move(pending_input);
+    pending_input.clear();
+    run_input(ready);
+}
 
-    vector<Token> tokens = parse(input);
-
-    /*for (auto &tok : tokens)*/
-    /* cout << tok << endl;*/
+// one epoll over the terminal and the job events: keystrokes go to readline,
+// job events get handled (and announced) right away, even mid-prompt
+static int run_interactive() {
+    int ep = shell_fd(epoll_create1(EPOLL_CLOEXEC));
+    epoll_event ev{};
+    ev.events = EPOLLIN;
+    ev.data.u32 = 0;
+    epoll_ctl(ep, EPOLL_CTL_ADD, STDIN_FILENO, &ev);
+    ev.data.u32 = 1;
+    epoll_ctl(ep, EPOLL_CTL_ADD, jobs_event_fd(), &ev);
 
-    // split tokens into sequential command groups by ';'
-    vector<vector<Token>> command_sequences;
-    vector<Token> current_seq;
-    for (const auto &tok : tokens) {
-        if (tok.type == Semicolon || tok.type == Background) {
-          if (tok.type == Background) {
-                current_seq.push_back(tok);
-          }
-          if (!current_seq.empty()) command_sequences.push_back(current_seq);
-          current_seq.clear();
-        } else {
-            current_seq.push_back(tok);
-        }
+    rl_callback_handler_install("$ ", on_line);
+    jobs_set_at_prompt(true);
+    while (!shell_done) {
+      epoll_event ready[2];
+      int n = epoll_wait(ep, ready, 2, -1);
+      if (n < 0) {
+        if (errno == EINTR) continue;
+        perror("epoll_wait");
+        break;
+      }
+      for (int i = 0; i < n && !shell_done; i++) {
+        if (ready[i].data.u32 == 0) rl_callback_read_char();
+        else jobs_poll();
+      }
     }
-    if (!current_seq.empty()) command_sequences.push_back(current_seq);
-
-    for (auto &seq : command_sequences) {
-        vector<Tree> pipeline;
-        vector<Token> current_cmd_tokens;
-        bool is_bg = false;
+    close(ep);
+    return last_status;
+}
 
-        // scan this specific sequence for the Background token
-        for (const auto &tok : seq) {
-            if (tok.type == Background) {
-                is_bg = true;
-                break; 
-            }
-        }
+int main(int argc, char **argv) {
+  std::ios_base::sync_with_stdio(false);
+  vars_init();
+  trace_init();
 
-        for (const auto &tok : seq) {
-            if (tok.type == Background) continue; // not passing & to check() 
-            if (tok.type == Pipe) {
-                if (!current_cmd_tokens.empty()) {
-                    pipeline.push_back(check(current_cmd_tokens));
-                    current_cmd_tokens.clear();
-                } 
-            } else {
-                current_cmd_tokens.push_back(tok);
-            }
-        }
-        if (!current_cmd_tokens.empty()) {
-            pipeline.push_back(check(current_cmd_tokens));
-        }
+  if (argc > 1) {
+    // batch modes: plain buffered output, flushed before anything else writes
+    interactive = false;
+    jobs_init();
+    int a = 1;
+    // --no-cache: compile the script from its text, and don't save it
+    bool use_cache = true;
+    if (string(argv[a]) == "--no-cache") {
+      use_cache = false;
+      if (++a == argc) return usage();
+    }
+    string arg = argv[a];
 
-        // transfer the flag to every command in pipe
-        for (auto &ast : pipeline) {
-            ast.is_background = is_bg;
-        }
+    if (arg == "-c") {
+      if (a + 1 >= argc) return usage();
+      return run_script(argv[a + 1]);
+    }
+    if (!arg.empty() && arg[0] == '-') return usage();
 
-        execute_pipeline(pipeline);
+    int fd = open(arg.c_str(), O_RDONLY | O_CLOEXEC);
+    if (fd < 0) {
+      cerr << "myshell: " << arg << ": " << strerror(errno) << endl;
+      return 127;
     }
-    /*Tree ast = check(tokens);*/ // old single-command check
+    return run_script_file(fd, use_cache);
+  }
 
-    /*cout << ast << endl;*/
-    /*execute(ast);*/ // old single-command execute
+  if (!isatty(STDIN_FILENO)) {
+    interactive = false;
+    jobs_init();
+    return run_stdin();
+  }
 
-    /*fs::path p = find_in_path(words[0]);*/
-    /**/
-    /*if (!p.empty())*/
-    /* system(input.c_str());*/
-    /*else*/
-    /* cout << words[0] << ": command not found" << endl;*/
+  // puts us in our own process group in the terminal's foreground
+  jobs_init();
 
-    free(input_ptr);
+  // save the terminal state of the shell itself at startup
+  if (tcgetattr(STDIN_FILENO, &shell_tmodes) < 0) {
+        perror("tcgetattr");
   }
+
+  // up-arrow reaches back into earlier sessions too, but only this far
+  history_open();
+  stifle_history(MAX_HISTORY);
+  history_tail(MAX_HISTORY, [](const HistoryEntry &e) { add_history(string(e.cmd).c_str()); });
+  // Ctrl-R and history -s: the log indexed in the background
+  history_index_load();
+  rl_bind_key(CTRL('r'), fuzzy_reverse_search);
+  // Tab: builtins and $PATH commands, indexed in the background
+  completion_init();
+
+  return run_interactive();
 }
@@ -0,0 +1,402 @@
+#include "parallel.h"
+#include "executor.h"
+#include "expand.h"
+#include "parser.h"
+#include "utils.h"
+#include "trace.h"
+#include "vars.h"
+#include <cerrno>
+#include <climits>
+#include <cstring>
+#include <deque>
+#include <map>
+#include <string>
+#include <vector>
+#include <fcntl.h>
+#include <poll.h>
+#include <sched.h>
+#include <sys/wait.h>
+#include <unistd.h>
+using namespace std;
+
+namespace {
+
+struct Options {
+  size_t slots = 0;     // -j, 0 = one per cpu
+  size_t max_args = 1;  // -n / -X, 0 = as many as ARG_MAX allows
+  bool keep_order = false; // -k
+  bool tag = false;        // --tag
+};
+
+// arguments come either from the ::: list or one per line from a fd,
+// read as they're needed so a slow producer doesn't hold up the first jobs
+class ArgSource {
+public:
+  ArgSource(char *const *list, size_t count) : list(list), count(count) {}
+  explicit ArgSource(int fd) : fd(fd) {}
+
+  bool next(string &arg) {
+    if (has_pending) {
+      arg = move(pending);
+      has_pending = false;
+      return true;
+    }
+    if (fd < 0) {
+      if (pos >= count) return false;
+      arg = list[pos++];
+      return true;
+    }
+    while (true) {
+      size_t nl = buf.find('\n', start);
+      if (nl != string::npos) {
+        arg.assign(buf, start, nl - start);
+        start = nl + 1;
+        return true;
+      }
+      if (eof) {
+        if (start >= buf.size()) return false;
+        arg.assign(buf, start, string::npos);
+        start = buf.size();
+        return true;
+      }
+      buf.erase(0, start);
+      start = 0;
+      char chunk[65536];
+      ssize_t got = read(fd, chunk, sizeof(chunk));
+      if (got < 0 && errno == EINTR) continue;
+      if (got <= 0) eof = true;
+      else buf.append(chunk, got);
+    }
+  }
+
+  // give back the argument next() just returned
+  void unget(string arg) {
+    pending = move(arg);
+    has_pending = true;
+  }
+
+private:
+  string pending;
+  bool has_pending = false;
+  char *const *list = nullptr;
+  size_t count = 0, pos = 0;
+  int fd = -1;
+  string buf;
+  size_t start = 0;
+  bool eof = false;
+};
+
+// one running job: the launched pipeline and everything it printed so far
+struct Slot {
+  size_t seq;
+  LaunchedPipeline job;
+  int fds[2]; // read ends of its stdout / stderr, -1 once at EOF
+  string text[2];
+  string tag;
+};
+
+struct Finished {
+  string text[2];
+};
+
+size_t cpu_count() {
+  cpu_set_t set;
+  if (sched_getaffinity(0, sizeof(set), &set) == 0) return CPU_COUNT(&set);
+  long n = sysconf(_SC_NPROCESSORS_ONLN);
+  return n > 0 ? n : 1;
+}
+
+// room for argument strings in one exec, after the environment and a margin
+// for the template's own words
+size_t arg_budget() {
+  long max = sysconf(_SC_ARG_MAX);
+  if (max <= 0) max = 128 * 1024;
+  size_t used = 4096;
+  for (char *const *e = var_envp(); *e; e++) used += strlen(*e) + 1 + sizeof(char *);
+  return (size_t)max > used * 2 ? max - used : max / 2;
+}
+
+size_t count_holes(string_view word) {
+  size_t n = 0;
+  for (size_t at = word.find("{}"); at != string_view::npos; at = word.find("{}", at + 2)) n++;
+  return n;
+}
+
+string fill(string_view word, string_view arg) {
+  string out;
+  size_t from = 0;
+  for (size_t at = word.find("{}"); at != string_view::npos; at = word.find("{}", at + 2)) {
+    out.append(word, from, at - from);
+    out.append(arg);
+    from = at + 2;
+  }
+  out.append(word, from, string_view::npos);
+  return out;
+}
+
+// the template pipeline with the batch's arguments put in. a word that is
+// exactly {} becomes one word per argument, a word with {} inside is
+// repeated per argument (like xargs -X context replace). with no {} at all
+// the arguments go on the end of the last command. argv entries point into
+// tmpl, batch or the new line's arena, so all three must outlive the launch
+CommandLine instantiate(const CommandLine &tmpl, bool has_holes, const vector<string> &batch) {
+  CommandLine line;
+  const Pipeline &src = tmpl.pipelines[0];
+  Pipeline p{0, 0, false};
+  string joined;
+  for (size_t i = 0; i < batch.size(); i++) joined += (i ? " " : "") + batch[i];
+
+  for (size_t c = 0; c < src.cmd_count; c++) {
+    const Command &cmd = tmpl.command(src, c);
+    Command out{EmptyCommand, 0, 0, (uint32_t)line.redirs.size(), 0, (uint32_t)line.argv.size(), cmd.assign_count};
+    line.argv.insert(line.argv.end(), tmpl.assigns_of(cmd), tmpl.assigns_of(cmd) + cmd.assign_count);
+    out.argv_begin = line.argv.size();
+    char *const *words = tmpl.argv_of(cmd);
+    for (size_t w = 0; w < cmd.argc; w++) {
+      string_view word = words[w];
+      if (word == "{}") {
+        for (const string &arg : batch) line.argv.push_back(const_cast<char *>(arg.c_str()));
+      } else if (count_holes(word)) {
+        for (const string &arg : batch) line.argv.push_back(const_cast<char *>(line.arena.copy(fill(word, arg)).data()));
+      } else {
+        line.argv.push_back(words[w]);
+      }
+    }
+    if (!has_holes && c + 1 == src.cmd_count) {
+      for (const string &arg : batch) line.argv.push_back(const_cast<char *>(arg.c_str()));
+    }
+    out.argc = line.argv.size() - out.argv_begin;
+    line.argv.push_back(nullptr);
+    if (out.argc > 0) out.type = is_builtin(line.argv[out.argv_begin]) ? Builtin : ExecutableFile;
+
+    const Redirect *rd = tmpl.redirs_of(cmd);
+    for (size_t r = 0; r < cmd.redir_count; r++) {
+      Redirect copy = rd[r];
+      if (count_holes(copy.target)) copy.target = line.arena.copy(fill(copy.target, joined)).data();
+      line.redirs.push_back(copy);
+    }
+    out.redir_count = cmd.redir_count;
+    line.commands.push_back(out);
+    p.cmd_count++;
+  }
+  line.pipelines.push_back(p);
+  return line;
+}
+
+// every line of text with tag and a tab in front
+string tagged(const string &text, const string &tag) {
+  string out;
+  out.reserve(text.size() + tag.size() * 8);
+  size_t from = 0;
+  while (from < text.size()) {
+    size_t nl = text.find('\n', from);
+    size_t end = nl == string::npos ? text.size() : nl + 1;
+    out += tag;
+    out += '\t';
+    out.append(text, from, end - from);
+    from = end;
+  }
+  return out;
+}
+
+int usage(int err) {
+  put(err, "usage: parallel [-j N] [-n N] [-X] [-k] [--tag] command... [::: arg...]\n");
+  return 2;
+}
+
+} // namespace
+
+int builtin_parallel(const BuiltinArgs &a) {
+  Options opt;
+  size_t i = 1;
+  for (; i < a.argc && a.argv[i][0] == '-'; i++) {
+    string_view o = a.argv[i];
+    if (o == "--") {
+      i++;
+      break;
+    }
+    if (o == "-k") opt.keep_order = true;
+    else if (o == "--tag") opt.tag = true;
+    else if (o == "-X") opt.max_args = 0;
+    else if ((o == "-j" || o == "-n") && i + 1 < a.argc) {
+      long v = atol(a.argv[++i]);
+      if (v <= 0) return usage(a.err);
+      (o == "-j" ? opt.slots : opt.max_args) = v;
+    } else if ((o.substr(0, 2) == "-j" || o.substr(0, 2) == "-n") && o.size() > 2) {
+      long v = atol(a.argv[i] + 2);
+      if (v <= 0) return usage(a.err);
+      (o[1] == 'j' ? opt.slots : opt.max_args) = v;
+    } else {
+      return usage(a.err);
+    }
+  }
+  if (opt.slots == 0) opt.slots = cpu_count();
+
+  // the template runs up to :::, the rest are the arguments
+  size_t cmd_begin = i;
+  while (i < a.argc && string_view(a.argv[i]) != ":::") i++;
+  if (i == cmd_begin) return usage(a.err);
+  ArgSource source = i < a.argc ? ArgSource(a.argv + i + 1, a.argc - i - 1) : ArgSource(a.in);
+
+  // one word is a command line of its own ('sort {} | uniq -c'), several
+  // are taken as the words of a simple command, already split and unquoted
+  CommandLine tmpl, raw; // raw: the template before expansion, which it points into
+  if (i - cmd_begin == 1) {
+    tmpl = check(parse(a.argv[cmd_begin]));
+    // $ words take their values once, not per job
+    if (tmpl.pipelines.size() == 1 && tmpl.pipelines[0].expand) {
+      raw = move(tmpl);
+      tmpl = expand_pipeline(raw, raw.pipelines[0]);
+    }
+  } else {
+    Command cmd{is_builtin(a.argv[cmd_begin]) ? Builtin : ExecutableFile, 0, (uint32_t)(i - cmd_begin), 0, 0};
+    tmpl.argv.assign(a.argv + cmd_begin, a.argv + i);
+    tmpl.argv.push_back(nullptr);
+    tmpl.commands.push_back(cmd);
+    tmpl.pipelines.push_back(Pipeline{0, 1, false});
+  }
+  if (tmpl.pipelines.size() != 1 || tmpl.pipelines[0].background) {
+    put(a.err, "parallel: the command must be a single pipeline\n");
+    return 2;
+  }
+  // what one argument adds to the exec, so batches stay under ARG_MAX
+  size_t holes = 0, hole_text = 0;
+  for (size_t w = 0; w < tmpl.argv.size(); w++) {
+    if (!tmpl.argv[w]) continue;
+    size_t n = count_holes(tmpl.argv[w]);
+    holes += n ? 1 : 0;
+    if (n && string_view(tmpl.argv[w]) != "{}") hole_text += strlen(tmpl.argv[w]);
+  }
+  bool has_holes = holes > 0;
+  for (const Redirect &rd : tmpl.redirs) has_holes = has_holes || count_holes(rd.target);
+  size_t budget = arg_budget();
+  for (char *w : tmpl.argv) budget -= w ? min(budget, strlen(w) + 1 + sizeof(char *)) : 0;
+
+  int devnull = open("/dev/null", O_RDONLY | O_CLOEXEC);
+  deque<Slot> running;
+  map<size_t, Finished> done; // -k: finished out of turn
+  size_t next_seq = 0, flush_seq = 0;
+  int failed = 0;
+  bool interrupted = false, more = true;
+  string arg;
+
+  auto emit = [&](Finished &f) {
+    put(a.out, f.text[0]);
+    put(a.err, f.text[1]);
+    put_flush(); // as each job finishes, not when they all have
+  };
+
+  while (true) {
+    // fill the free slots
+    while (more && !interrupted && running.size() < opt.slots) {
+      vector<string> batch;
+      size_t used = 0;
+      while (opt.max_args == 0 || batch.size() < opt.max_args) {
+        if (!source.next(arg)) {
+          more = false;
+          break;
+        }
+        size_t cost = max<size_t>(holes, 1) * (arg.size() + 1 + sizeof(char *)) + hole_text;
+        if (!batch.empty() && used + cost > budget) {
+          source.unget(move(arg)); // doesn't fit, it starts the next batch
+          break;
+        }
+        used += cost;
+        batch.push_back(move(arg));
+      }
+      if (batch.empty()) break;
+
+      int out[2], err[2];
+      trace_count(CountPipes, 2);
+      if (pipe2(out, O_CLOEXEC) < 0 || pipe2(err, O_CLOEXEC) < 0) {
+        put(a.err, string("parallel: pipe: ") + strerror(errno) + "\n");
+        more = false;
+        break;
+      }
+      CommandLine line = instantiate(tmpl, has_holes, batch);
+      PipelineIO io;
+      io.in = devnull;
+      io.out = out[1];
+      io.err = err[1];
+      io.foreground = false;
+
+      Slot slot;
+      slot.seq = next_seq++;
+      slot.job = launch_pipeline(line, line.pipelines[0], -1, io);
+      close(out[1]);
+      close(err[1]);
+      slot.fds[0] = out[0];
+      slot.fds[1] = err[0];
+      if (opt.tag) {
+        for (size_t b = 0; b < batch.size(); b++) slot.tag += (b ? " " : "") + batch[b];
+      }
+      running.push_back(move(slot));
+
+    }
+    if (running.empty()) break;
+
+    // wait for output from any running job
+    vector<pollfd> pfds;
+    vector<pair<size_t, int>> owners;
+    for (size_t s = 0; s < running.size(); s++) {
+      for (int k = 0; k < 2; k++) {
+        if (running[s].fds[k] < 0) continue;
+        pfds.push_back(pollfd{running[s].fds[k], POLLIN, 0});
+        owners.push_back({s, k});
+      }
+    }
+    if (!pfds.empty() && poll(pfds.data(), pfds.size(), -1) < 0) {
+      if (errno == EINTR) continue;
+      break;
+    }
+    for (size_t f = 0; f < pfds.size(); f++) {
+      if (!pfds[f].revents) continue;
+      Slot &slot = running[owners[f].first];
+      int k = owners[f].second;
+      char chunk[65536];
+      ssize_t got = read(slot.fds[k], chunk, sizeof(chunk));
+      if (got < 0 && errno == EINTR) continue;
+      if (got > 0) {
+        slot.text[k].append(chunk, got);
+      } else {
+        close(slot.fds[k]);
+        slot.fds[k] = -1;
+      }
+    }
+
+    // both ends closed: the job is as good as done, collect it
+    for (size_t s = 0; s < running.size();) {
+      Slot &slot = running[s];
+      if (slot.fds[0] >= 0 || slot.fds[1] >= 0) {
+        s++;
+        continue;
+      }
+      int status = slot.job.last_stage_status;
+      for (pid_t pid : slot.job.pids) {
+        int raw;
+        while (waitpid(pid, &raw, 0) < 0 && errno == EINTR) {}
+        if (pid == slot.job.last_pid) status = exit_code(raw);
+        // Ctrl-C reached the jobs: finish what's running, start nothing new
+        if (WIFSIGNALED(raw) && WTERMSIG(raw) == SIGINT) interrupted = true;
+      }
+      if (status != 0) failed++;
+
+      Finished f;
+      for (int k = 0; k < 2; k++) f.text[k] = opt.tag ? tagged(slot.text[k], slot.tag) : move(slot.text[k]);
+      if (!opt.keep_order) {
+        emit(f);
+      } else {
+        done[slot.seq] = move(f);
+        for (auto it = done.find(flush_seq); it != done.end(); it = done.find(++flush_seq)) {
+          emit(it->second);
+          done.erase(it);
+        }
+      }
+      running.erase(running.begin() + s);
+    }
+  }
+
+  if (devnull >= 0) close(devnull);
+  if (interrupted) return 128 + SIGINT;
+  return min(failed, 101);
+}
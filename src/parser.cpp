@@ -1,8 +1,17 @@
 #include "parser.h"
-#include "utils.h" // Needed because check() calls find_in_path()
+#include "builtins.h" // check() tells builtins apart
+#include "vars.h"     // valid_var_name() for for's variable
+#include <unistd.h>
 #include <algorithm>
 #include <cctype>
 #include <sstream>
+#include <array>
+#include <cstdint>
+#include <cstdlib>
+#include <cstring>
+#ifdef __SSE2__
+#include <emmintrin.h>
+#endif
 #define ALL(s) (s).begin(), (s).end()
 using namespace std;
 
@@ -29,242 +38,948 @@ ostream &operator<<(ostream &os, const Token &tok) { // changing the way how cou
   case RedirectOut:
     os << "RedirectOut, ";
     break;
-  }
-  os << "text: " << tok.text;
-  return os;
-}
-
-ostream &operator<<(ostream &os, const Tree &t) {
-  os << "{ type: ";
-
-  switch (t.type) {
-  case Builtin:
-    os << "Builtin, ";
+  case RedirectIn:
+    os << "RedirectIn, ";
     break;
-  case ExecutableFile:
-    os << "ExecutableFile, ";
+  case Background:
+    os << "Background, ";
     break;
-  case TextNode:
-    os << "TextNode, ";
+  case And:
+    os << "And, ";
     break;
-  case WhitespaceNode:
-    os << "WhitespaceNode, ";
+  case Or:
+    os << "Or, ";
     break;
-  case Leaf:
-    os << "Leaf, ";
+  case CaseEnd:
+    os << "CaseEnd, ";
+    break;
+  case HereDoc:
+    os << "HereDoc, ";
+    break;
+  case HereDocBody:
+    os << "HereDocBody, ";
+    break;
+  case Expandable:
+    os << "Expandable, ";
+    break;
+  case HereDocExpand:
+    os << "HereDocExpand, ";
     break;
   }
+  os << "text: " << tok.text;
+  return os;
+}
 
-  os << "value: " << t.value << ", children: ";
-  for (auto &child : t.children) {
-    os << child << ',';
+ostream &operator<<(ostream &os, const CommandLine &line) { // debug dump of the IR
+  for (const auto &p : line.pipelines) {
+    os << "{ pipeline" << (p.background ? " &" : "") << ": ";
+    for (size_t i = 0; i < p.cmd_count; i++) {
+      const Command &cmd = line.command(p, i);
+      os << "{ type: ";
+      switch (cmd.type) {
+      case Builtin:
+        os << "Builtin, ";
+        break;
+      case ExecutableFile:
+        os << "ExecutableFile, ";
+        break;
+      case EmptyCommand:
+        os << "EmptyCommand, ";
+        break;
+      }
+      os << "argv:";
+      for (size_t a = 0; a < cmd.argc; a++) os << ' ' << line.argv_of(cmd)[a];
+      for (size_t r = 0; r < cmd.redir_count; r++) {
+        const Redirect &rd = line.redirs_of(cmd)[r];
+        static const char *const ops[] = {">", ">>", "<<", "<", "<>", ">&", ">&-"};
+        os << ", " << rd.fd << ops[rd.op];
+        if (rd.op == RedirDup) os << rd.src_fd;
+        else os << rd.target;
+      }
+      os << " },";
+    }
+    os << " }" << endl;
   }
+  return os;
+}
 
-  os << " }";
+// byte classes for the tokenizer, built at compile time
+enum : uint8_t {
+  C_SPACE = 1,  // isspace()
+  C_OP = 2,     // | ; > & <
+  C_QUOTE = 4,  // ' " backslash $ `
+  C_DIGIT = 8,
+  C_GLOB = 16,  // * ? [
+};
+// anything that ends a plain word or needs a closer look
+constexpr uint8_t C_STOP = C_SPACE | C_OP | C_QUOTE | C_GLOB;
 
-  return os;
+static constexpr array<uint8_t, 256> make_byte_classes() {
+  array<uint8_t, 256> t{};
+  for (unsigned char c : {' ', '\t', '\n', '\v', '\f', '\r'}) t[c] |= C_SPACE;
+  for (unsigned char c : {'|', ';', '>', '&', '<'}) t[c] |= C_OP;
+  for (unsigned char c : {'\'', '"', '\\', '$', '`'}) t[c] |= C_QUOTE;
+  for (unsigned char c = '0'; c <= '9'; c++) t[c] |= C_DIGIT;
+  for (unsigned char c : {'*', '?', '['}) t[c] |= C_GLOB;
+  return t;
+}
+static constexpr array<uint8_t, 256> byte_class = make_byte_classes();
+
+static inline bool is(char c, uint8_t cls) {
+  return byte_class[static_cast<unsigned char>(c)] & cls;
 }
 
-vector<Token> parse(string in) {
-  vector<Token> tokens;
+// offset of the first C_STOP byte in [p, p + n), or n.
+// 16 bytes at a time with SSE2 (baseline on x86-64), scalar tail
+static size_t scan_stop(const char *p, size_t n) {
   size_t i = 0;
-  
-  while (i < in.size()) {
-    // skip leading whitespaces
-    while (i < in.size() && isspace(in[i])) { 
-      i++; 
+#ifdef __SSE2__
+  const __m128i pipe = _mm_set1_epi8('|'), semi = _mm_set1_epi8(';');
+  const __m128i gt = _mm_set1_epi8('>'), amp = _mm_set1_epi8('&');
+  const __m128i sq = _mm_set1_epi8('\''), dq = _mm_set1_epi8('"');
+  const __m128i bs = _mm_set1_epi8('\\'), sp = _mm_set1_epi8(' ');
+  const __m128i lt = _mm_set1_epi8('<'), dollar = _mm_set1_epi8('$');
+  const __m128i star = _mm_set1_epi8('*'), qmark = _mm_set1_epi8('?'), lbr = _mm_set1_epi8('[');
+  const __m128i tick = _mm_set1_epi8('`');
+  const __m128i tab = _mm_set1_epi8('\t'), four = _mm_set1_epi8(4);
+
+  for (; i + 16 <= n; i += 16) {
+    __m128i v = _mm_loadu_si128(reinterpret_cast<const __m128i *>(p + i));
+    __m128i m = _mm_or_si128(_mm_cmpeq_epi8(v, pipe), _mm_cmpeq_epi8(v, semi));
+    m = _mm_or_si128(m, _mm_or_si128(_mm_cmpeq_epi8(v, gt), _mm_cmpeq_epi8(v, amp)));
+    m = _mm_or_si128(m, _mm_or_si128(_mm_cmpeq_epi8(v, sq), _mm_cmpeq_epi8(v, dq)));
+    m = _mm_or_si128(m, _mm_or_si128(_mm_cmpeq_epi8(v, bs), _mm_cmpeq_epi8(v, sp)));
+    m = _mm_or_si128(m, _mm_or_si128(_mm_cmpeq_epi8(v, lt), _mm_cmpeq_epi8(v, dollar)));
+    m = _mm_or_si128(m, _mm_or_si128(_mm_cmpeq_epi8(v, star), _mm_cmpeq_epi8(v, qmark)));
+    m = _mm_or_si128(m, _mm_or_si128(_mm_cmpeq_epi8(v, lbr), _mm_cmpeq_epi8(v, tick)));
+    // \t..\r: unsigned (c - '\t') <= 4
+    __m128i d = _mm_sub_epi8(v, tab);
+    m = _mm_or_si128(m, _mm_cmpeq_epi8(_mm_min_epu8(d, four), d));
+
+    int mask = _mm_movemask_epi8(m);
+    if (mask) return i + __builtin_ctz(mask);
+  }
+#endif
+  for (; i < n; i++) {
+    if (is(p[i], C_STOP)) return i;
+  }
+  return n;
+}
+
+static bool opens_substitution(string_view s, size_t i) {
+  return s[i] == '`' || (s[i] == '$' && i + 1 < s.size() && s[i + 1] == '(');
+}
+
+// offset past the "..." starting at s[i]: \" doesn't close it, and neither
+// does a " inside a substitution in it
+static size_t dquote_end(string_view s, size_t i) {
+  size_t n = s.size();
+  for (i++; i < n;) {
+    if (s[i] == '\\') i += 2;
+    else if (s[i] == '"') return i + 1;
+    else if (opens_substitution(s, i)) i = substitution_end(s, i);
+    else i++;
+  }
+  return n;
+}
+
+size_t substitution_end(string_view s, size_t i) {
+  size_t n = s.size();
+  if (s[i] == '`') {
+    for (size_t j = i + 1; j < n; j++) {
+      if (s[j] == '\\') j++;
+      else if (s[j] == '`') return j + 1;
+    }
+    return n;
+  }
+  int depth = 0;
+  for (size_t j = i + 1; j < n;) {
+    char c = s[j];
+    if (c == '\\') {
+      j += 2;
+    } else if (c == '\'') {
+      size_t close = s.find('\'', j + 1);
+      if (close == string_view::npos) return n;
+      j = close + 1;
+    } else if (c == '"') {
+      j = dquote_end(s, j);
+    } else if (opens_substitution(s, j)) {
+      j = substitution_end(s, j);
+    } else if (c == '(') {
+      depth++;
+      j++;
+    } else if (c == ')') {
+      if (--depth == 0) return j + 1;
+      j++;
+    } else {
+      j++;
     }
-    
-    if (i >= in.size()) break;
+  }
+  return n;
+}
+
+// end of a word that contains quotes, backslashes, $, ` or glob
+// characters, starting at i
+static size_t quoted_word_end(string_view in, size_t i) {
+  size_t n = in.size();
+  while (i < n) {
+    i += scan_stop(in.data() + i, n - i);
+    if (i >= n || !is(in[i], C_QUOTE | C_GLOB)) break;
 
-    if (in[i] == '|') {
-      tokens.emplace_back(Token{Pipe, "|"});
+    if (in[i] == '\\') {
+      i += 2;
+    } else if (opens_substitution(in, i)) {
+      // $(...) and `...` take their spaces and operators along
+      i = substitution_end(in, i);
+    } else if (in[i] == '$' || is(in[i], C_GLOB)) {
       i++;
-      continue;
+    } else if (in[i] == '\'') {
+      size_t close = in.find('\'', i + 1);
+      i = close == string_view::npos ? n : close + 1;
+    } else {
+      i = dquote_end(in, i);
     }
-    else if (in[i] == ';') {
-      tokens.emplace_back(Token{Semicolon, ";"});
+  }
+  return i < n ? i : n;
+}
+
+// a $ that starts an expansion somewhere outside single quotes, or a glob
+// character outside any quotes (and neither escaped by a backslash)
+static bool has_expansion(string_view raw) {
+  size_t n = raw.size();
+  bool dq = false;
+  for (size_t i = 0; i < n; i++) {
+    char c = raw[i];
+    if (c == '\\') {
       i++;
-      continue;
+    } else if (c == '\'' && !dq) {
+      size_t close = raw.find('\'', i + 1);
+      if (close == string_view::npos) return false;
+      i = close;
+    } else if (c == '"') {
+      dq = !dq;
+    } else if ((c == '$' && i + 1 < n && starts_expansion(raw[i + 1])) || c == '`') {
+      return true;
+    } else if (!dq && is(c, C_GLOB)) {
+      return true;
     }
-    else if (in[i] == '>') {
-    if (i + 1 < in.size() && in[i+1] == '>') {
-        tokens.emplace_back(Token{RedirectOut, ">>"});
-        i += 2;
+  }
+  return false;
+}
+
+// strip quotes/backslashes out of raw into dst, returns bytes written.
+// the result is never longer than raw
+static size_t unescape_word(string_view raw, char *dst) {
+  size_t i = 0, o = 0, n = raw.size();
+  while (i < n) {
+    if (raw[i] == '\\') {
+      // backslash outside quotes: skip the '\' and take the next char literally
+      i++;
+      if (i < n) dst[o++] = raw[i++];
+    } else if (raw[i] == '\'') {
+      // single quotes: take everything literally until the closing '
+      i++;
+      while (i < n && raw[i] != '\'') dst[o++] = raw[i++];
+      if (i < n) i++;
+    } else if (raw[i] == '"') {
+      // double quotes:handle specific escape rules inside "..."
+      i++;
+      while (i < n && raw[i] != '"') {
+        if (raw[i] == '\\' && i + 1 < n) {
+          char next = raw[i + 1];
+          // POSIX rule: only escape if next is ", \, $, or `
+          if (next == '"' || next == '\\' || next == '$' || next == '`') {
+            dst[o++] = next;
+            i += 2;
+          } else {
+            // otherwise, keep the backslash as literal text
+            dst[o++] = raw[i++];
+          }
+        } else {
+          dst[o++] = raw[i++];
+        }
+      }
+      if (i < n) i++; // skip closing "
     } else {
-        tokens.emplace_back(Token{RedirectOut, ">"});
-        i++;
+      dst[o++] = raw[i++];
     }
-    continue;
-    } else if (in[i] == '&') {
-    tokens.emplace_back(Token{Background, "&"});
-    i++;
-    continue;
-    }
-    else if (isdigit(in[i]) && i + 1 < in.size() && in[i+1] == '>') {
-      if (i + 2 < in.size() && in[i+2] == '>') {
-          // Handle 1>> or 2>>
-          string redirectToken = "";
-          redirectToken += in[i];   // '1' or '2'
-          redirectToken += ">>";
-          tokens.emplace_back(Token{RedirectOut, redirectToken});
-          i += 3;
-      } else {
-          // Handle 1> or 2>
-          string redirectToken = "";
-          redirectToken += in[i];
-          redirectToken += ">";
-          tokens.emplace_back(Token{RedirectOut, redirectToken});
-          i += 2;
+  }
+  return o;
+}
+
+bool heredoc_ends(string_view line, const OpenHereDoc &doc) {
+  if (doc.strip_tabs) line.remove_prefix(min(line.find_first_not_of('\t'), line.size()));
+  return line == doc.delim;
+}
+
+// length of the here-document operator at in[i] (<<, <<-, <<<, with an
+// optional fd digit in front), 0 if there is none
+static size_t heredoc_op_len(string_view in, size_t i) {
+  size_t d = is(in[i], C_DIGIT) ? 1 : 0;
+  if (in.substr(i + d, 2) != "<<") return 0;
+  char next = i + d + 2 < in.size() ? in[i + d + 2] : '\0';
+  return d + (next == '<' || next == '-' ? 3 : 2);
+}
+
+// length of the redirection operator at in[i], 0 if there is none:
+// > >> >& < <> <&, each with an optional fd digit in front, and &> &>>
+static size_t redirect_op_len(string_view in, size_t i) {
+  size_t n = in.size(), j = i;
+  if (in[j] == '&') {
+    if (j + 1 >= n || in[j + 1] != '>') return 0;
+    j += 2;
+    return (j < n && in[j] == '>' ? j + 1 : j) - i;
+  }
+  if (is(in[j], C_DIGIT) && j + 1 < n) j++;
+  if (in[j] == '>') {
+    j++;
+    if (j < n && (in[j] == '>' || in[j] == '&')) j++;
+  } else if (in[j] == '<') {
+    j++;
+    if (j < n && (in[j] == '>' || in[j] == '&')) j++;
+  } else {
+    return 0;
+  }
+  return j - i;
+}
+
+// the bodies of the pending << operators (token indexes), read from the
+// lines starting at pos; each one's delimiter token becomes its body.
+// returns where the input continues after the last delimiter line
+static size_t read_heredoc_bodies(string_view in, size_t pos, ParsedLine &line, vector<size_t> &pending) {
+  vector<Token> &tokens = line.tokens;
+  for (size_t op : pending) {
+    // `cat <<` with no word after it: nothing to wait for
+    if (op + 1 >= tokens.size() || tokens[op + 1].type != PlainText) continue;
+    OpenHereDoc doc{string(tokens[op + 1].text), tokens[op].text.back() == '-'};
+
+    // untouched bodies stay views into the input like any plain word;
+    // <<- drops leading tabs, so that one is rebuilt in the arena
+    size_t start = pos;
+    string stripped;
+    bool closed = false;
+    while (pos < in.size()) {
+      size_t nl = in.find('\n', pos);
+      if (nl == string_view::npos) nl = in.size();
+      string_view text = in.substr(pos, nl - pos);
+      if (heredoc_ends(text, doc)) {
+        closed = true;
+        break;
+      }
+      if (doc.strip_tabs) {
+        text.remove_prefix(min(text.find_first_not_of('\t'), text.size()));
+        stripped += text;
+        stripped += '\n';
       }
-    continue;
+      pos = nl < in.size() ? nl + 1 : nl;
+    }
+    string_view body = doc.strip_tabs ? line.arena.copy(stripped) : in.substr(start, pos - start);
+    if (!body.empty() && body.back() != '\n') body = line.arena.copy(string(body) + '\n'); // cut off by EOF
+    // a quoted delimiter was unescaped into the arena, and keeps the body
+    // literal; otherwise $ and \ in it still mean something
+    const char *d = tokens[op + 1].text.data();
+    bool quoted = d < in.data() || d >= in.data() + in.size();
+    bool expands = !quoted && body.find_first_of("$\\`") != string_view::npos;
+    tokens[op + 1] = Token{expands ? HereDocExpand : HereDocBody, body};
+
+    if (closed) {
+      size_t nl = in.find('\n', pos);
+      pos = nl == string_view::npos ? in.size() : nl + 1;
+    } else {
+      line.open_heredocs.push_back(move(doc));
+    }
+  }
+  pending.clear();
+  return pos;
 }
-    string current_argument = "";
-    
-    while (i < in.size() && !isspace(in[i]) && in[i] != '|' && in[i] != ';') {
-      
-      if (in[i] == '\\') {
-          // backslash outside quotes: skip the '\' and take the next char literally
-          i++;
-          if (i < in.size()) {
-              current_argument += in[i];
-              i++;
-          }
-      } 
-      else if (in[i] == '\'') {
-        // single quotes: take everything literally until the closing '
-        i++;
-        while (i < in.size() && in[i] != '\'') {
-          current_argument += in[i];
-          i++;
+
+ParsedLine parse(string_view in) {
+  ParsedLine line;
+  line.src = in;
+  vector<Token> &tokens = line.tokens;
+  size_t i = 0;
+  size_t n = in.size();
+  // rough guess (a token every ~8 bytes) so big scripts don't regrow the vector
+  tokens.reserve(n / 8 + 4);
+  vector<size_t> pending; // << operators whose bodies start at the next newline
+
+  while (i < n) {
+    // skip leading whitespaces
+    while (i < n && is(in[i], C_SPACE)) {
+      if (in[i] == '\n') {
+        // a newline ends a command like ';' does, unless the line can't end
+        // there: nothing yet, or right after | && || or another separator
+        TokenT last = tokens.empty() ? Semicolon : tokens.back().type;
+        if (last != Semicolon && last != Pipe && last != And && last != Or && last != CaseEnd) {
+          tokens.push_back(Token{Semicolon, in.substr(i, 1)});
         }
-        if (i < in.size()) i++; 
-      } 
-      else if (in[i] == '\"') {
-        // double quotes:handle specific escape rules inside "..."
-        i++; 
-        while (i < in.size() && in[i] != '\"') {
-          if (in[i] == '\\' && i + 1 < in.size()) {
-            char next = in[i + 1];
-            // POSIX rule: only escape if next is ", \, $, or `
-            if (next == '\"' || next == '\\' || next == '$' || next == '`') {
-              current_argument += next;
-              i += 2;
-            } else {
-              // otherwise, keep the backslash as literal text
-              current_argument += in[i];
-              i++;
-            }
-          } else {
-            current_argument += in[i];
-            i++;
-          }
+        // end of a line that opened here-documents: their bodies come next
+        if (!pending.empty()) {
+          i = read_heredoc_bodies(in, i + 1, line, pending);
+          continue;
         }
-        if (i < in.size()) i++; // skip closing "
-      } 
-      else {
-        current_argument += in[i];
-        i++;
       }
+      i++;
+    }
+
+    if (i >= n) break;
+
+    char c = in[i];
+    // comment: '#' at the start of a word runs to the end of the line
+    if (c == '#') {
+      size_t nl = in.find('\n', i);
+      if (nl == string_view::npos) break;
+      i = nl;
+      continue;
+    }
+
+    if (c == '|') {
+      bool two = i + 1 < n && in[i + 1] == '|';
+      tokens.push_back(Token{two ? Or : Pipe, in.substr(i, two ? 2 : 1)});
+      i += two ? 2 : 1;
+      continue;
+    }
+    else if (c == ';') {
+      bool two = i + 1 < n && in[i + 1] == ';';
+      tokens.push_back(Token{two ? CaseEnd : Semicolon, in.substr(i, two ? 2 : 1)});
+      i += two ? 2 : 1;
+      continue;
+    }
+    else if (size_t len = heredoc_op_len(in, i)) {
+      // << <<- <<< and N<<...; the word after a << is its delimiter
+      tokens.push_back(Token{HereDoc, in.substr(i, len)});
+      if (len < 3 || in.substr(i + len - 3, 3) != "<<<") pending.push_back(tokens.size() - 1);
+      i += len;
+      continue;
+    } else if (size_t len = redirect_op_len(in, i)) {
+      size_t d = is(c, C_DIGIT) ? 1 : 0;
+      tokens.push_back(Token{in[i + d] == '<' ? RedirectIn : RedirectOut, in.substr(i, len)});
+      i += len;
+      continue;
+    } else if (c == '&') {
+      bool two = i + 1 < n && in[i + 1] == '&';
+      tokens.push_back(Token{two ? And : Background, in.substr(i, two ? 2 : 1)});
+      i += two ? 2 : 1;
+      continue;
+    }
+
+    // plain word: a view straight into the input, no copy
+    size_t start = i;
+    i += scan_stop(in.data() + i, n - i);
+    if (i >= n || !is(in[i], C_QUOTE | C_GLOB)) {
+      tokens.push_back(Token{PlainText, in.substr(start, i - start)});
+      continue;
     }
 
-    tokens.emplace_back(Token{PlainText, current_argument});
+    // quotes, backslashes, $ or * ? [ somewhere: find the real end. a word
+    // that expands stays raw for now, anything else gets unescaped into
+    // the line's arena
+    i = quoted_word_end(in, i);
+    string_view raw = in.substr(start, i - start);
+    if (has_expansion(raw)) {
+      tokens.push_back(Token{Expandable, raw});
+      continue;
+    }
+    char *dst = line.arena.alloc(raw.size() + 1);
+    size_t len = unescape_word(raw, dst);
+    dst[len] = '\0';
+    tokens.push_back(Token{PlainText, string_view(dst, len)});
+  }
+  // the input ran out before the bodies (or their ends) did
+  if (!pending.empty()) read_heredoc_bodies(in, n, line, pending);
+  return line;
+}
+
+// NUL terminated pointer for a token's text. unescaped words already sit
+// NUL terminated in the arena; views into the source get copied once
+static char *word_ptr(const Token &tok, const ParsedLine &parsed, Arena &arena) {
+  const char *p = tok.text.data();
+  if (p >= parsed.src.data() && p < parsed.src.data() + parsed.src.size()) {
+    return const_cast<char *>(arena.copy(tok.text).data());
+  }
+  return const_cast<char *>(p);
+}
+
+static bool is_word(TokenT type) { return type == PlainText || type == SingleQuoted || type == Expandable; }
+
+// NAME=... (raw or not, the name part never has quotes)
+static bool is_assignment(string_view word) {
+  size_t eq = word.find('=');
+  if (eq == 0 || eq == string_view::npos || (word[0] >= '0' && word[0] <= '9')) return false;
+  for (size_t k = 0; k < eq; k++) {
+    char c = word[k];
+    if (!(c == '_' || (c >= 'a' && c <= 'z') || (c >= 'A' && c <= 'Z') || (c >= '0' && c <= '9'))) return false;
+  }
+  return true;
+}
+
+enum Keyword { KwNone, KwIf, KwThen, KwElif, KwElse, KwFi, KwWhile, KwUntil, KwDo, KwDone, KwFor, KwIn, KwCase,
+               KwEsac };
+
+// the reserved word tok is, if any: it has to be unquoted, i.e. still a
+// view into the input
+static Keyword keyword_of(const Token &tok, const ParsedLine &parsed) {
+  const char *p = tok.text.data();
+  if (tok.type != PlainText || tok.text.size() < 2 || tok.text.size() > 5 || p < parsed.src.data() ||
+      p >= parsed.src.data() + parsed.src.size()) {
+    return KwNone;
+  }
+  static const pair<string_view, Keyword> words[] = {
+      {"if", KwIf},       {"then", KwThen}, {"elif", KwElif}, {"else", KwElse}, {"fi", KwFi},
+      {"while", KwWhile}, {"until", KwUntil}, {"do", KwDo},   {"done", KwDone}, {"for", KwFor},
+      {"in", KwIn},       {"case", KwCase}, {"esac", KwEsac},
+  };
+  for (const auto &[w, k] : words) {
+    if (tok.text == w) return k;
   }
-  return tokens;
+  return KwNone;
 }
 
-Tree check(vector<Token> &tokens) {
-  if (tokens.empty()) return Tree{Leaf, "", {}};
+// where check() is inside an open compound command. from ForName on the
+// tokens are the construct's own words, not commands
+enum Stage { IfCond, IfBody, IfElse, LoopCond, LoopBody, CaseBody, ForName, ForIn, ForWords, ForDo, CaseWord,
+             CaseIn, CasePattern };
+
+static constexpr uint32_t NO_JUMP = UINT32_MAX;
+
+struct OpenCompound {
+  Keyword kind; // KwIf, KwWhile, KwUntil, KwFor or KwCase
+  Stage stage;
+  uint32_t and_or;             // the enclosing list's pending && / || jump
+  uint32_t start = 0;          // loops: where each iteration starts
+  uint32_t branch = NO_JUMP;   // jump out of the current branch, or out of the loop
+  const char *name = nullptr;  // for's variable
+  vector<uint32_t> ends;       // jumps to the end of the whole thing
+};
+
+CommandLine check(ParsedLine &&parsed) {
+  CommandLine line;
+  line.arena = std::move(parsed.arena);
+  const vector<Token> &tokens = parsed.tokens;
+
+  // one allocation each, sized off the token count
+  line.argv.reserve(tokens.size() * 2 + 1);
+  line.commands.reserve(tokens.size() / 2 + 1);
 
-  Tree tree{Leaf, "", {}};
-  bool command_found = false;
+  Command cmd{EmptyCommand, 0, 0, 0, 0};
+  Pipeline pipeline{0, 0, false};
+  bool in_command = false;
 
-  for (size_t i = 0; i < tokens.size(); i++) {
-    const Token *cur = &tokens[i];
+  // the ExpandMode of the argv entry just pushed
+  auto mark_argv = [&](ExpandMode mode) {
+    if (mode == ExpandNone && line.argv_expand.empty()) return;
+    line.argv_expand.resize(line.argv.size(), ExpandNone);
+    line.argv_expand.back() = mode;
+    if (mode != ExpandNone) pipeline.expand = true;
+  };
+
+  auto finish_command = [&]() {
+    if (!in_command) return;
+    line.argv.push_back(nullptr);
+    mark_argv(ExpandNone);
+    if (cmd.argc > 0) {
+      const char *name = line.argv[cmd.argv_begin];
+      // PATH lookup is deferred to execute time (and goes through the
+      // command hash), so only builtins are told apart here
+      cmd.type = is_builtin(name) ? Builtin : ExecutableFile;
+    }
+    line.commands.push_back(cmd);
+    pipeline.cmd_count++;
+    in_command = false;
+  };
+  auto start_command = [&]() {
+    if (in_command) return;
+    uint32_t at = line.argv.size();
+    cmd = Command{EmptyCommand, at, 0, (uint32_t)line.redirs.size(), 0, at, 0};
+    in_command = true;
+  };
+  auto emit = [&](OpCode op, uint32_t arg = 0, const char *name = nullptr) {
+    line.code.push_back(Instr{op, arg, NO_JUMP, name});
+    return uint32_t(line.code.size() - 1);
+  };
+  // the jump at `at` goes to whatever gets emitted next
+  auto land = [&](uint32_t at) { line.code[at].target = line.code.size(); };
+
+  // every pipeline gets an OpRun. a line with no control flow drops the
+  // code at the end and runs its pipelines in order as before
+  auto finish_pipeline = [&](bool background) {
+    finish_command();
+    if (pipeline.cmd_count > 0) {
+      pipeline.background = background;
+      line.pipelines.push_back(pipeline);
+      emit(OpRun, line.pipelines.size() - 1);
+    }
+    pipeline = Pipeline{(uint32_t)line.commands.size(), 0, false};
+  };
+
+  vector<OpenCompound> frames;
+  uint32_t and_or = NO_JUMP; // the && / || jump waiting for the end of the element after it
+  bool control = false;
+
+  // end of an and-or list (; & newline, or a reserved word)
+  auto end_list = [&](bool background) {
+    finish_pipeline(background);
+    if (and_or != NO_JUMP) land(and_or);
+    and_or = NO_JUMP;
+  };
+
+  // for lists and case words and patterns are pipelines that never run:
+  // the code only expands their words
+  auto push_word = [&](const Token &tok, ExpandMode raw_mode) {
+    start_command();
+    line.argv.push_back(word_ptr(tok, parsed, line.arena));
+    cmd.argc++;
+    mark_argv(tok.type == Expandable ? raw_mode : ExpandNone);
+  };
+  auto finish_words = [&]() {
+    start_command(); // `for x in; do` has none
+    finish_command();
+    line.pipelines.push_back(pipeline);
+    pipeline = Pipeline{(uint32_t)line.commands.size(), 0, false};
+    return uint32_t(line.pipelines.size() - 1);
+  };
+  // one pattern of `pat | pat)`, true when it was the last one
+  auto push_pattern = [&](Token tok) {
+    if (!in_command && !tok.text.empty() && tok.text[0] == '(') tok.text.remove_prefix(1);
+    bool last = !tok.text.empty() && tok.text.back() == ')';
+    if (last) tok.text.remove_suffix(1);
+    if (tok.text.empty()) return last;
+    if (tok.type == Expandable) {
+      push_word(tok, ExpandPattern);
+      return last;
+    }
+    // a pattern with nothing to expand matches only itself
+    string escaped;
+    for (char c : tok.text) {
+      if (is(c, C_GLOB) || c == '\\') escaped += '\\';
+      escaped += c;
+    }
+    push_word(Token{PlainText, line.arena.copy(escaped)}, ExpandNone);
+    return last;
+  };
+
+  auto fail = [&](string_view tok) {
+    line.error = "syntax error near unexpected token `" + string(tok) + "'";
+  };
+  auto open = [&](Keyword kind, Stage stage) {
+    frames.push_back(OpenCompound{kind, stage, and_or});
+    and_or = NO_JUMP;
+    control = true;
+  };
+  auto close = [&]() {
+    OpenCompound &f = frames.back();
+    for (uint32_t at : f.ends) land(at);
+    and_or = f.and_or;
+    frames.pop_back();
+  };
+  auto for_begin = [&](uint32_t words) {
+    OpenCompound &f = frames.back();
+    emit(OpForBegin, words);
+    f.start = f.branch = emit(OpForNext, 0, f.name);
+  };
+
+  // a reserved word where a command would start
+  auto keyword = [&](Keyword k, string_view text) {
+    OpenCompound *f = frames.empty() ? nullptr : &frames.back();
+    if (k != KwIf && k != KwWhile && k != KwUntil && k != KwFor && k != KwCase) end_list(false);
+    switch (k) {
+    case KwIf:
+      open(KwIf, IfCond);
+      return;
+    case KwWhile:
+    case KwUntil:
+      open(k, LoopCond);
+      frames.back().start = emit(OpLoopEnter) + 1;
+      return;
+    case KwFor:
+      open(KwFor, ForName);
+      return;
+    case KwCase:
+      open(KwCase, CaseWord);
+      return;
+    case KwThen:
+      if (!f || f->kind != KwIf || f->stage != IfCond) break;
+      f->branch = emit(OpJumpIfFail);
+      f->stage = IfBody;
+      return;
+    case KwElif:
+    case KwElse:
+      if (!f || f->kind != KwIf || f->stage != IfBody) break;
+      f->ends.push_back(emit(OpJump));
+      land(f->branch);
+      f->stage = k == KwElif ? IfCond : IfElse;
+      return;
+    case KwFi:
+      if (!f || f->kind != KwIf || (f->stage != IfBody && f->stage != IfElse)) break;
+      if (f->stage == IfBody) {
+        // no else: a false condition leaves $? 0
+        f->ends.push_back(emit(OpJump));
+        land(f->branch);
+        emit(OpSetStatus, 0);
+      }
+      close();
+      return;
+    case KwDo:
+      if (!f || (f->kind != KwWhile && f->kind != KwUntil) || f->stage != LoopCond) break;
+      f->branch = emit(f->kind == KwWhile ? OpJumpIfFail : OpJumpIfOk);
+      f->stage = LoopBody;
+      return;
+    case KwDone:
+      if (!f || f->stage != LoopBody) break;
+      emit(OpSaveStatus);
+      line.code[emit(OpJump)].target = f->start;
+      land(f->branch);
+      emit(OpLoopExit);
+      close();
+      return;
+    case KwEsac:
+      if (!f || f->kind != KwCase || f->stage != CaseBody) break;
+      f->ends.push_back(emit(OpJump)); // the last ;; is optional
+      land(f->branch);
+      emit(OpSetStatus, 0);
+      emit(OpCasePop);
+      close();
+      return;
+    default:
+      break;
+    }
+    fail(text);
+  };
+
+  // the words of a for or case header. true when tok was taken
+  auto header = [&](const Token &tok) {
+    OpenCompound &f = frames.back();
+    bool sep = tok.type == Semicolon;
+    Keyword k = keyword_of(tok, parsed);
+    switch (f.stage) {
+    case ForName:
+      if (tok.type != PlainText || !valid_var_name(tok.text)) break;
+      f.name = word_ptr(tok, parsed, line.arena);
+      f.stage = ForIn;
+      return true;
+    case ForIn:
+      if (k == KwIn) {
+        f.stage = ForWords;
+        return true;
+      }
+      if (!sep && k != KwDo) break;
+      for_begin(finish_words()); // no list: loop over nothing
+      f.stage = sep ? ForDo : LoopBody;
+      return true;
+    case ForWords:
+      if (sep) {
+        for_begin(finish_words());
+        f.stage = ForDo;
+        return true;
+      }
+      if (!is_word(tok.type)) break;
+      push_word(tok, ExpandFields);
+      return true;
+    case ForDo:
+      if (sep) return true;
+      if (k != KwDo) break;
+      f.stage = LoopBody;
+      return true;
+    case CaseWord:
+      if (!is_word(tok.type)) break;
+      push_word(tok, ExpandString);
+      emit(OpCaseBegin, finish_words());
+      f.stage = CaseIn;
+      return true;
+    case CaseIn:
+      if (sep) return true;
+      if (k != KwIn) break;
+      f.stage = CasePattern;
+      return true;
+    case CasePattern:
+      if (!in_command && (sep || tok.type == CaseEnd)) return true;
+      if (!in_command && k == KwEsac) {
+        emit(OpSetStatus, 0);
+        emit(OpCasePop);
+        close();
+        return true;
+      }
+      if (in_command && tok.type == Pipe) return true;
+      if (!is_word(tok.type)) break;
+      if (push_pattern(tok)) {
+        f.branch = emit(OpCaseMatch, finish_words());
+        f.stage = CaseBody;
+      }
+      return true;
+    default:
+      return false;
+    }
+    fail(tok.text);
+    return true;
+  };
+
+  for (size_t i = 0; i < tokens.size() && line.error.empty(); i++) {
+    const Token &cur = tokens[i];
+
+    if (!frames.empty() && frames.back().stage >= ForName && header(cur)) continue;
+    if (!in_command && pipeline.cmd_count == 0) {
+      Keyword k = keyword_of(cur, parsed);
+      if (k != KwNone && k != KwIn) {
+        keyword(k, cur.text);
+        continue;
+      }
+    }
 
-    switch (cur->type) {
+    switch (cur.type) {
     case PlainText:
-    case SingleQuoted: {
-      Tree node;
+    case SingleQuoted:
+    case Expandable: {
+      start_command();
+      line.argv.push_back(word_ptr(cur, parsed, line.arena));
+      bool raw = cur.type == Expandable;
+      if (cmd.argc == 0 && is_assignment(cur.text)) {
+        // NAME=value ahead of the name: the command's slice starts after it
+        cmd.assign_count++;
+        cmd.argv_begin++;
+        mark_argv(raw ? ExpandString : ExpandNone);
+      } else {
+        cmd.argc++;
+        mark_argv(raw ? ExpandFields : ExpandNone);
+      }
+    } break;
 
-      if (!command_found) {
-        if (find(ALL(builtins), cur->text) != builtins.end()) {
-          node = {Builtin, cur->text, "", {}};
-        } else {
-          auto p = find_in_path(cur->text);
-          if (!p.empty()) {
-            node = {ExecutableFile, cur->text, p, {}};
-          } else {
-            // it's a command that doesn't exist
-            node = {TextNode, cur->text, "", {}};
-          }
+    case RedirectOut:
+    case RedirectIn: {
+      // ">", ">>", "2>&", "<", "0<>", "&>" ... the optional digit is the fd
+      start_command();
+      if (i + 1 >= tokens.size() || !is_word(tokens[i + 1].type)) {
+        break; // no target, nothing to redirect
+      }
+      ExpandMode target_mode = tokens[i + 1].type == Expandable ? ExpandString : ExpandNone;
+      string_view op = cur.text;
+      bool explicit_fd = isdigit(static_cast<unsigned char>(op[0]));
+      int fd = cur.type == RedirectIn ? STDIN_FILENO : STDOUT_FILENO;
+      if (explicit_fd) {
+        fd = op[0] - '0';
+        op.remove_prefix(1);
+      }
+      const char *word = word_ptr(tokens[i + 1], parsed, line.arena);
+      i++;
+
+      auto add = [&](int to, RedirOp kind, const char *target, int src) {
+        ExpandMode mode = kind == RedirDup || kind == RedirClose ? ExpandNone : target_mode;
+        line.redirs.push_back(Redirect{to, kind, target, src, mode});
+        cmd.redir_count++;
+        if (mode != ExpandNone) pipeline.expand = true;
+      };
+      // &>file, and >&file (no fd, not a number): stdout to the file, then
+      // stderr onto stdout, so the file is opened only once
+      bool both = op == "&>" || op == "&>>";
+      if (op.back() == '&') {
+        string_view w = word;
+        if (w == "-") {
+          add(fd, RedirClose, "", -1);
+          break;
         }
-        tree = node;
-        command_found = true;
+        if (!w.empty() && w.size() <= 9 && all_of(ALL(w), [](char c) { return isdigit(static_cast<unsigned char>(c)); })) {
+          add(fd, RedirDup, "", atoi(word));
+          break;
+        }
+        if (op != ">&" || explicit_fd) break; // <&file, 3>&file: ambiguous, ignored
+        both = true;
+      }
+      if (both) {
+        add(STDOUT_FILENO, op == "&>>" ? RedirAppend : RedirTrunc, word, -1);
+        add(STDERR_FILENO, RedirDup, "", STDOUT_FILENO);
+      } else if (op == "<") {
+        add(fd, RedirIn, word, -1);
+      } else if (op == "<>") {
+        add(fd, RedirReadWrite, word, -1);
       } else {
-        node = {TextNode, cur->text, "", {}};
-        tree.children.emplace_back(node);
+        add(fd, op == ">>" ? RedirAppend : RedirTrunc, word, -1);
       }
     } break;
 
-    case WhitespaceTk:
-      // parser handles this
-      break;
+    case HereDoc: {
+      // "<<", "<<-", "<<<", "0<<" ... the optional digit is the fd
+      start_command();
+      string_view op = cur.text;
+      int fd = STDIN_FILENO;
+      if (isdigit(static_cast<unsigned char>(op[0]))) {
+        fd = op[0] - '0';
+        op.remove_prefix(1);
+      }
+      const Token *next = i + 1 < tokens.size() ? &tokens[i + 1] : nullptr;
+      const char *body = nullptr;
+      ExpandMode mode = ExpandNone;
+      if (op == "<<<") {
+        // here-string: the word and a newline
+        if (!next || !is_word(next->type)) break;
+        char *text = line.arena.alloc(next->text.size() + 2);
+        memcpy(text, next->text.data(), next->text.size());
+        memcpy(text + next->text.size(), "\n", 2);
+        body = text;
+        if (next->type == Expandable) mode = ExpandString;
+      } else if (next && (next->type == HereDocBody || next->type == HereDocExpand)) {
+        body = word_ptr(*next, parsed, line.arena);
+        if (next->type == HereDocExpand) mode = ExpandHereDoc;
+      } else {
+        // no delimiter word, or no body read for it
+        if (next && next->type == PlainText) i++;
+        line.redirs.push_back(Redirect{fd, RedirHereDoc, "", -1});
+        cmd.redir_count++;
+        break;
+      }
+      line.redirs.push_back(Redirect{fd, RedirHereDoc, body, -1, mode});
+      cmd.redir_count++;
+      if (mode != ExpandNone) pipeline.expand = true;
+      i++;
+    } break;
+
+    case HereDocBody:
+    case HereDocExpand:
+      break; // only ever read through its HereDoc
 
     case Pipe:
-      // handled by build_pipeline_trees()
+      finish_command();
       break;
+
     case Semicolon:
+      end_list(false);
       break;
-    case RedirectOut:
-      if (i + 1 < tokens.size()) {
-            // use cur->text to capture ">", ">>", "1>>", "2>>"
-            tree.children.emplace_back(Tree{TextNode, cur->text, {}}); 
-            tree.children.emplace_back(Tree{TextNode, tokens[i+1].text, {}}); 
-            i++; 
-        }
-      break;
-    }
-  }
-
-  return tree;
-}
 
-vector<Tree> build_pipeline_trees(vector<Token> &tokens) {
-    vector<Tree> pipeline;
-    vector<Token> current_cmd_tokens;
-    bool background_pipeline = false;
+    case Background:
+      end_list(true);
+      break;
 
-    for (const auto &tok : tokens) {
-        if (tok.type == Background) {
-            background_pipeline = true;
-            break; 
-        }
-    }
+    case And:
+    case Or:
+      // jumps to the next && / || (or the end of the list), which looks at
+      // $? again: `a && b || c` runs c when either a or b failed
+      finish_pipeline(false);
+      if (and_or != NO_JUMP) land(and_or);
+      and_or = emit(cur.type == And ? OpJumpIfFail : OpJumpIfOk);
+      control = true;
+      break;
 
-    for (const auto &tok : tokens) {
-        if (tok.type == Background || tok.type == Semicolon) {
-            break; 
-        }
+    case CaseEnd:
+      if (frames.empty() || frames.back().kind != KwCase || frames.back().stage != CaseBody) {
+        fail(cur.text);
+        break;
+      }
+      end_list(false);
+      frames.back().ends.push_back(emit(OpJump));
+      land(frames.back().branch);
+      frames.back().stage = CasePattern;
+      break;
 
-        if (tok.type == Pipe) {
-            if (!current_cmd_tokens.empty()) {
-                pipeline.push_back(check(current_cmd_tokens));
-                current_cmd_tokens.clear();
-            }
-        } else {
-            current_cmd_tokens.push_back(tok);
-        }
-    }
-    if (!current_cmd_tokens.empty()) {
-        pipeline.push_back(check(current_cmd_tokens));
+    case WhitespaceTk:
+      // parser handles this
+      break;
     }
+  }
+  end_list(false);
+  if (!line.argv_expand.empty()) line.argv_expand.resize(line.argv.size(), ExpandNone);
 
-    // apply the background flag to every command in this pipeline.
-    // eg if we run 'ls | grep .cpp &', both 'ls' and 'grep' belong to the background process group.
-    for (auto &ast : pipeline) {
-        ast.is_background = background_pipeline;
-    }
+  // the rest of it is on the lines after this one
+  TokenT last = tokens.empty() ? Semicolon : tokens.back().type;
+  line.incomplete = !frames.empty() || last == Pipe || last == And || last == Or;
+  if (!control) line.code.clear();
 
-    return pipeline;
-}
\ No newline at end of file
+  return line;
+}
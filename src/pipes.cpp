@@ -0,0 +1,226 @@
+#include "pipes.h"
+#include "trace.h"
+#include <cerrno>
+#include <cstdio>
+#include <iostream>
+#include <thread>
+#include <fcntl.h>
+#include <pthread.h>
+#include <signal.h>
+#include <sys/epoll.h>
+#include <sys/ioctl.h>
+#include <unistd.h>
+using namespace std;
+
+bool parse_pipe_size(string_view text, size_t &bytes) {
+  if (text == "auto" || text == "max") {
+    bytes = text == "auto" ? PIPE_AUTO : pipe_max_size();
+    return true;
+  }
+  size_t v = 0, i = 0;
+  for (; i < text.size() && text[i] >= '0' && text[i] <= '9' && v < (size_t(1) << 40); i++) v = v * 10 + (text[i] - '0');
+  if (i == 0) return false;
+  if (i + 1 == text.size() && (text[i] & ~0x20) == 'K') v <<= 10, i++;
+  else if (i + 1 == text.size() && (text[i] & ~0x20) == 'M') v <<= 20, i++;
+  bytes = v;
+  return i == text.size() && v > 0;
+}
+
+size_t pipe_max_size() {
+  static size_t max = [] {
+    size_t v = 1 << 20; // the kernel's own default for it
+    if (FILE *f = fopen("/proc/sys/fs/pipe-max-size", "re")) {
+      if (fscanf(f, "%zu", &v) != 1) v = 1 << 20;
+      fclose(f);
+    }
+    return v;
+  }();
+  return max;
+}
+
+void set_pipe_size(int fd, size_t bytes) {
+  // EPERM means over pipe-user-pages-soft: take what there is room for
+  for (size_t want = min(bytes, pipe_max_size()); want >= 4096; want /= 2) {
+    if (fcntl(fd, F_SETPIPE_SZ, int(want)) >= 0 || errno != EPERM) return;
+  }
+}
+
+namespace {
+
+// one stage's output on its way to the next stage
+struct Link {
+  int src, dst;
+  uint64_t bytes = 0;
+  uint64_t idle_ns = 0;    // src empty: the downstream stage waits on the upstream one
+  uint64_t blocked_ns = 0; // dst full: the upstream stage waits on the downstream one
+  enum State { Moving, Idle, Blocked, Done } state = Moving;
+  uint64_t since = 0; // start of the current idle or blocked spell
+  int size = 0;       // dst's capacity at the end
+  bool src_watched = false, dst_watched = false;
+
+  void settle(State s) {
+    if (s == state) return;
+    uint64_t now = trace_now();
+    if (state == Idle) idle_ns += now - since;
+    if (state == Blocked) blocked_ns += now - since;
+    state = s;
+    since = now;
+  }
+};
+
+} // namespace
+
+struct PipeMeter {
+  vector<Link> links;
+  vector<string> names;
+  bool grow;
+  uint64_t start, end = 0;
+  thread relay;
+};
+
+namespace {
+
+// a reader fell behind: give its pipe (and the one feeding it) room, up to
+// the max. true if dst got bigger
+bool grow_link(Link &l) {
+  int cur = fcntl(l.dst, F_GETPIPE_SZ);
+  if (cur <= 0 || size_t(cur) >= pipe_max_size()) return false;
+  size_t want = min(size_t(cur) * 4, pipe_max_size());
+  set_pipe_size(l.dst, want);
+  set_pipe_size(l.src, want);
+  return fcntl(l.dst, F_GETPIPE_SZ) > cur;
+}
+
+void relay(shared_ptr<PipeMeter> m) {
+  // a stage that exits early gives us EPIPE instead of killing the shell
+  sigset_t set;
+  sigemptyset(&set);
+  sigaddset(&set, SIGPIPE);
+  pthread_sigmask(SIG_BLOCK, &set, nullptr);
+
+  int ep = epoll_create1(EPOLL_CLOEXEC);
+  size_t live = m->links.size();
+  // only the end a link is waiting on is in the epoll set: hangups can't
+  // be masked, and a writer that's gone would wake us over and over while
+  // the reader is still the one holding things up
+  auto watch_end = [&](int fd, bool &watched, uint32_t events, uint64_t data) {
+    struct epoll_event ev = {};
+    ev.events = events;
+    ev.data.u64 = data;
+    if (events) epoll_ctl(ep, watched ? EPOLL_CTL_MOD : EPOLL_CTL_ADD, fd, &ev);
+    else if (watched) epoll_ctl(ep, EPOLL_CTL_DEL, fd, nullptr);
+    watched = events != 0;
+  };
+  auto watch = [&](size_t i, uint32_t src_ev, uint32_t dst_ev) {
+    Link &l = m->links[i];
+    watch_end(l.src, l.src_watched, src_ev, i * 2);
+    watch_end(l.dst, l.dst_watched, dst_ev, i * 2 + 1);
+  };
+  auto finish = [&](Link &l) {
+    l.settle(Link::Done);
+    l.size = fcntl(l.dst, F_GETPIPE_SZ);
+    // downstream sees EOF, and upstream SIGPIPE if it writes again
+    close(l.src);
+    close(l.dst);
+    live--;
+  };
+  // move whatever can move without blocking, then wait on the side that
+  // stopped it
+  auto step = [&](size_t i) {
+    Link &l = m->links[i];
+    for (;;) {
+      ssize_t n = splice(l.src, nullptr, l.dst, nullptr, 1 << 20, SPLICE_F_MOVE | SPLICE_F_NONBLOCK);
+      if (n > 0) {
+        l.bytes += n;
+        l.settle(Link::Moving);
+        continue;
+      }
+      if (n < 0 && errno == EINTR) continue;
+      if (n == 0 || errno != EAGAIN) return finish(l); // upstream done, or downstream gone
+      int avail = 0;
+      ioctl(l.src, FIONREAD, &avail);
+      if (avail > 0) {
+        l.settle(Link::Blocked);
+        if (m->grow && grow_link(l)) continue;
+        watch(i, 0, EPOLLOUT);
+      } else {
+        l.settle(Link::Idle);
+        watch(i, EPOLLIN, 0);
+      }
+      return;
+    }
+  };
+
+  for (size_t i = 0; i < m->links.size(); i++) step(i);
+  struct epoll_event events[64];
+  while (live > 0) {
+    int n = epoll_wait(ep, events, 64, -1);
+    if (n < 0 && errno != EINTR) break;
+    for (int e = 0; e < n; e++) {
+      size_t i = events[e].data.u64 / 2;
+      Link &l = m->links[i];
+      if (l.state == Link::Done) continue;
+      bool dst = events[e].data.u64 & 1;
+      if (dst && (events[e].events & EPOLLERR)) finish(l); // the reader is gone
+      else step(i);
+    }
+  }
+  close(ep);
+  m->end = trace_now();
+}
+
+string human_bytes(double n) {
+  const char *units[] = {"B", "K", "M", "G", "T"};
+  int u = 0;
+  while (n >= 1024 && u < 4) n /= 1024, u++;
+  char buf[32];
+  snprintf(buf, sizeof buf, u ? "%.1f%s" : "%.0f%s", n, units[u]);
+  return buf;
+}
+
+string seconds(uint64_t ns) {
+  char buf[32];
+  snprintf(buf, sizeof buf, "%.2fs", ns / 1e9);
+  return buf;
+}
+
+} // namespace
+
+shared_ptr<PipeMeter> meter_start(vector<pair<int, int>> links, vector<string> names, bool grow) {
+  auto m = make_shared<PipeMeter>();
+  for (auto [src, dst] : links) {
+    m->links.push_back(Link{src, dst});
+    m->links.back().since = trace_now();
+  }
+  m->names = move(names);
+  m->grow = grow;
+  m->start = trace_now();
+  m->relay = thread(relay, m);
+  return m;
+}
+
+void meter_finish(const shared_ptr<PipeMeter> &m, bool report) {
+  if (!report) {
+    m->relay.detach();
+    return;
+  }
+  m->relay.join();
+
+  uint64_t elapsed = max<uint64_t>(m->end - m->start, 1);
+  size_t n = m->links.size() + 1;
+  size_t width = 0;
+  for (const string &name : m->names) width = max(width, name.size());
+  cerr << "meter: " << n << " stages, " << seconds(elapsed) << endl;
+  for (size_t i = 0; i < n; i++) {
+    const Link *in = i > 0 ? &m->links[i - 1] : nullptr;
+    const Link *out = i + 1 < n ? &m->links[i] : nullptr;
+    string row = "  " + to_string(i + 1) + " " + m->names[i] + string(width - m->names[i].size(), ' ');
+    if (in) row += "  in " + human_bytes(in->bytes);
+    if (out) row += "  out " + human_bytes(out->bytes);
+    row += "  " + human_bytes((out ? out->bytes : in->bytes) * 1e9 / elapsed) + "/s";
+    if (in) row += "  waiting for input " + seconds(in->idle_ns);
+    if (out) row += "  blocked on output " + seconds(out->blocked_ns);
+    if (out && out->size > 0) row += "  pipe " + human_bytes(out->size);
+    cerr << row << endl;
+  }
+}
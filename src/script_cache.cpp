@@ -0,0 +1,350 @@
+#include "script_cache.h"
+#include "trace.h"
+#include "vars.h"
+#include <algorithm>
+#include <cerrno>
+#include <cstring>
+#include <ctime>
+#include <string>
+#include <dirent.h>
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <unistd.h>
+using namespace std;
+
+// file layout: a header, then per line a LineHeader and its arrays (argv
+// as string offsets, then redirections, commands, pipelines, expand modes
+// and code, copied as they are in memory), then one table of NUL
+// terminated strings. pointers in the records are stored as offsets into
+// that table; on a hit they are turned back into pointers into the
+// mapping. the structs are written raw, which is fine because the key
+// includes the shell binary: an entry is never read by another build
+
+static const char CACHE_MAGIC[8] = {'M', 'Y', 'S', 'H', 'C', 'O', 'M', 'P'};
+static const uint32_t CACHE_VERSION = 1;
+static const size_t CACHE_MAX_ENTRIES = 256;
+static const uint64_t CACHE_MAX_BYTES = 64 << 20;
+static const uint32_t NO_STRING = UINT32_MAX;
+
+struct CacheHeader {
+  char magic[8];
+  uint32_t version;
+  uint32_t line_count;
+  uint64_t dev, ino, mtime, size; // the script's identity
+  uint64_t shell;                 // shell_identity() of the writer
+  uint64_t strings;               // offset of the string table
+  uint64_t file_size;
+};
+
+struct LineHeader {
+  uint32_t argv, redirs, commands, pipelines, expand, code; // element counts
+  uint32_t error; // string offset, NO_STRING for none
+  uint8_t incomplete;
+  uint8_t last;
+};
+
+static uint64_t mtime_ns(const struct stat &st) {
+  return uint64_t(st.st_mtim.tv_sec) * 1000000000 + st.st_mtim.tv_nsec;
+}
+
+static uint64_t fnv(initializer_list<uint64_t> values) {
+  uint64_t h = 1469598103934665603ull;
+  for (uint64_t v : values) {
+    h ^= v;
+    h *= 1099511628211ull;
+  }
+  return h;
+}
+
+// changes with every build of the shell, so no entry outlives the IR
+// layout it was written with. 0 when it can't be told
+static uint64_t shell_identity() {
+  static const uint64_t id = [] {
+    struct stat st;
+    if (stat("/proc/self/exe", &st) < 0) return uint64_t(0);
+    return fnv({CACHE_VERSION, uint64_t(st.st_dev), uint64_t(st.st_ino), mtime_ns(st), uint64_t(st.st_size)});
+  }();
+  return id;
+}
+
+static string cache_dir() {
+  const char *xdg = var_get("XDG_CACHE_HOME");
+  const char *home = var_get("HOME");
+  if (xdg && *xdg) return string(xdg) + "/myshell/scripts";
+  if (home && *home) return string(home) + "/.cache/myshell/scripts";
+  return "";
+}
+
+// one entry per script file: an edited script replaces its old entry
+static string entry_path(const string &dir, const struct stat &st) {
+  char name[32];
+  snprintf(name, sizeof(name), "/%016llx.msc", (unsigned long long)fnv({uint64_t(st.st_dev), uint64_t(st.st_ino)}));
+  return dir + name;
+}
+
+// bounds checked reads out of the mapping
+struct Reader {
+  const char *base;
+  uint64_t pos, end;
+
+  template <class T> bool read(T &v) {
+    if (end - pos < sizeof(T)) return false;
+    memcpy(&v, base + pos, sizeof(T));
+    pos += sizeof(T);
+    return true;
+  }
+  template <class T> bool read(vector<T> &v, size_t n) {
+    if ((end - pos) / sizeof(T) < n) return false;
+    v.resize(n);
+    memcpy(v.data(), base + pos, n * sizeof(T));
+    pos += n * sizeof(T);
+    return true;
+  }
+};
+
+// every index in a loaded line points inside its own arrays. the file is
+// only as trustworthy as the disk it sits on: a torn or tampered entry is a
+// miss, not a jump off the end of argv
+static bool line_fits(const CommandLine &line) {
+  uint64_t argc = line.argv.size(), redirs = line.redirs.size(), commands = line.commands.size();
+  uint64_t pipelines = line.pipelines.size(), code = line.code.size();
+  if (!line.argv_expand.empty() && line.argv_expand.size() != argc) return false;
+  for (uint8_t mode : line.argv_expand) {
+    if (mode > ExpandPattern) return false;
+  }
+  for (const Redirect &rd : line.redirs) {
+    if (rd.op > RedirClose || rd.expand > ExpandPattern || !rd.target || rd.fd < 0 || rd.fd > 9) return false;
+    if (rd.op == RedirDup && (rd.src_fd < 0 || rd.src_fd > 9)) return false;
+  }
+  for (const Command &cmd : line.commands) {
+    // argv[argv_begin + argc] is the slice's nullptr, execv wants it there
+    if (cmd.type > EmptyCommand || uint64_t(cmd.argv_begin) + cmd.argc >= argc ||
+        line.argv[cmd.argv_begin + cmd.argc] || uint64_t(cmd.assign_begin) + cmd.assign_count > argc ||
+        uint64_t(cmd.redir_begin) + cmd.redir_count > redirs) {
+      return false;
+    }
+    for (uint32_t a = 0; a < cmd.argc; a++) {
+      if (!line.argv[cmd.argv_begin + a]) return false;
+    }
+    for (uint32_t a = 0; a < cmd.assign_count; a++) {
+      if (!line.argv[cmd.assign_begin + a]) return false;
+    }
+  }
+  for (const Pipeline &p : line.pipelines) {
+    if (uint64_t(p.cmd_begin) + p.cmd_count > commands) return false;
+  }
+  // a line with an error never runs its code, which may still have jumps
+  // that were never landed
+  if (!line.error.empty() || line.incomplete) return true;
+  for (const Instr &in : line.code) {
+    switch (in.op) {
+    case OpRun:
+    case OpForBegin:
+    case OpCaseBegin:
+      if (in.arg >= pipelines) return false;
+      break;
+    case OpCaseMatch:
+      if (in.arg >= pipelines || in.target > code) return false;
+      break;
+    case OpForNext:
+      if (!in.name || in.target > code) return false;
+      break;
+    case OpJump:
+    case OpJumpIfFail:
+    case OpJumpIfOk:
+      if (in.target > code) return false;
+      break;
+    case OpSetStatus:
+    case OpLoopEnter:
+    case OpSaveStatus:
+    case OpLoopExit:
+    case OpCasePop:
+      break;
+    default:
+      return false;
+    }
+  }
+  return true;
+}
+
+bool script_cache_load(const struct stat &st, CompiledScript &out) {
+  TraceSpan span(PhaseCache);
+  string dir = cache_dir();
+  uint64_t shell = shell_identity();
+  if (dir.empty() || !shell) return false;
+  int fd = open(entry_path(dir, st).c_str(), O_RDONLY | O_CLOEXEC);
+  if (fd < 0) return false;
+
+  struct stat cst;
+  CacheHeader h;
+  bool ok = fstat(fd, &cst) == 0 && size_t(cst.st_size) >= sizeof(h) && pread(fd, &h, sizeof(h), 0) == sizeof(h) &&
+            memcmp(h.magic, CACHE_MAGIC, sizeof(CACHE_MAGIC)) == 0 && h.version == CACHE_VERSION &&
+            h.shell == shell && h.dev == uint64_t(st.st_dev) && h.ino == uint64_t(st.st_ino) &&
+            h.mtime == mtime_ns(st) && h.size == uint64_t(st.st_size) && h.file_size == uint64_t(cst.st_size) &&
+            h.strings >= sizeof(h) && h.strings < h.file_size;
+  // private and writable: the words are char *, and whatever might write
+  // through one only ever touches its own copy of the page
+  void *mem = ok ? mmap(nullptr, h.file_size, PROT_READ | PROT_WRITE, MAP_PRIVATE, fd, 0) : MAP_FAILED;
+  if (mem != MAP_FAILED) futimens(fd, nullptr); // its mtime is when it was last used, for eviction
+  close(fd);
+  if (mem == MAP_FAILED) return false;
+  uint64_t file_size = h.file_size;
+  shared_ptr<void> mapping(mem, [file_size](void *p) { munmap(p, file_size); });
+
+  char *strings = static_cast<char *>(mem) + h.strings;
+  uint64_t strings_len = h.file_size - h.strings;
+  if (strings[strings_len - 1] != '\0') return false;
+  auto ptr = [&](uint64_t off, bool &good) -> char * {
+    if (off == NO_STRING) return nullptr;
+    good = good && off < strings_len;
+    return good ? strings + off : nullptr;
+  };
+
+  Reader r{static_cast<const char *>(mem), sizeof(h), h.strings};
+  CompiledScript script;
+  script.lines.resize(h.line_count);
+  script.last.resize(h.line_count);
+  vector<uint32_t> argv;
+  for (uint32_t i = 0; i < h.line_count; i++) {
+    CommandLine &line = script.lines[i];
+    LineHeader lh;
+    if (!r.read(lh) || !r.read(argv, lh.argv) || !r.read(line.redirs, lh.redirs) ||
+        !r.read(line.commands, lh.commands) || !r.read(line.pipelines, lh.pipelines) ||
+        !r.read(line.argv_expand, lh.expand) || !r.read(line.code, lh.code)) {
+      return false;
+    }
+    bool good = true;
+    line.argv.resize(argv.size());
+    for (size_t a = 0; a < argv.size(); a++) line.argv[a] = ptr(argv[a], good);
+    for (Redirect &rd : line.redirs) rd.target = ptr(uintptr_t(rd.target), good);
+    for (Instr &in : line.code) in.name = ptr(uintptr_t(in.name), good);
+    if (const char *error = ptr(lh.error, good)) line.error = error;
+    line.incomplete = lh.incomplete;
+    if (!good || !line_fits(line)) return false;
+    script.last[i] = lh.last;
+  }
+  script.mapping = move(mapping);
+  out = move(script);
+  return true;
+}
+
+// oldest used first, until the directory fits the budget again
+static void evict(const string &dir) {
+  struct Entry {
+    string path;
+    uint64_t used;
+    uint64_t bytes;
+  };
+  vector<Entry> entries;
+  uint64_t total = 0;
+  DIR *d = opendir(dir.c_str());
+  if (!d) return;
+  while (dirent *e = readdir(d)) {
+    size_t len = strlen(e->d_name);
+    if (len < 4 || strcmp(e->d_name + len - 4, ".msc") != 0) continue;
+    string path = dir + '/' + e->d_name;
+    struct stat st;
+    if (stat(path.c_str(), &st) < 0) continue;
+    entries.push_back(Entry{move(path), mtime_ns(st), uint64_t(st.st_size)});
+    total += st.st_size;
+  }
+  closedir(d);
+  if (entries.size() <= CACHE_MAX_ENTRIES && total <= CACHE_MAX_BYTES) return;
+
+  sort(entries.begin(), entries.end(), [](const Entry &a, const Entry &b) { return a.used < b.used; });
+  size_t left = entries.size();
+  for (const Entry &e : entries) {
+    if (left <= CACHE_MAX_ENTRIES && total <= CACHE_MAX_BYTES) break;
+    if (unlink(e.path.c_str()) == 0) {
+      left--;
+      total -= e.bytes;
+    }
+  }
+}
+
+template <class T> static void append(string &buf, const T &v) {
+  buf.append(reinterpret_cast<const char *>(&v), sizeof(T));
+}
+
+void script_cache_store(const struct stat &st, const CompiledScript &script) {
+  string dir = cache_dir();
+  uint64_t shell = shell_identity();
+  if (dir.empty() || !shell || time(nullptr) - st.st_mtim.tv_sec < 2) return;
+
+  string body, strings;
+  auto str = [&](const char *s) -> uint32_t {
+    if (!s) return NO_STRING;
+    uint32_t off = strings.size();
+    strings.append(s, strlen(s) + 1);
+    return off;
+  };
+  for (size_t i = 0; i < script.lines.size(); i++) {
+    const CommandLine &line = script.lines[i];
+    LineHeader lh{};
+    lh.argv = line.argv.size();
+    lh.redirs = line.redirs.size();
+    lh.commands = line.commands.size();
+    lh.pipelines = line.pipelines.size();
+    lh.expand = line.argv_expand.size();
+    lh.code = line.code.size();
+    lh.error = line.error.empty() ? NO_STRING : str(line.error.c_str());
+    lh.incomplete = line.incomplete;
+    lh.last = script.last[i];
+    append(body, lh);
+    for (char *a : line.argv) append(body, str(a));
+    for (Redirect rd : line.redirs) {
+      rd.target = reinterpret_cast<const char *>(uintptr_t(str(rd.target)));
+      append(body, rd);
+    }
+    body.append(reinterpret_cast<const char *>(line.commands.data()), line.commands.size() * sizeof(Command));
+    body.append(reinterpret_cast<const char *>(line.pipelines.data()), line.pipelines.size() * sizeof(Pipeline));
+    body.append(reinterpret_cast<const char *>(line.argv_expand.data()), line.argv_expand.size());
+    for (Instr in : line.code) {
+      in.name = reinterpret_cast<const char *>(uintptr_t(str(in.name)));
+      append(body, in);
+    }
+  }
+  if (strings.empty() || strings.back() != '\0') strings += '\0';
+
+  CacheHeader h{};
+  memcpy(h.magic, CACHE_MAGIC, sizeof(CACHE_MAGIC));
+  h.version = CACHE_VERSION;
+  h.line_count = script.lines.size();
+  h.dev = st.st_dev;
+  h.ino = st.st_ino;
+  h.mtime = mtime_ns(st);
+  h.size = st.st_size;
+  h.shell = shell;
+  h.strings = sizeof(h) + body.size();
+  h.file_size = h.strings + strings.size();
+
+  // ~/.cache/myshell/scripts, each level as needed
+  for (size_t slash = dir.find('/', 1); slash != string::npos; slash = dir.find('/', slash + 1)) {
+    mkdir(dir.substr(0, slash).c_str(), 0700);
+  }
+  mkdir(dir.c_str(), 0700);
+
+  // written aside and renamed in, so a reader sees all of it or none
+  string path = entry_path(dir, st);
+  string tmp = path + ".tmp" + to_string(getpid());
+  int fd = open(tmp.c_str(), O_WRONLY | O_CREAT | O_TRUNC | O_CLOEXEC, 0600);
+  if (fd < 0) return;
+  string whole;
+  whole.reserve(h.file_size);
+  append(whole, h);
+  whole += body;
+  whole += strings;
+  bool ok = true;
+  for (size_t done = 0; ok && done < whole.size();) {
+    ssize_t n = write(fd, whole.data() + done, whole.size() - done);
+    if (n < 0 && errno == EINTR) continue;
+    ok = n > 0;
+    done += ok ? n : 0;
+  }
+  close(fd);
+  if (!ok || rename(tmp.c_str(), path.c_str()) < 0) {
+    unlink(tmp.c_str());
+    return;
+  }
+  evict(dir);
+}
@@ -0,0 +1,264 @@
+#include "trace.h"
+#include <algorithm>
+#include <cerrno>
+#include <cstdio>
+#include <cstdlib>
+#include <cstring>
+#include <fcntl.h>
+#include <sys/syscall.h>
+#include <unistd.h>
+using namespace std;
+
+bool trace_enabled = false;
+atomic<uint64_t> trace_counters[COUNTER_COUNT];
+
+static const char *const phase_names[PHASE_COUNT] = {
+  "parse", "check", "resolve", "redirect", "spawn", "fork", "exec", "wait", "builtin", "glob", "cache",
+};
+static const char *const counter_names[COUNTER_COUNT] = {"forks", "spawns", "execs", "stats", "pipes"};
+
+// ---- event ring -----------------------------------------------------------
+// writers claim a slot with one fetch_add and publish it by storing its
+// sequence number last; a reader takes a slot only if the number is the one
+// it expects before and after copying, so an overwritten slot is skipped
+// rather than torn
+
+struct TraceEvent {
+  atomic<uint64_t> seq; // claim index + 1 once written, 0 while being written
+  uint64_t start, dur;
+  uint32_t tid;
+  uint8_t phase;
+  char detail[35];
+};
+static_assert(sizeof(TraceEvent) == 64, "one event per cache line");
+
+static const size_t RING_SIZE = size_t(1) << 16; // 4 MiB, allocated on first use
+static TraceEvent *ring = nullptr;
+static atomic<uint64_t> ring_head{0};
+
+// ---- histograms -----------------------------------------------------------
+// log-linear: four buckets per power of two, so a percentile is off by at
+// most a quarter of its magnitude. 0-3 ns get a bucket each
+
+static const size_t BUCKETS = 64 * 4;
+
+struct Histogram {
+  atomic<uint64_t> buckets[BUCKETS];
+  atomic<uint64_t> count, max;
+};
+static Histogram histograms[PHASE_COUNT];
+
+static size_t bucket_of(uint64_t ns) {
+  if (ns < 4) return ns;
+  unsigned e = 63 - __builtin_clzll(ns);
+  return e * 4 + ((ns >> (e - 2)) & 3);
+}
+
+// largest value that lands in bucket b
+static uint64_t bucket_top(size_t b) {
+  if (b < 4) return b;
+  unsigned e = b / 4;
+  uint64_t low = uint64_t(4 + b % 4) << (e - 2);
+  return low + (uint64_t(1) << (e - 2)) - 1;
+}
+
+static uint32_t thread_id() {
+  static thread_local uint32_t tid = syscall(SYS_gettid);
+  return tid;
+}
+
+void trace_record(TracePhase phase, uint64_t start, uint64_t end, const char *detail) {
+  uint64_t dur = end - start;
+  Histogram &h = histograms[phase];
+  h.buckets[bucket_of(dur)].fetch_add(1, memory_order_relaxed);
+  h.count.fetch_add(1, memory_order_relaxed);
+  uint64_t seen = h.max.load(memory_order_relaxed);
+  while (dur > seen && !h.max.compare_exchange_weak(seen, dur, memory_order_relaxed)) {}
+
+  if (!ring) return;
+  uint64_t i = ring_head.fetch_add(1, memory_order_relaxed);
+  TraceEvent &e = ring[i & (RING_SIZE - 1)];
+  e.seq.store(0, memory_order_relaxed);
+  atomic_thread_fence(memory_order_release);
+  e.start = start;
+  e.dur = dur;
+  e.tid = thread_id();
+  e.phase = phase;
+  size_t n = 0;
+  if (detail) {
+    while (n < sizeof(e.detail) - 1 && detail[n]) {
+      e.detail[n] = detail[n];
+      n++;
+    }
+  }
+  e.detail[n] = '\0';
+  e.seq.store(i + 1, memory_order_release);
+}
+
+void trace_set(bool on) {
+  if (on && !ring) ring = new TraceEvent[RING_SIZE]();
+  trace_enabled = on;
+}
+
+void trace_clear() {
+  if (ring) {
+    for (size_t i = 0; i < RING_SIZE; i++) ring[i].seq.store(0, memory_order_relaxed);
+  }
+  ring_head = 0;
+  for (Histogram &h : histograms) {
+    for (auto &b : h.buckets) b.store(0, memory_order_relaxed);
+    h.count = 0;
+    h.max = 0;
+  }
+}
+
+void trace_reset_counters() {
+  for (auto &c : trace_counters) c.store(0, memory_order_relaxed);
+}
+
+// ---- output ---------------------------------------------------------------
+
+static void json_string(string &out, const char *s) {
+  out += '"';
+  for (; *s; s++) {
+    unsigned char c = *s;
+    if (c == '"' || c == '\\') {
+      out += '\\';
+      out += c;
+    } else if (c < 0x20) {
+      char esc[8];
+      snprintf(esc, sizeof(esc), "\\u%04x", c);
+      out += esc;
+    } else {
+      out += c;
+    }
+  }
+  out += '"';
+}
+
+string trace_json() {
+  string out = "{\"displayTimeUnit\":\"ns\",\"traceEvents\":[";
+  bool first = true;
+  char num[128];
+  int pid = getpid();
+  uint64_t end = ring ? ring_head.load(memory_order_acquire) : 0;
+  for (uint64_t i = end > RING_SIZE ? end - RING_SIZE : 0; i < end; i++) {
+    TraceEvent &slot = ring[i & (RING_SIZE - 1)];
+    if (slot.seq.load(memory_order_acquire) != i + 1) continue;
+    uint64_t start = slot.start, dur = slot.dur;
+    uint32_t tid = slot.tid;
+    uint8_t phase = slot.phase;
+    char detail[sizeof(slot.detail)];
+    memcpy(detail, slot.detail, sizeof(detail));
+    atomic_thread_fence(memory_order_acquire);
+    if (slot.seq.load(memory_order_relaxed) != i + 1) continue; // lapped while copying
+    detail[sizeof(detail) - 1] = '\0';
+
+    if (!first) out += ',';
+    first = false;
+    // Chrome wants microseconds; keep the nanoseconds as decimals
+    snprintf(num, sizeof(num), "\n{\"name\":\"%s\",\"cat\":\"shell\",\"ph\":\"X\",\"ts\":%llu.%03llu,\"dur\":%llu.%03llu,",
+             phase_names[phase], (unsigned long long)(start / 1000), (unsigned long long)(start % 1000),
+             (unsigned long long)(dur / 1000), (unsigned long long)(dur % 1000));
+    out += num;
+    snprintf(num, sizeof(num), "\"pid\":%d,\"tid\":%u", pid, tid);
+    out += num;
+    if (detail[0]) {
+      out += ",\"args\":{\"detail\":";
+      json_string(out, detail);
+      out += '}';
+    }
+    out += '}';
+  }
+  out += "\n]}\n";
+  return out;
+}
+
+bool trace_dump(const string &path) {
+  int fd = open(path.c_str(), O_WRONLY | O_CREAT | O_TRUNC | O_CLOEXEC, 0644);
+  if (fd < 0) return false;
+  string json = trace_json();
+  string_view rest = json;
+  while (!rest.empty()) {
+    ssize_t n = write(fd, rest.data(), rest.size());
+    if (n < 0) {
+      if (errno == EINTR) continue;
+      int saved = errno;
+      close(fd);
+      errno = saved;
+      return false;
+    }
+    rest.remove_prefix(n);
+  }
+  return close(fd) == 0;
+}
+
+static string exit_path;
+static pid_t exit_owner; // forked children inherit the atexit hook, not the dump
+
+void trace_dump_at_exit() {
+  if (exit_path.empty() || getpid() != exit_owner) return;
+  if (!trace_dump(exit_path)) perror(exit_path.c_str());
+  exit_path.clear(); // once: an exec that fails still ends in exit()
+}
+
+void trace_init() {
+  const char *env = getenv("MYSHELL_TRACE");
+  if (!env || !*env) return;
+  // %p is the pid, so nested shells don't overwrite each other's dumps
+  exit_path = env;
+  size_t at = exit_path.find("%p");
+  if (at != string::npos) exit_path.replace(at, 2, to_string(getpid()));
+  exit_owner = getpid();
+  trace_set(true);
+  atexit(trace_dump_at_exit);
+}
+
+static string duration(uint64_t ns) {
+  char buf[32];
+  if (ns < 1000) snprintf(buf, sizeof(buf), "%lluns", (unsigned long long)ns);
+  else if (ns < 1000000) snprintf(buf, sizeof(buf), "%.1fus", ns / 1e3);
+  else if (ns < 1000000000) snprintf(buf, sizeof(buf), "%.1fms", ns / 1e6);
+  else snprintf(buf, sizeof(buf), "%.2fs", ns / 1e9);
+  return buf;
+}
+
+// the value below which a fraction q of the samples fall, to bucket precision
+static uint64_t percentile(const Histogram &h, uint64_t count, double q) {
+  uint64_t rank = max<uint64_t>(1, uint64_t(q * count + 0.5)), seen = 0;
+  for (size_t b = 0; b < BUCKETS; b++) {
+    seen += h.buckets[b].load(memory_order_relaxed);
+    if (seen >= rank) return min(bucket_top(b), h.max.load(memory_order_relaxed));
+  }
+  return h.max.load(memory_order_relaxed);
+}
+
+string trace_stats_text() {
+  string out;
+  char line[128];
+  bool any = false;
+  for (size_t p = 0; p < PHASE_COUNT; p++) {
+    const Histogram &h = histograms[p];
+    uint64_t count = h.count.load(memory_order_relaxed);
+    if (count == 0) continue;
+    if (!any) {
+      snprintf(line, sizeof(line), "%-10s %8s %10s %10s %10s\n", "phase", "count", "p50", "p99", "max");
+      out += line;
+      any = true;
+    }
+    snprintf(line, sizeof(line), "%-10s %8llu %10s %10s %10s\n", phase_names[p], (unsigned long long)count,
+             duration(percentile(h, count, 0.50)).c_str(), duration(percentile(h, count, 0.99)).c_str(),
+             duration(h.max.load(memory_order_relaxed)).c_str());
+    out += line;
+  }
+  if (!any) out += trace_enabled ? "no spans recorded yet\n" : "tracing is off, `trace on` to time phases\n";
+
+  for (size_t c = 0; c < COUNTER_COUNT; c++) {
+    out += c ? "  " : "";
+    out += counter_names[c];
+    out += ' ';
+    out += to_string(trace_counters[c].load(memory_order_relaxed));
+  }
+  out += '\n';
+  return out;
+}
@@ -1,15 +1,44 @@
 #include "utils.h"
+#include "completion.h"
+#include "trace.h"
+#include "vars.h"
 #include <iostream>
 #include <sstream>
 #include <cstdlib>
+#include <fcntl.h>
+#include <unistd.h>
+#include <sys/stat.h>
+#include <sys/wait.h>
 using namespace std;
 
-vector<Job> jobs;
 struct termios shell_tmodes;
-vector<string> builtins = {"cd", "exit", "echo", "pwd", "type", "history", "jobs"};
-deque<string> manual_history_list;
 const size_t MAX_HISTORY = 500;
-size_t history_count = 0;
+bool interactive = true;
+int last_status = 0;
+
+static vector<bool> shell_fds; // by descriptor number
+
+int shell_fd(int fd) {
+  if (fd < 0) return fd;
+  if (fd < SHELL_FD_BASE) {
+    int moved = fcntl(fd, F_DUPFD_CLOEXEC, SHELL_FD_BASE);
+    if (moved >= 0) {
+      close(fd);
+      fd = moved;
+    }
+  }
+  if (size_t(fd) >= shell_fds.size()) shell_fds.resize(fd + 1);
+  shell_fds[fd] = true;
+  return fd;
+}
+
+void shell_fd_close(int fd) {
+  if (fd < 0) return;
+  if (size_t(fd) < shell_fds.size()) shell_fds[fd] = false;
+  close(fd);
+}
+
+bool is_shell_fd(int fd) { return fd >= 0 && size_t(fd) < shell_fds.size() && shell_fds[fd]; }
 
 bool peek(const string &s, int (*f)(int), size_t pos) {
   if (pos + 1 < s.size()) {
@@ -27,68 +56,161 @@ bool peek(const string &s, bool (*f)(char), size_t pos) {
   return false;
 }
 
-fs::path find_in_path(string s) {
+// command hash: name -> resolved path, like bash's `hash`.
+// entries remember which PATH dir they came from so a change in that
+// dir's mtime (file added/removed) drops them, and the whole table is
+// thrown away when $PATH itself changes
+struct PathDir {
+  string dir;
+  struct timespec mtime;
+  bool mtime_known;
+};
+
+unordered_map<string, HashEntry> command_hash;
+static vector<PathDir> path_dirs;
+static string hashed_path_env;
+static bool path_synced = false;
+
+static bool dir_mtime(const string &dir, struct timespec &out) {
+  struct stat st;
+  trace_count(CountStats);
+  if (stat(dir.c_str(), &st) < 0) return false;
+  out = st.st_mtim;
+  return true;
+}
+
+static bool same_time(const struct timespec &a, const struct timespec &b) {
+  return a.tv_sec == b.tv_sec && a.tv_nsec == b.tv_nsec;
+}
+
+// rebuild the dir list only when $PATH differs from the one we hashed against
+static void sync_path_dirs() {
+  const char *path_env = var_get("PATH");
+  string cur = path_env ? path_env : "";
+  if (path_synced && cur == hashed_path_env) return;
+
+  hashed_path_env = cur;
+  path_synced = true;
+  command_hash.clear();
+  path_dirs.clear();
+
+  size_t start = 0;
+  while (start <= cur.size()) {
+    size_t end = cur.find(':', start);
+    if (end == string::npos) end = cur.size();
+    if (end > start) path_dirs.push_back({cur.substr(start, end - start), {}, false});
+    start = end + 1;
+  }
+}
+
+// drop every entry resolved from dir i (its contents changed under us)
+static void forget_dir(size_t i) {
+  for (auto it = command_hash.begin(); it != command_hash.end();) {
+    if (it->second.dir_index == i) it = command_hash.erase(it);
+    else ++it;
+  }
+}
+
+static bool is_executable_file(const string &p) {
+  struct stat st;
+  trace_count(CountStats);
+  if (stat(p.c_str(), &st) < 0) return false;
+  return S_ISREG(st.st_mode) && (st.st_mode & (S_IXUSR | S_IXGRP | S_IXOTH));
+}
+
+void hash_reset() {
+  exec_index_reset();
+  command_hash.clear();
+  path_dirs.clear();
+  hashed_path_env.clear();
+  path_synced = false;
+}
+
+fs::path find_in_path(const string &s) {
+  TraceSpan span(PhaseResolve, s.c_str());
   if (!s.empty() && s[0] == '~') {
-    const char* home = getenv("HOME");
+    const char* home = var_get("HOME");
     if (home) {
       // replace ~ with home dir path
-      fs::path expanded_path = fs::path(home) / s.substr(1 == s.size() ? 1 : 2); 
-      
+      fs::path expanded_path;
       if (s == "~") expanded_path = fs::path(home);
       else expanded_path = fs::path(home) / s.substr(2);
 
+      trace_count(CountStats, 2);
       if (fs::exists(expanded_path) && fs::is_regular_file(expanded_path)) {
         return expanded_path;
       }
     }
   }
-  // handle both absolute and relative paths
+  // handle both absolute and relative paths, these never go through the hash
   if (s.find('/') != string::npos) {
+      trace_count(CountStats, 2);
       if (fs::exists(s) && fs::is_regular_file(s)) { // ensure its not a directory
           return fs::path(s);
       }
       return fs::path{};
   }
+  if (s.empty()) return fs::path{};
+
+  sync_path_dirs();
+
+  // fast path: one stat on the dir the command came from instead of
+  // walking all of $PATH
+  auto hit = command_hash.find(s);
+  if (hit != command_hash.end()) {
+    PathDir &d = path_dirs[hit->second.dir_index];
+    struct timespec now;
+    if (dir_mtime(d.dir, now) && d.mtime_known && same_time(now, d.mtime)) {
+      hit->second.hits++;
+      return hit->second.path;
+    }
+    // dir changed (or vanished), everything hashed from it is suspect
+    forget_dir(hit->second.dir_index);
+    d.mtime_known = false;
+  }
 
-  // 2. Get the current PATH environment variable
-  const char *path_env = getenv("PATH");
-  if (!path_env) return fs::path{};
+  // the completion index usually knows where it is, and checks that the
+  // dirs involved haven't changed since it looked. not that it's nowhere:
+  // chmod +x leaves the dir's mtime alone, so a miss still walks PATH
+  long where = exec_index_lookup(hashed_path_env, s);
+  if (where >= 0 && (size_t)where < path_dirs.size()) {
+    string full_path = path_dirs[where].dir + "/" + s;
+    if (is_executable_file(full_path)) {
+      PathDir &d = path_dirs[where];
+      if (!d.mtime_known) d.mtime_known = dir_mtime(d.dir, d.mtime);
+      command_hash[s] = HashEntry{fs::path(full_path), (size_t)where, 1};
+      return full_path;
+    }
+  }
 
-  string path_str(path_env);
-  stringstream ss(path_str);
-  string dir;
+  // slow path: walk PATH in order, one stat per candidate
+  for (size_t i = 0; i < path_dirs.size(); i++) {
+    string full_path = path_dirs[i].dir + "/" + s;
+    if (!is_executable_file(full_path)) continue;
 
-  // iterate through each dir in path
-  while (getline(ss, dir, ':')) {
-    if (dir.empty()) continue; // skip empty entries
-
-    try {
-      fs::path full_path = fs::path(dir) / s;
-
-      // check if file exists and is executable
-      if (fs::exists(full_path)) {
-        auto perms = fs::status(full_path).permissions();
-        if ((perms & fs::perms::owner_exec) != fs::perms::none ||
-            (perms & fs::perms::group_exec) != fs::perms::none ||
-            (perms & fs::perms::others_exec) != fs::perms::none) {
-          return full_path;
-        }
-      }
-    } catch (...) {
-      // ignore directories we don't have permission to read
-      continue;
-    }
+    PathDir &d = path_dirs[i];
+    if (!d.mtime_known) d.mtime_known = dir_mtime(d.dir, d.mtime);
+    command_hash[s] = HashEntry{fs::path(full_path), i, 1};
+    return full_path;
   }
 
   return fs::path{};
 }
 
-void chdir_logic(string dir) {
+int exit_code(int status) {
+  if (WIFEXITED(status)) return WEXITSTATUS(status);
+  if (WIFSIGNALED(status)) return 128 + WTERMSIG(status);
+  if (WIFSTOPPED(status)) return 128 + WSTOPSIG(status);
+  return 0;
+}
+
+// returns an error message for the caller to report, empty on success
+string chdir_logic(const string &dir) {
   string expanded_dir = dir;
 
   // tilde expansion logic
   if (!dir.empty() && dir[0] == '~') {
-    const char *home = getenv("HOME");
+    const char *home = var_get("HOME");
     if (home) {
       if (dir == "~") {
         expanded_dir = home;
@@ -102,14 +224,13 @@ void chdir_logic(string dir) {
     if (fs::exists(expanded_dir)) {
       if (fs::is_directory(expanded_dir)) {
         fs::current_path(expanded_dir);
-      } else {
-        cout << "cd: " << dir << ": Not a directory" << endl;
+        return "";
       }
-    } else {
-      cout << "cd: " << dir << ": No such file or directory" << endl;
+      return "cd: " + dir + ": Not a directory";
     }
+    return "cd: " + dir + ": No such file or directory";
   } catch (const fs::filesystem_error& e) {
     // handle permission errors or other FS issues
-    cout << "cd: " << dir << ": Permission denied" << endl;
+    return "cd: " + dir + ": Permission denied";
   }
-}
\ No newline at end of file
+}
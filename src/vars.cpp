@@ -0,0 +1,114 @@
+#include "vars.h"
+#include <algorithm>
+#include <cstring>
+#include <unordered_map>
+using namespace std;
+
+extern char **environ;
+
+// entry is the whole "NAME=value", so an exported variable goes into envp
+// as a pointer to it without any copying
+struct Var {
+  string entry;
+  bool exported;
+  bool set; // false: only `export NAME` so far
+};
+
+static unordered_map<string, Var> vars;
+static vector<char *> envp_cache{nullptr};
+static bool envp_dirty = true;
+
+bool valid_var_name(string_view name) {
+  if (name.empty() || (name[0] >= '0' && name[0] <= '9')) return false;
+  for (char c : name) {
+    if (!(c == '_' || (c >= 'a' && c <= 'z') || (c >= 'A' && c <= 'Z') || (c >= '0' && c <= '9'))) return false;
+  }
+  return true;
+}
+
+void vars_init() {
+  for (char **e = environ; *e; e++) {
+    const char *eq = strchr(*e, '=');
+    if (!eq) continue;
+    string name(*e, eq - *e);
+    vars[name] = Var{*e, true, true};
+  }
+  envp_dirty = true;
+}
+
+const char *var_get(string_view name) {
+  auto it = vars.find(string(name));
+  if (it == vars.end() || !it->second.set) return nullptr;
+  return it->second.entry.c_str() + name.size() + 1;
+}
+
+void var_set(string_view name, string_view value) {
+  Var &v = vars[string(name)];
+  v.entry.assign(name);
+  v.entry += '=';
+  v.entry += value;
+  v.set = true;
+  if (v.exported) envp_dirty = true;
+}
+
+void var_unset(string_view name) {
+  auto it = vars.find(string(name));
+  if (it == vars.end()) return;
+  if (it->second.exported) envp_dirty = true;
+  vars.erase(it);
+}
+
+void var_export(string_view name) {
+  Var &v = vars[string(name)];
+  if (v.entry.empty()) v.entry = string(name) + "=";
+  if (!v.exported && v.set) envp_dirty = true;
+  v.exported = true;
+}
+
+bool var_assign(string_view assignment) {
+  size_t eq = assignment.find('=');
+  if (eq == string_view::npos || !valid_var_name(assignment.substr(0, eq))) return false;
+  var_set(assignment.substr(0, eq), assignment.substr(eq + 1));
+  return true;
+}
+
+char *const *var_envp() {
+  if (envp_dirty) {
+    envp_cache.clear();
+    for (auto &[name, v] : vars) {
+      if (v.exported && v.set) envp_cache.push_back(v.entry.data());
+    }
+    envp_cache.push_back(nullptr);
+    envp_dirty = false;
+  }
+  return envp_cache.data();
+}
+
+// "NAME=..." starts with name followed by '='
+static bool names(const char *entry, string_view name) {
+  return strncmp(entry, name.data(), name.size()) == 0 && entry[name.size()] == '=';
+}
+
+vector<char *> env_overlay(char *const *assigns, size_t count) {
+  vector<char *> env;
+  char *const *base = var_envp();
+  env.reserve(envp_cache.size() + count);
+  for (size_t i = 0; i < count; i++) env.push_back(assigns[i]);
+  for (char *const *e = base; *e; e++) {
+    bool shadowed = false;
+    for (size_t i = 0; i < count && !shadowed; i++) {
+      string_view a = assigns[i];
+      shadowed = names(*e, a.substr(0, a.find('=')));
+    }
+    if (!shadowed) env.push_back(*e);
+  }
+  env.push_back(nullptr);
+  return env;
+}
+
+vector<pair<string, bool>> var_names() {
+  vector<pair<string, bool>> out;
+  for (auto &[name, v] : vars) out.push_back({name, v.exported});
+  sort(out.begin(), out.end());
+  return out;
+}